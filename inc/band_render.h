@@ -0,0 +1,95 @@
+#ifndef BAND_RENDER_H
+#define BAND_RENDER_H
+
+#include <stdint.h>
+#include "draw_fractal.h"
+#include "fractal_params.h"
+
+#define BANDS_IN_FLIGHT 2 // one band renders while the previous one is written
+
+// Images too big for memory are rendered as horizontal bands of the full width, top to bottom.
+// Each band is a FractalBuffer_t of its own, the kernel wrapper below puts its samples where they are in the full image.
+typedef struct BandCFG {
+    Fractal inner;
+    void *inner_cfg;
+    double offset_y; // kernel y of the band's center in the full image
+} BandCFG;
+
+uint32_t band_kernel(double x, double y, BandCFG *cfg, const atomic_bool *cancel, SampleInfo_t *info, OrbitState_t *orbit) {
+    // the band has the full image's width, so x and the y scale are the same as in the full image
+    return cfg->inner(x, y + cfg->offset_y, cfg->inner_cfg, cancel, info, orbit);
+}
+
+// called with every finished band in order, rows y0 to y0 + band->height of the full image. Returns false to stop.
+typedef bool (*BandSink)(Image *band, uint32_t y0, void *ctx);
+
+// Rows per band so that the bands in flight stay within budget bytes, whole tile rows where possible.
+// Every per-sample buffer of a band counts, band_start doesn't enable sample info or orbit states, so that's the image,
+// iters and flags, plus the row the sink converts to RGB.
+uint32_t band_rows_for_budget(uint32_t width, uint64_t budget) {
+    uint64_t row_bytes = (uint64_t)width * fractal_buffer_sample_bytes(false, false);
+    uint64_t rows = budget > (uint64_t)width * 3 ? (budget - (uint64_t)width * 3) / (row_bytes * BANDS_IN_FLIGHT) : 0;
+    if(rows > RENDER_TILE_SIZE) { rows -= rows % RENDER_TILE_SIZE; }
+    return rows > 0 ? rows : 1;
+}
+
+typedef struct RenderBand_t {
+    uint32_t y0;
+    FractalBuffer_t *buf;
+    RenderJob_t *job;
+    BandCFG cfg;
+} RenderBand_t;
+
+void band_start(RenderBand_t *band, RenderPool_t *pool, FractalSetup_t *setup, RenderOptions_t opts, uint32_t width, uint32_t height, uint32_t y0, uint32_t rows) {
+    if(y0 + rows > height) { rows = height - y0; }
+    band->y0 = y0;
+    band->buf = fractal_buffer_create(width, rows);
+    band->cfg = (BandCFG) {
+        .inner = fractal_setup_fn(setup),
+        .inner_cfg = fractal_setup_cfg(setup),
+        .offset_y = (y0 + rows / 2.0 - height / 2.0) * 4.0 / width
+    };
+    band->job = DrawFractal_threaded_start(pool, band->buf, (Fractal) &band_kernel, &band->cfg, 1, PASS_SAMPLE, opts, 0.0, 0.0, NULL, 0);
+}
+
+// Render rows first_row to height of a width x height image in bands of band_rows and hand them to sink in order.
+// Returns false if sink stopped the render.
+bool band_render(RenderPool_t *pool, FractalSetup_t *setup, RenderOptions_t opts, uint32_t width, uint32_t height, uint32_t first_row, uint32_t band_rows, BandSink sink, void *ctx) {
+    // the next band queues behind the current one
+    opts.queue_last = true;
+    RenderBand_t bands[BANDS_IN_FLIGHT];
+    uint32_t n_bands = 0;
+    uint32_t next_row = first_row;
+    for(; n_bands < BANDS_IN_FLIGHT && next_row < height; ++n_bands, next_row += band_rows) {
+        band_start(&bands[n_bands], pool, setup, opts, width, height, next_row, band_rows);
+    }
+
+    bool ok = true;
+    uint64_t kernel_calls = 0;
+    double start_ms = render_time_ms();
+    for(uint32_t i = 0; i < n_bands; ++i) {
+        RenderBand_t *band = &bands[i % BANDS_IN_FLIGHT];
+        if(ok) {
+            DrawFractal_threaded_wait(band->job);
+            kernel_calls += band->job->kernel_calls;
+            DrawFractal_threaded_end(band->job);
+            ok = sink(band->buf->image, band->y0, ctx);
+        } else {
+            // the band's config lives in bands, it has to be out of the render threads before returning
+            DrawFractal_threaded_stop(band->job);
+            DrawFractal_threaded_end(band->job);
+        }
+        fractal_buffer_release(band->buf);
+        if(ok && next_row < height) {
+            band_start(band, pool, setup, opts, width, height, next_row, band_rows);
+            next_row += band_rows;
+            ++n_bands;
+        }
+    }
+
+    double ms = render_time_ms() - start_ms;
+    printf("bands: rows %u to %u in %.2f ms, %" PRIu64 " samples computed\n", first_row, height, ms, kernel_calls);
+    return ok;
+}
+
+#endif // BAND_RENDER_H
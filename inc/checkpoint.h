@@ -0,0 +1,153 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "draw_fractal.h"
+#include "mandelbrot.h"
+
+// Checkpoint of a single frame render: the reference orbit and the iteration count and PIX_* flags of every pixel,
+// written while the render goes on. Resuming loads the pixels back into the buffer, the render then skips the tiles
+// whose samples are all known and only computes the samples that are missing.
+//
+//   CheckpointHeader_t
+//   ref_iterations doubles of the reference orbit's real parts, then as many imaginary parts
+//   width * height uint8_t PIX_* flags
+//   width * height uint32_t iteration counts
+//   width * height SampleInfo_t if has_info
+
+#define CHECKPOINT_MAGIC "GMPFCKP1"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_CHUNK 65536 // samples staged at a time while the counts and info are written
+
+typedef struct CheckpointHeader_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t ref_iterations; // 0 if the kernel has no reference orbit
+    uint64_t hash; // params_hash of the location
+    uint32_t has_info; // 1 if the buffer's SampleInfo_t are included
+    uint32_t reserved;
+} CheckpointHeader_t;
+
+// Write the checkpoint to path, replacing the previous one only once it's complete.
+// The buffer may be rendered into meanwhile. Every sample is taken as its flags show it (fractal_buffer_flags), so
+// it's either complete or left out. Guesses are the only samples that change while known, the verify pass may be
+// recomputing one, they're written with their count as an estimate (fractal_buffer_set_estimated).
+bool checkpoint_write(const char *path, uint64_t hash, FractalBuffer_t *buf, const RefIter *ref) {
+    CheckpointHeader_t h = {
+        .version = CHECKPOINT_VERSION,
+        .width = buf->image->width,
+        .height = buf->image->height,
+        .ref_iterations = ref != NULL ? ref->iterations : 0,
+        .hash = hash,
+        .has_info = buf->info != NULL ? 1 : 0,
+        .reserved = 0
+    };
+    memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+    size_t n = (size_t)h.width * h.height;
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    uint8_t *flags = malloc(n);
+    // large enough for a chunk of either counts or info
+    void *stage = malloc(CHECKPOINT_CHUNK * sizeof(SampleInfo_t));
+    bool ok = f != NULL && flags != NULL && stage != NULL;
+    if(ok) {
+        ok = fwrite(&h, sizeof(h), 1, f) == 1
+            && (ref == NULL || (fwrite(ref->re, sizeof(double), h.ref_iterations, f) == h.ref_iterations
+                                && fwrite(ref->im, sizeof(double), h.ref_iterations, f) == h.ref_iterations));
+        // the flags are taken first, the counts and info only of the samples known by then
+        for(size_t i = 0; i < n; ++i) {
+            flags[i] = fractal_buffer_flags(buf, i) & (PIX_KNOWN | PIX_FILLED | PIX_GUESSED);
+        }
+        ok = ok && fwrite(flags, 1, n, f) == n;
+        for(size_t i0 = 0; i0 < n && ok; i0 += CHECKPOINT_CHUNK) {
+            size_t m = n - i0 < CHECKPOINT_CHUNK ? n - i0 : CHECKPOINT_CHUNK;
+            uint32_t *iters = stage;
+            for(size_t i = 0; i < m; ++i) {
+                iters[i] = (flags[i0 + i] & PIX_KNOWN) ? fractal_buffer_iter(buf, i0 + i) : 0;
+            }
+            ok = fwrite(iters, sizeof(uint32_t), m, f) == m;
+        }
+        for(size_t i0 = 0; buf->info != NULL && i0 < n && ok; i0 += CHECKPOINT_CHUNK) {
+            size_t m = n - i0 < CHECKPOINT_CHUNK ? n - i0 : CHECKPOINT_CHUNK;
+            SampleInfo_t *info = stage;
+            for(size_t i = 0; i < m; ++i) {
+                size_t idx = i0 + i;
+                if(!(flags[idx] & PIX_KNOWN)) {
+                    info[i] = (SampleInfo_t) {0.0f, 0, 0.0f};
+                } else if(flags[idx] & PIX_GUESSED) {
+                    info[i] = (SampleInfo_t) {.smooth = (float)fractal_buffer_iter(buf, idx), .flags = SAMPLE_ESTIMATED};
+                } else {
+                    info[i] = buf->info[idx];
+                }
+            }
+            ok = fwrite(info, sizeof(SampleInfo_t), m, f) == m;
+        }
+        ok = ok && fflush(f) == 0 && fdatasync(fileno(f)) == 0;
+    }
+    if(f != NULL) {
+        ok = fclose(f) == 0 && ok;
+        // replaced in one go, a crash leaves either the old or the new checkpoint
+        ok = ok && rename(tmp, path) == 0;
+    }
+    free(flags);
+    free(stage);
+    if(!ok) {
+        printf("writing checkpoint %s failed\n", path);
+        remove(tmp);
+    }
+    return ok;
+}
+
+// a checkpoint read back by checkpoint_read
+typedef struct Checkpoint_t {
+    double *ref_re, *ref_im; // NULL without a reference orbit
+    FractalBuffer_t *buf;
+} Checkpoint_t;
+
+// Read the checkpoint at path if it's one of the location with that hash at width x height.
+// Returns false if there's none or it doesn't match.
+bool checkpoint_read(const char *path, uint64_t hash, uint32_t width, uint32_t height, Checkpoint_t *c) {
+    FILE *f = fopen(path, "rb");
+    if(f == NULL) { return false; }
+    CheckpointHeader_t h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) == 0
+        && h.version == CHECKPOINT_VERSION && h.hash == hash && h.width == width && h.height == height;
+    if(!ok) {
+        printf("checkpoint %s is of a different render\n", path);
+        fclose(f);
+        return false;
+    }
+    size_t n = (size_t)width * height;
+    c->ref_re = NULL;
+    c->ref_im = NULL;
+    if(h.ref_iterations > 0) {
+        c->ref_re = malloc(h.ref_iterations * sizeof(double));
+        c->ref_im = malloc(h.ref_iterations * sizeof(double));
+        ok = fread(c->ref_re, sizeof(double), h.ref_iterations, f) == h.ref_iterations
+            && fread(c->ref_im, sizeof(double), h.ref_iterations, f) == h.ref_iterations;
+    }
+    c->buf = fractal_buffer_create(width, height);
+    if(h.has_info) {
+        fractal_buffer_enable_info(c->buf);
+    }
+    ok = ok && fread(c->buf->flags, 1, n, f) == n && fread(c->buf->iters, sizeof(uint32_t), n, f) == n
+        && (!h.has_info || fread(c->buf->info, sizeof(SampleInfo_t), n, f) == n);
+    fclose(f);
+    if(!ok) {
+        printf("checkpoint %s is incomplete\n", path);
+        free(c->ref_re);
+        free(c->ref_im);
+        fractal_buffer_release(c->buf);
+        *c = (Checkpoint_t) {NULL, NULL, NULL};
+    }
+    return ok;
+}
+
+#endif // CHECKPOINT_H
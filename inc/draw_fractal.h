@@ -1,15 +1,98 @@
+#ifndef DRAW_FRACTAL_H
+#define DRAW_FRACTAL_H
+
 #include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
 #include "raylib.h"
 #include "pthread.h"
 
 #define MAX_ITER 100
 
-typedef uint32_t (*Fractal)(double x, double y, void* cfg);
+// What a fractal function knows about a sample besides its iteration count. Callers that want it pass one in,
+// otherwise info is NULL and the function skips the extra work.
+typedef struct SampleInfo_t {
+    float smooth; // continuous escape iteration (count plus fraction), the iteration cap for points inside
+    uint8_t flags; // SAMPLE_*
+    float distance; // exterior distance estimate to the set in kernel units (4 across the image width), 0 inside or unknown
+} SampleInfo_t;
+
+#define SAMPLE_GLITCH 0x01 // the perturbed orbit got close to the reference's precision limit
+#define SAMPLE_ESTIMATED 0x02 // filled or guessed by the renderer instead of computed
+
+// Where the orbit of a sample stopped at the iteration cap, so a higher cap can continue from there instead of from 0.
+// Kernels without a way to continue leave it alone and start over.
+typedef struct OrbitState_t {
+    double re, im; // z, or dz relative to the reference orbit for perturbation
+    double der_re, der_im; // derivative of z by the kernel's x/y, only kept up to date by kernels that were given info
+    uint32_t iteration; // iterations done, 0 for a fresh orbit
+    uint32_t ref_iteration; // position in the reference orbit for perturbation
+} OrbitState_t;
+
+// Fractal functions return the escape iteration, UINT32_MAX if the point didn't escape.
+// Long running ones poll cancel (which may be NULL) every CANCEL_CHECK_INTERVAL iterations and return ITER_CANCELLED once it's set.
+// If orbit isn't NULL the function continues from it and leaves the state there for points that didn't escape.
+typedef uint32_t (*Fractal)(double x, double y, void* cfg, const atomic_bool *cancel, SampleInfo_t *info, OrbitState_t *orbit);
+
+#define ITER_CANCELLED (UINT32_MAX - 1)
+#define CANCEL_CHECK_INTERVAL 1024 // power of 2
 
 Color colorMap(uint32_t iter) {
+    if(iter == UINT32_MAX) { return BLACK; } // inside the set
     return ColorFromHSV((float) ((iter * 5) % 360), 1., 1.);
 }
 
+typedef enum {
+    PALETTE_HSV, // colorMap
+    PALETTE_GRAY, // black to white and back every 64 iterations
+    PALETTE_FIRE, // black, red, yellow, white every 256 iterations
+    N_PALETTES
+} Palette_t;
+
+const char *PALETTE_NAMES[N_PALETTES] = {"hsv", "gray", "fire"};
+
+Color paletteColor(Palette_t palette, uint32_t iter) {
+    if(iter == UINT32_MAX) { return BLACK; } // inside the set
+    switch(palette) {
+    case PALETTE_GRAY: {
+        uint32_t t = (iter * 8) % 512;
+        unsigned char v = t < 256 ? t : 511 - t;
+        return (Color) {v, v, v, 255};
+    }
+    case PALETTE_FIRE: {
+        uint32_t t = (iter * 3) % 768;
+        if(t < 256) { return (Color) {t, 0, 0, 255}; }
+        if(t < 512) { return (Color) {255, t - 256, 0, 255}; }
+        return (Color) {255, 255, t - 512, 255};
+    }
+    default:
+        return colorMap(iter);
+    }
+}
+
+// palette color at a fractional (smooth) iteration count, blended between the colors of the iterations around it
+Color paletteColorSmooth(Palette_t palette, uint32_t iter, float smooth) {
+    if(iter == UINT32_MAX) { return BLACK; } // inside the set
+    if(!(smooth > 0.0f)) { smooth = 0.0f; }
+    uint32_t i0 = (uint32_t)smooth;
+    float t = smooth - i0;
+    Color c0 = paletteColor(palette, i0);
+    Color c1 = paletteColor(palette, i0 + 1);
+    return (Color) {
+        (unsigned char)(c0.r + (c1.r - c0.r) * t + 0.5f),
+        (unsigned char)(c0.g + (c1.g - c0.g) * t + 0.5f),
+        (unsigned char)(c0.b + (c1.b - c0.b) * t + 0.5f),
+        255
+    };
+}
+
 void DrawFractal(Image *image, Fractal fractal, void* cfg) {
     int32_t width = image->width;
     int32_t height = image->height;
@@ -19,7 +102,7 @@ void DrawFractal(Image *image, Fractal fractal, void* cfg) {
             // re/im range -2 to 2
             double re = ((float) x - (float)width / 2) * 2. / (float)width;
             double im = ((float) y - (float)height / 2) * 2. / (float)width;
-            int iter = fractal(re, im, cfg);
+            uint32_t iter = fractal(re, im, cfg, NULL, NULL, NULL);
             if(iter != UINT32_MAX) {
                 ImageDrawPixel(image, x, y, colorMap(iter));
                 // a
@@ -28,79 +111,1002 @@ void DrawFractal(Image *image, Fractal fractal, void* cfg) {
     }
 }
 
-typedef struct RenderThreadSync_t {
+#define RENDER_TILE_SIZE 32 // edge length of the tiles handed to render threads, in lattice samples
+#define RENDER_WAIT_POLL_NS 1000000 // 1 ms, how often DrawFractal_threaded_wait checks the job
+#define ADAPTIVE_MIN_TILE 4 // adaptive tiles this small are rendered sample by sample instead of subdivided
+
+// per pixel flags of the renderer's sample buffer
+#define PIX_KNOWN 0x01 // iteration count is valid
+#define PIX_FILLED 0x02 // iteration count was filled in from a uniform tile border instead of computed
+#define PIX_GUESSED 0x04 // iteration count was guessed from the coarser lattice, cleared once verified
+#define PIX_PREVIEW 0x08 // colour was resampled from the previous view, iteration count isn't valid
+#define PIX_ORBIT 0x10 // the buffer's orbits hold where the sample stopped at the iteration cap
+#define PIX_AA 0x20 // colour is the average of the sample and its antialias sub-samples
+
+#define AA_MAX_SAMPLES 64 // most sub-samples RenderOptions_t.antialias may ask for per pixel
+
+typedef enum {
+    PASS_SAMPLE, // compute (or fill/guess) the unknown samples on the lattice
+    PASS_VERIFY, // recompute guessed samples that border a sample with a different iteration count
+    PASS_ANTIALIAS, // supersample the pixels that border a pixel with a different iteration count, step 1 only
+} RenderPass_t;
+
+// order in which tiles are handed to the render threads
+typedef enum {
+    TILE_ORDER_ROWS, // top to bottom
+    TILE_ORDER_SPIRAL, // spiral outwards from the centre of the image
+    TILE_ORDER_HILBERT, // along a Hilbert curve, neighbouring tiles render close together in time
+    TILE_ORDER_CURSOR, // nearest to the focus point (e.g. the mouse cursor) first
+    N_TILE_ORDERS
+} TileOrder_t;
+
+const char *TILE_ORDER_NAMES[N_TILE_ORDERS] = {"rows", "spiral", "hilbert", "cursor"};
+
+typedef struct RenderOptions_t {
+    bool adaptive; // trace tile borders and fill uniform tiles instead of computing every sample (Mariani-Silver)
+    bool guess; // guess samples whose neighbours on the coarser lattice all share the same iteration count
+    TileOrder_t order;
+    Palette_t palette;
+    bool queue_last; // queue the tiles under the waiting tiles of other jobs instead of on top, so jobs finish first come first served
+    bool sample_info; // renderer_startRender keeps the SampleInfo_t of every sample in the buffer
+    bool keep_orbits; // renderer_startRender keeps the orbit state of samples that didn't escape, see renderer_raiseIterations
+    uint32_t antialias; // sub-samples a PASS_ANTIALIAS render takes per pixel at most (4 to AA_MAX_SAMPLES), 0: off
+    uint32_t aa_threshold; // neighbouring iteration counts further apart than this get antialiased
+} RenderOptions_t;
+
+// monotonic clock for render timing
+double render_time_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+}
+
+// rectangle of lattice samples, end exclusive
+typedef struct RenderTile_t {
+    uint32_t x0, y0, x1, y1;
+} RenderTile_t;
+
+// rectangle of image pixels, end exclusive
+typedef struct PixelRect_t {
+    uint32_t x0, y0, x1, y1;
+} PixelRect_t;
+
+// Pixel buffers of a render, shared by the renderer and the jobs writing into it.
+// Reference counted so a cancelled job that's still finishing a sample never writes into a buffer that got reused.
+typedef struct FractalBuffer_t {
+    Image *image; // image to write into
+    uint32_t *iters; // iteration count of each pixel, only lattice samples are written
+    uint8_t *flags; // PIX_* flags of each pixel
+    SampleInfo_t *info; // sample info of each pixel, NULL unless enabled with fractal_buffer_enable_info
+    OrbitState_t *orbits; // orbit state of each PIX_ORBIT pixel, NULL unless enabled with fractal_buffer_enable_orbits
+    atomic_int refs;
+    atomic_int jobs; // jobs rendering into the buffer, including cancelled ones that are still finishing a tile
+
+    pthread_mutex_t dirty_mtx; // guards the dirty list, render threads add to it while the UI takes from it
+    PixelRect_t *dirty; // regions of image that changed since the last fractal_buffer_take_dirty
+    uint32_t n_dirty, dirty_cap;
+} FractalBuffer_t;
+
+FractalBuffer_t* fractal_buffer_create(uint32_t width, uint32_t height) {
+    FractalBuffer_t *buf = malloc(sizeof(FractalBuffer_t));
+    buf->image = malloc(sizeof(Image));
+    *buf->image = GenImageColor(width, height, BLACK);
+    buf->iters = malloc((size_t)width * height * sizeof(uint32_t));
+    buf->flags = calloc((size_t)width * height, sizeof(uint8_t));
+    buf->info = NULL;
+    buf->orbits = NULL;
+    atomic_init(&buf->refs, 1);
+    atomic_init(&buf->jobs, 0);
+    pthread_mutex_init(&(buf->dirty_mtx), NULL);
+    buf->dirty = NULL;
+    buf->n_dirty = 0;
+    buf->dirty_cap = 0;
+    return buf;
+}
+
+FractalBuffer_t* fractal_buffer_retain(FractalBuffer_t *buf) {
+    atomic_fetch_add(&buf->refs, 1);
+    return buf;
+}
+
+void fractal_buffer_release(FractalBuffer_t *buf) {
+    if(atomic_fetch_sub(&buf->refs, 1) != 1) { return; }
+    UnloadImage(*buf->image);
+    free(buf->image);
+    free(buf->iters);
+    free(buf->flags);
+    free(buf->info);
+    free(buf->orbits);
+    pthread_mutex_destroy(&(buf->dirty_mtx));
+    free(buf->dirty);
+    free(buf);
+}
+
+// Wait until no job renders into the buffer anymore. Cancelled jobs stop within CANCEL_CHECK_INTERVAL iterations.
+void fractal_buffer_wait_jobs(FractalBuffer_t *buf) {
+    while(atomic_load(&buf->jobs) > 0) {
+        sched_yield();
+    }
+}
+
+// memory a FractalBuffer_t takes per sample: image, iters and flags, plus the info and orbit state if they're enabled
+size_t fractal_buffer_sample_bytes(bool info, bool orbits) {
+    return sizeof(Color) + sizeof(uint32_t) + sizeof(uint8_t) + (info ? sizeof(SampleInfo_t) : 0) + (orbits ? sizeof(OrbitState_t) : 0);
+}
+
+// keep the SampleInfo_t of every sample from now on, for raw output
+void fractal_buffer_enable_info(FractalBuffer_t *buf) {
+    if(buf->info != NULL) { return; }
+    buf->info = calloc((size_t)buf->image->width * buf->image->height, sizeof(SampleInfo_t));
+}
+
+// keep the orbit state of samples that don't escape from now on, so they can be continued with a higher iteration cap
+void fractal_buffer_enable_orbits(FractalBuffer_t *buf) {
+    if(buf->orbits != NULL) { return; }
+    buf->orbits = malloc((size_t)buf->image->width * buf->image->height * sizeof(OrbitState_t));
+}
+
+// colour every known pixel from its iteration count, e.g. after the counts were loaded from a file
+void fractal_buffer_redraw(FractalBuffer_t *buf, Palette_t palette) {
+    Color *pixels = (Color*)buf->image->data;
+    size_t n = (size_t)buf->image->width * buf->image->height;
+    for(size_t i = 0; i < n; ++i) {
+        if(buf->flags[i] & PIX_KNOWN) {
+            pixels[i] = paletteColor(palette, buf->iters[i]);
+        }
+    }
+}
+
+// Samples are read by other threads while they're being rendered, e.g. the neighbours of a tile by the verify pass.
+// A sample's flags are stored last, with release, once its count, info and colour are in place, and loaded with
+// acquire, so a sample flagged PIX_KNOWN is complete. Counts change while a sample is known (a guess that got
+// verified), they're accessed atomically as well.
+uint8_t fractal_buffer_flags(const FractalBuffer_t *buf, size_t idx) {
+    return __atomic_load_n(&buf->flags[idx], __ATOMIC_ACQUIRE);
+}
+
+void fractal_buffer_publish(FractalBuffer_t *buf, size_t idx, uint8_t flags) {
+    __atomic_store_n(&buf->flags[idx], flags, __ATOMIC_RELEASE);
+}
+
+uint32_t fractal_buffer_iter(const FractalBuffer_t *buf, size_t idx) {
+    return __atomic_load_n(&buf->iters[idx], __ATOMIC_RELAXED);
+}
+
+void fractal_buffer_set_iter(FractalBuffer_t *buf, size_t idx, uint32_t iter) {
+    __atomic_store_n(&buf->iters[idx], iter, __ATOMIC_RELAXED);
+}
+
+void fractal_buffer_mark_dirty(FractalBuffer_t *buf, PixelRect_t rect) {
+    pthread_mutex_lock(&(buf->dirty_mtx));
+    if(buf->n_dirty == buf->dirty_cap) {
+        buf->dirty_cap = buf->dirty_cap ? buf->dirty_cap * 2 : 64;
+        buf->dirty = realloc(buf->dirty, buf->dirty_cap * sizeof(PixelRect_t));
+    }
+    buf->dirty[buf->n_dirty++] = rect;
+    pthread_mutex_unlock(&(buf->dirty_mtx));
+}
+
+// move up to max dirty rects into out, returns how many were taken
+uint32_t fractal_buffer_take_dirty(FractalBuffer_t *buf, PixelRect_t *out, uint32_t max) {
+    pthread_mutex_lock(&(buf->dirty_mtx));
+    uint32_t n = buf->n_dirty < max ? buf->n_dirty : max;
+    buf->n_dirty -= n;
+    memcpy(out, &buf->dirty[buf->n_dirty], n * sizeof(PixelRect_t));
+    pthread_mutex_unlock(&(buf->dirty_mtx));
+    return n;
+}
+
+struct RenderJob_t;
+
+// tile of a job waiting in the pool
+typedef struct QueuedTile_t {
+    struct RenderJob_t *job;
+    RenderTile_t tile;
+} QueuedTile_t;
+
+// where the render threads run
+typedef struct RenderPlacement_t {
+    uint32_t n_threads; // 0: one per usable CPU
+    bool pin; // pin every render thread to one CPU
+    bool skip_smt; // only use the first hardware thread of every physical core
+    uint32_t reserved_cpus; // usable CPUs kept free for the UI/coordinator threads, taken from the end of the affinity mask
+} RenderPlacement_t;
+
+struct RenderPool_t;
+
+// State of one render thread. Each thread allocates its own once it runs on its CPU,
+// so first touch puts it on the thread's NUMA node.
+typedef struct RenderWorker_t {
+    struct RenderPool_t *pool;
+    uint32_t index;
+    int cpu; // -1 if not pinned
+    int node; // NUMA node of cpu, -1 if unknown
+    // only touched by the thread itself
+    uint64_t tiles;
+    uint64_t kernel_calls;
+} RenderWorker_t;
+
+// Persistent render threads, shared by all jobs. Threads only exit when the pool is destroyed.
+typedef struct RenderPool_t {
     uint32_t n_threads;
     pthread_t *tid; // thread IDs for render threads
-    pthread_mutex_t mtx; // mutex for grabbing image rows without race conditions (and setting/reading cancel condition)
-    Image *image; // image to write into
-    uint32_t row_idx; // stores the next available row for a thread to grab
+    RenderWorker_t *launch; // what each thread starts its RenderWorker_t from
+    cpu_set_t reserved; // CPUs left to the UI/coordinator threads
+    uint32_t n_reserved;
+    pthread_mutex_t mtx; // guards the tile stack and the bookkeeping of all jobs in the pool
+    pthread_cond_t cv; // signalled when tiles are pushed or the pool shuts down
+
+    QueuedTile_t *tiles; // stack of tiles waiting for a thread
+    uint32_t n_tiles, tiles_cap;
+    uint32_t live_jobs; // jobs that haven't been freed yet, including cancelled ones that are still finishing a tile
+    bool shutdown;
+} RenderPool_t;
+
+// One render pass over a buffer. Started by DrawFractal_threaded_start, then either finished
+// (check_threaded_render_status says done, free it with DrawFractal_threaded_end) or handed to DrawFractal_threaded_cancel.
+typedef struct RenderJob_t {
+    RenderPool_t *pool;
+    FractalBuffer_t *buf;
+    uint32_t step; // lattice spacing in pixels, each sample fills a step x step block
+    RenderPass_t pass;
+    RenderOptions_t opts;
 
     Fractal fractal; // pointer to fractal function
     void* fractal_cfg; // configuration for fractal function (stores zoom, x/y center, and other params depending on fractal function)
-    bool cancel; // set to true to cancel render
-} RenderThreadSync_t;
+    atomic_bool cancel; // polled by the fractal function, once set nothing more gets written into buf
+
+    // guarded by pool->mtx
+    bool orphaned; // cancelled, whichever thread finishes the last tile frees the job
+    uint32_t pending; // tiles waiting or being rendered, the render is done once this hits 0
+    uint64_t done_samples, total_samples; // for progress reporting
+    uint64_t kernel_calls; // number of samples that were actually computed
+    uint64_t guessed; // number of samples guessed instead of computed
+    uint64_t corrected; // number of guessed samples the verify pass found to be wrong
+    double start_ms, first_tile_ms, end_ms; // render_time_ms() at start, when the first tile finished (0 before) and when the last did
+} RenderJob_t;
 
 typedef void* (*render_thread_t)(void* arg);
 
-void* render_thread(RenderThreadSync_t *sync) {
-    int width = sync->image->width;
-    int height = sync->image->height;
-    while(1) {
-        // acquire row
-        if(pthread_mutex_lock(&(sync->mtx))) { return NULL; }
-        int32_t row_idx = sync->row_idx;
-        ++(sync->row_idx);
-        bool cancel = sync->cancel;
-        pthread_mutex_unlock(&(sync->mtx));
-        // exit thread early
-        if(cancel) { return NULL; }
-
-        // check if done
-        if(row_idx >= height) { break; }
-        else {
-            // fractal drawing loop
-            for(int32_t x = 0; x < width; ++x) {
-                // re/im range -2 to 2
-                double re = ((float)x + 0.5 - (float)width / 2) * 4. / (float)width; // +0.5 centers pixel on coordinate
-                double im = ((float)row_idx + 0.5 - (float)height / 2) * 4. / (float)width; // to keep image from moving when resolution changes
-                int iter = sync->fractal(re, im, sync->fractal_cfg);
-                if(iter != UINT32_MAX) {
-                    ImageDrawPixel(sync->image, x, row_idx, colorMap(iter));
+// number of lattice samples along an image edge for the given step
+uint32_t lattice_size(uint32_t pixels, uint32_t step) {
+    return (pixels + step - 1) / step;
+}
+
+bool render_job_cancelled(RenderJob_t *job) {
+    return atomic_load_explicit(&job->cancel, memory_order_relaxed);
+}
+
+// push tiles of a job for the render threads to pick up, on top of the stack or under all waiting tiles if last is set.
+// Caller must hold the pool mutex.
+void push_tiles(RenderPool_t *pool, RenderJob_t *job, RenderTile_t *tiles, uint32_t n, bool last) {
+    if(pool->n_tiles + n > pool->tiles_cap) {
+        pool->tiles_cap = (pool->n_tiles + n) * 2;
+        pool->tiles = realloc(pool->tiles, pool->tiles_cap * sizeof(QueuedTile_t));
+    }
+    QueuedTile_t *dst = &pool->tiles[pool->n_tiles];
+    if(last) {
+        memmove(&pool->tiles[n], pool->tiles, pool->n_tiles * sizeof(QueuedTile_t));
+        dst = pool->tiles;
+    }
+    for(uint32_t i = 0; i < n; ++i) {
+        dst[i] = (QueuedTile_t) {job, tiles[i]};
+    }
+    pool->n_tiles += n;
+    job->pending += n;
+    pthread_cond_broadcast(&(pool->cv));
+}
+
+// free a job nobody is rendering anymore. Caller must hold the pool mutex.
+void render_job_free(RenderJob_t *job) {
+    --(job->pool->live_jobs);
+    // everything the job wrote is in place before the buffer's owner sees it gone
+    atomic_fetch_sub(&job->buf->jobs, 1);
+    fractal_buffer_release(job->buf);
+    free(job);
+}
+
+// true if the pixel rect overlaps one of the regions
+bool rect_overlaps(PixelRect_t rect, const PixelRect_t *regions, uint32_t n_regions) {
+    for(uint32_t i = 0; i < n_regions; ++i) {
+        if(rect.x0 < regions[i].x1 && regions[i].x0 < rect.x1 && rect.y0 < regions[i].y1 && regions[i].y0 < rect.y1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// true if every sample of the tile is known already
+bool tile_known(RenderJob_t *job, RenderTile_t t) {
+    int width = job->buf->image->width;
+    for(uint32_t sy = t.y0; sy < t.y1; ++sy) {
+        for(uint32_t sx = t.x0; sx < t.x1; ++sx) {
+            if(!(job->buf->flags[(size_t)sy * job->step * width + sx * job->step] & PIX_KNOWN)) { return false; }
+        }
+    }
+    return true;
+}
+
+// Draw the step x step block of the sample at pixel (x, y). Other pixels of the block that are known already or hold
+// a preview keep their colour, they get their own sample later.
+void draw_sample_block(FractalBuffer_t *buf, uint32_t x, uint32_t y, uint32_t step, Color c) {
+    Image *image = buf->image;
+    Color *pixels = (Color*)image->data;
+    pixels[(size_t)y * image->width + x] = c;
+    uint32_t x1 = x + step < (uint32_t)image->width ? x + step : (uint32_t)image->width;
+    uint32_t y1 = y + step < (uint32_t)image->height ? y + step : (uint32_t)image->height;
+    for(uint32_t py = y; py < y1; ++py) {
+        for(uint32_t px = x; px < x1; ++px) {
+            size_t idx = (size_t)py * image->width + px;
+            if(buf->flags[idx] & (PIX_KNOWN | PIX_PREVIEW)) { continue; }
+            pixels[idx] = c;
+        }
+    }
+}
+
+// sample info of a sample the renderer filled in without computing it
+void fractal_buffer_set_estimated(FractalBuffer_t *buf, size_t idx, uint32_t iter) {
+    if(buf->info == NULL) { return; }
+    buf->info[idx] = (SampleInfo_t) {.smooth = (float)iter, .flags = SAMPLE_ESTIMATED};
+}
+
+// fractal coordinates of the image point (fx, fy), in pixels from the top left corner of the image
+void image_to_fractal(int width, int height, double fx, double fy, double *re, double *im) {
+    // re/im range -2 to 2
+    *re = (fx - width / 2.0) * 4. / width;
+    *im = (fy - height / 2.0) * 4. / width; // to keep image from moving when resolution changes
+}
+
+// Compute the sample at pixel (x, y), store it and draw its block.
+// Returns ITER_CANCELLED without storing anything if the job got cancelled meanwhile. A job cancelled right after
+// the check still stores its sample, the buffer's owner waits for that with fractal_buffer_wait_jobs before reusing it.
+uint32_t compute_sample(RenderJob_t *job, uint32_t x, uint32_t y, uint64_t *kernel_calls) {
+    int width = job->buf->image->width;
+    int height = job->buf->image->height;
+    size_t idx = (size_t)y * width + x;
+
+    double re, im;
+    image_to_fractal(width, height, x + 0.5, y + 0.5, &re, &im); // +0.5 centers pixel on coordinate
+    // a sample that stopped at a lower iteration cap continues where it was, keeping what its info said so far
+    bool resumed = job->buf->orbits != NULL && (job->buf->flags[idx] & PIX_ORBIT);
+    OrbitState_t orbit = resumed ? job->buf->orbits[idx] : (OrbitState_t) {0.0, 0.0, 0.0, 0.0, 0, 0};
+    SampleInfo_t info = resumed && job->buf->info != NULL ? job->buf->info[idx] : (SampleInfo_t) {0.0f, 0, 0.0f};
+    uint32_t iter = job->fractal(re, im, job->fractal_cfg, &(job->cancel), job->buf->info != NULL ? &info : NULL,
+                                 job->buf->orbits != NULL ? &orbit : NULL);
+    ++(*kernel_calls);
+    // results of stale jobs are dropped
+    if(iter == ITER_CANCELLED || render_job_cancelled(job)) { return ITER_CANCELLED; }
+
+    fractal_buffer_set_iter(job->buf, idx, iter);
+    if(job->buf->info != NULL) {
+        job->buf->info[idx] = info;
+    }
+    uint8_t flags = PIX_KNOWN;
+    if(job->buf->orbits != NULL && iter == UINT32_MAX) {
+        job->buf->orbits[idx] = orbit;
+        flags |= PIX_ORBIT;
+    }
+    // fill the whole block, finer passes overwrite it with their own samples
+    draw_sample_block(job->buf, x, y, job->step, paletteColor(job->opts.palette, iter));
+    fractal_buffer_publish(job->buf, idx, flags);
+    return iter;
+}
+
+// Guess the sample at pixel (x, y) from its neighbours on the next coarser lattice (2 * step).
+// Returns false if they're not all known or don't share one iteration count.
+bool guess_sample(RenderJob_t *job, uint32_t x, uint32_t y, uint32_t *iter) {
+    int32_t width = job->buf->image->width;
+    int32_t height = job->buf->image->height;
+    int32_t step = job->step;
+    // a coordinate that's an odd multiple of step lies between two coarse samples
+    bool odd_x = (x / step) % 2 == 1;
+    bool odd_y = (y / step) % 2 == 1;
+    if(!odd_x && !odd_y) { return false; } // sample is on the coarse lattice itself
+
+    int32_t dxs[2] = {odd_x ? -step : 0, odd_x ? step : 0};
+    int32_t dys[2] = {odd_y ? -step : 0, odd_y ? step : 0};
+    bool first = true;
+    for(uint32_t i = 0; i < 2; ++i) {
+        for(uint32_t j = 0; j < 2; ++j) {
+            int32_t nx = (int32_t)x + dxs[i];
+            int32_t ny = (int32_t)y + dys[j];
+            if(nx < 0 || ny < 0 || nx >= width || ny >= height) { return false; }
+            size_t nidx = (size_t)ny * width + nx;
+            if(!(fractal_buffer_flags(job->buf, nidx) & PIX_KNOWN)) { return false; }
+            if(first) {
+                *iter = fractal_buffer_iter(job->buf, nidx);
+                first = false;
+            } else if(fractal_buffer_iter(job->buf, nidx) != *iter) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// returns the iteration count of lattice sample (sx, sy), computing (or guessing) and drawing it if it isn't known yet
+uint32_t render_sample(RenderJob_t *job, uint32_t sx, uint32_t sy, uint64_t *kernel_calls, uint64_t *guessed) {
+    uint32_t x = sx * job->step;
+    uint32_t y = sy * job->step;
+    size_t idx = (size_t)y * job->buf->image->width + x;
+    if(job->buf->flags[idx] & PIX_KNOWN) { return job->buf->iters[idx]; }
+
+    uint32_t iter;
+    if(job->opts.guess && guess_sample(job, x, y, &iter)) {
+        ++(*guessed);
+        fractal_buffer_set_iter(job->buf, idx, iter);
+        fractal_buffer_set_estimated(job->buf, idx, iter);
+        draw_sample_block(job->buf, x, y, job->step, paletteColor(job->opts.palette, iter));
+        fractal_buffer_publish(job->buf, idx, PIX_KNOWN | PIX_GUESSED);
+        return iter;
+    }
+    return compute_sample(job, x, y, kernel_calls);
+}
+
+// compute every sample of the tile, returns the number of samples finished
+uint64_t render_tile_full(RenderJob_t *job, RenderTile_t t, uint64_t *kernel_calls, uint64_t *guessed) {
+    for(uint32_t sy = t.y0; sy < t.y1 && !render_job_cancelled(job); ++sy) {
+        for(uint32_t sx = t.x0; sx < t.x1; ++sx) {
+            render_sample(job, sx, sy, kernel_calls, guessed);
+        }
+    }
+    return (uint64_t)(t.x1 - t.x0) * (t.y1 - t.y0);
+}
+
+// Mariani-Silver: trace the tile border, if it has a single iteration count the interior gets filled with it.
+// Otherwise the interior is split in 4 and handed back to the render threads.
+// Returns the number of samples finished.
+uint64_t render_tile_adaptive(RenderJob_t *job, RenderTile_t t, uint64_t *kernel_calls, uint64_t *guessed) {
+    uint32_t w = t.x1 - t.x0;
+    uint32_t h = t.y1 - t.y0;
+    if(w <= ADAPTIVE_MIN_TILE || h <= ADAPTIVE_MIN_TILE) {
+        return render_tile_full(job, t, kernel_calls, guessed);
+    }
+
+    // the whole border has to be computed either way, the sub-tiles only cover the interior
+    uint32_t border_iter = render_sample(job, t.x0, t.y0, kernel_calls, guessed);
+    bool uniform = true;
+    for(uint32_t sx = t.x0; sx < t.x1; ++sx) {
+        uniform &= render_sample(job, sx, t.y0, kernel_calls, guessed) == border_iter;
+        uniform &= render_sample(job, sx, t.y1 - 1, kernel_calls, guessed) == border_iter;
+    }
+    for(uint32_t sy = t.y0 + 1; sy < t.y1 - 1; ++sy) {
+        uniform &= render_sample(job, t.x0, sy, kernel_calls, guessed) == border_iter;
+        uniform &= render_sample(job, t.x1 - 1, sy, kernel_calls, guessed) == border_iter;
+    }
+
+    uint64_t border_samples = (uint64_t)w * h - (uint64_t)(w - 2) * (h - 2);
+    if(render_job_cancelled(job)) { return border_samples; }
+
+    RenderTile_t interior = {t.x0 + 1, t.y0 + 1, t.x1 - 1, t.y1 - 1};
+    int width = job->buf->image->width;
+    uint32_t step = job->step;
+
+    // samples that are already known (e.g. from a coarser pass) have to agree with the border as well
+    for(uint32_t sy = interior.y0; uniform && sy < interior.y1; ++sy) {
+        for(uint32_t sx = interior.x0; sx < interior.x1; ++sx) {
+            size_t idx = (size_t)sy * step * width + sx * step;
+            if((job->buf->flags[idx] & PIX_KNOWN) && job->buf->iters[idx] != border_iter) {
+                uniform = false;
+                break;
+            }
+        }
+    }
+
+    if(uniform) {
+        Color c = paletteColor(job->opts.palette, border_iter);
+        // the border may itself contain guesses, so fills get verified along with them
+        uint8_t fill_flags = PIX_KNOWN | PIX_FILLED | (job->opts.guess ? PIX_GUESSED : 0);
+        for(uint32_t sy = interior.y0; sy < interior.y1; ++sy) {
+            for(uint32_t sx = interior.x0; sx < interior.x1; ++sx) {
+                size_t idx = (size_t)sy * step * width + sx * step;
+                if(job->buf->flags[idx] & PIX_KNOWN) { continue; }
+                fractal_buffer_set_iter(job->buf, idx, border_iter);
+                fractal_buffer_set_estimated(job->buf, idx, border_iter);
+                draw_sample_block(job->buf, sx * step, sy * step, step, c);
+                fractal_buffer_publish(job->buf, idx, fill_flags);
+            }
+        }
+        return (uint64_t)w * h;
+    }
+
+    uint32_t xm = (interior.x0 + interior.x1) / 2;
+    uint32_t ym = (interior.y0 + interior.y1) / 2;
+    RenderTile_t sub[4] = {
+        {interior.x0, interior.y0, xm, ym},
+        {xm, interior.y0, interior.x1, ym},
+        {interior.x0, ym, xm, interior.y1},
+        {xm, ym, interior.x1, interior.y1},
+    };
+    pthread_mutex_lock(&(job->pool->mtx));
+    push_tiles(job->pool, job, sub, 4, false);
+    pthread_mutex_unlock(&(job->pool->mtx));
+
+    return border_samples;
+}
+
+// Recompute the guessed samples of the tile that have a neighbour with a different iteration count,
+// i.e. the edges of guessed regions. Repeats until the tile is stable, returns the number of samples finished.
+uint64_t render_tile_verify(RenderJob_t *job, RenderTile_t t, uint64_t *kernel_calls, uint64_t *corrected) {
+    int32_t width = job->buf->image->width;
+    int32_t height = job->buf->image->height;
+    int32_t step = job->step;
+    const int32_t offsets[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+    bool changed = true;
+    while(changed && !render_job_cancelled(job)) {
+        changed = false;
+        for(uint32_t sy = t.y0; sy < t.y1; ++sy) {
+            for(uint32_t sx = t.x0; sx < t.x1; ++sx) {
+                int32_t x = sx * step;
+                int32_t y = sy * step;
+                size_t idx = (size_t)y * width + x;
+                if(!(job->buf->flags[idx] & PIX_GUESSED)) { continue; }
+
+                // neighbours in other tiles are verified at the same time, see fractal_buffer_flags
+                uint32_t guess = fractal_buffer_iter(job->buf, idx);
+                bool edge = false;
+                for(uint32_t n = 0; n < 4 && !edge; ++n) {
+                    int32_t nx = x + offsets[n][0] * step;
+                    int32_t ny = y + offsets[n][1] * step;
+                    if(nx < 0 || ny < 0 || nx >= width || ny >= height) { continue; }
+                    size_t nidx = (size_t)ny * width + nx;
+                    edge = (fractal_buffer_flags(job->buf, nidx) & PIX_KNOWN) && fractal_buffer_iter(job->buf, nidx) != guess;
                 }
-            } // end for
-        } // end else
+                if(!edge) { continue; }
 
+                uint32_t iter = compute_sample(job, x, y, kernel_calls);
+                if(iter == ITER_CANCELLED) { return 0; }
+                if(iter != guess) {
+                    ++(*corrected);
+                    changed = true;
+                }
+            }
+        }
+    }
+    return (uint64_t)(t.x1 - t.x0) * (t.y1 - t.y0);
+}
+
+// true if the iteration counts are further apart than threshold, a sample that didn't escape differs from any that did
+bool iters_differ(uint32_t a, uint32_t b, uint32_t threshold) {
+    if(a == b) { return false; }
+    if(a == UINT32_MAX || b == UINT32_MAX) { return true; }
+    return (a > b ? a - b : b - a) > threshold;
+}
+
+// Jitter in [0, 1) for coordinate i of the sub-samples of pixel (x, y). Hashed instead of drawn from a random
+// generator, so a view gets the same sub-samples however its tiles are spread over the threads.
+double aa_jitter(uint32_t x, uint32_t y, uint32_t i) {
+    uint32_t h = x * 0x8da6b343u ^ y * 0xd8163841u ^ i * 0xcb1ab31fu;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h / 4294967296.0;
+}
+
+// Add the colours of k x k stratified sub-samples of pixel (x, y) to sum, each jittered within its cell of the pixel.
+// Cells are numbered from first_cell on for the jitter, so grids of the same pixel don't repeat each other's samples.
+// Clears *agree if one of them differs from iter. Returns false if the job got cancelled.
+bool antialias_grid(RenderJob_t *job, uint32_t x, uint32_t y, uint32_t k, uint32_t first_cell, uint32_t iter, double sum[3], uint64_t *kernel_calls, bool *agree) {
+    int width = job->buf->image->width;
+    int height = job->buf->image->height;
+    for(uint32_t gy = 0; gy < k; ++gy) {
+        for(uint32_t gx = 0; gx < k; ++gx) {
+            uint32_t cell = first_cell + gy * k + gx;
+            double re, im;
+            image_to_fractal(width, height, x + (gx + aa_jitter(x, y, 2 * cell)) / k, y + (gy + aa_jitter(x, y, 2 * cell + 1)) / k, &re, &im);
+            uint32_t sub = job->fractal(re, im, job->fractal_cfg, &(job->cancel), NULL, NULL);
+            ++(*kernel_calls);
+            if(sub == ITER_CANCELLED || render_job_cancelled(job)) { return false; }
+            Color c = paletteColor(job->opts.palette, sub);
+            sum[0] += c.r;
+            sum[1] += c.g;
+            sum[2] += c.b;
+            if(iters_differ(sub, iter, job->opts.aa_threshold)) { *agree = false; }
+        }
+    }
+    return true;
+}
+
+// Antialias the pixels of the tile whose iteration count differs from one of their 8 neighbours by more than
+// opts.aa_threshold, flat regions cost nothing. Such a pixel gets 2 x 2 sub-samples first, if one of them differs
+// from the pixel's own count as well a finer grid follows, up to opts.antialias sub-samples in all. The pixel is
+// coloured with the average of its samples and flagged PIX_AA, its iteration count stays that of its center.
+// Step 1 only, returns the number of pixels finished.
+uint64_t render_tile_antialias(RenderJob_t *job, RenderTile_t t, uint64_t *kernel_calls) {
+    int32_t width = job->buf->image->width;
+    int32_t height = job->buf->image->height;
+    Color *pixels = (Color*)job->buf->image->data;
+    uint32_t fine = job->opts.antialias > 4 ? (uint32_t)sqrt(job->opts.antialias - 4) : 0;
+    for(uint32_t y = t.y0; y < t.y1; ++y) {
+        for(uint32_t x = t.x0; x < t.x1; ++x) {
+            size_t idx = (size_t)y * width + x;
+            uint8_t flags = fractal_buffer_flags(job->buf, idx);
+            if((flags & (PIX_KNOWN | PIX_AA)) != PIX_KNOWN) { continue; }
+            uint32_t iter = fractal_buffer_iter(job->buf, idx);
+
+            // neighbours in other tiles get their PIX_AA meanwhile, so their flags are read atomically as well
+            bool edge = false;
+            for(int32_t ny = (int32_t)y - 1; ny <= (int32_t)y + 1 && !edge; ++ny) {
+                for(int32_t nx = (int32_t)x - 1; nx <= (int32_t)x + 1 && !edge; ++nx) {
+                    if(nx < 0 || ny < 0 || nx >= width || ny >= height) { continue; }
+                    size_t nidx = (size_t)ny * width + nx;
+                    edge = (fractal_buffer_flags(job->buf, nidx) & PIX_KNOWN)
+                        && iters_differ(fractal_buffer_iter(job->buf, nidx), iter, job->opts.aa_threshold);
+                }
+            }
+            if(!edge) { continue; }
+
+            Color c = paletteColor(job->opts.palette, iter);
+            double sum[3] = {c.r, c.g, c.b};
+            uint32_t n = 1;
+            bool agree = true;
+            if(!antialias_grid(job, x, y, 2, 0, iter, sum, kernel_calls, &agree)) { return 0; }
+            n += 4;
+            if(!agree && fine >= 2) {
+                if(!antialias_grid(job, x, y, fine, 4, iter, sum, kernel_calls, &agree)) { return 0; }
+                n += fine * fine;
+            }
+            pixels[idx] = (Color) {
+                (unsigned char)(sum[0] / n + 0.5), (unsigned char)(sum[1] / n + 0.5), (unsigned char)(sum[2] / n + 0.5), 255
+            };
+            // only this tile writes the pixel's flags, a store instead of a read-modify-write
+            fractal_buffer_publish(job->buf, idx, flags | PIX_AA);
+        }
+    }
+    return (uint64_t)(t.x1 - t.x0) * (t.y1 - t.y0);
+}
+
+void* render_thread(RenderWorker_t *launch) {
+    RenderWorker_t *worker = aligned_alloc(64, (sizeof(RenderWorker_t) + 63) / 64 * 64);
+    if(worker == NULL) { return NULL; }
+    *worker = *launch;
+    RenderPool_t *pool = worker->pool;
+    while(1) {
+        // acquire tile, the worker goes back to render_pool_destroy either way
+        if(pthread_mutex_lock(&(pool->mtx))) { break; }
+        while(pool->n_tiles == 0 && !pool->shutdown) {
+            pthread_cond_wait(&(pool->cv), &(pool->mtx));
+        }
+        if(pool->shutdown) {
+            pthread_mutex_unlock(&(pool->mtx));
+            break;
+        }
+        QueuedTile_t queued = pool->tiles[--(pool->n_tiles)];
+        pthread_mutex_unlock(&(pool->mtx));
+
+        RenderJob_t *job = queued.job;
+        uint64_t kernel_calls = 0;
+        uint64_t guessed = 0;
+        uint64_t corrected = 0;
+        uint64_t samples = 0;
+        bool skipped = false;
+        if(render_job_cancelled(job)) {
+            // stale tile, drop it
+            skipped = true;
+        } else if(job->pass == PASS_SAMPLE && tile_known(job, queued.tile)) {
+            // nothing new in here, e.g. a tile of a panned view that was fully on screen before
+            samples = (uint64_t)(queued.tile.x1 - queued.tile.x0) * (queued.tile.y1 - queued.tile.y0);
+            skipped = true;
+        } else if(job->pass == PASS_VERIFY) {
+            samples = render_tile_verify(job, queued.tile, &kernel_calls, &corrected);
+        } else if(job->pass == PASS_ANTIALIAS) {
+            samples = job->step == 1 ? render_tile_antialias(job, queued.tile, &kernel_calls) : 0;
+        } else if(job->opts.adaptive) {
+            samples = render_tile_adaptive(job, queued.tile, &kernel_calls, &guessed);
+        } else {
+            samples = render_tile_full(job, queued.tile, &kernel_calls, &guessed);
+        }
+        if(!skipped && (job->pass == PASS_SAMPLE || kernel_calls > 0)) {
+            Image *image = job->buf->image;
+            RenderTile_t t = queued.tile;
+            PixelRect_t rect = {t.x0 * job->step, t.y0 * job->step, t.x1 * job->step, t.y1 * job->step};
+            if(rect.x1 > image->width) { rect.x1 = image->width; }
+            if(rect.y1 > image->height) { rect.y1 = image->height; }
+            fractal_buffer_mark_dirty(job->buf, rect);
+        }
+
+        ++(worker->tiles);
+        worker->kernel_calls += kernel_calls;
+
+        pthread_mutex_lock(&(pool->mtx));
+        job->done_samples += samples;
+        job->kernel_calls += kernel_calls;
+        job->guessed += guessed;
+        job->corrected += corrected;
+        if(job->first_tile_ms == 0.0) {
+            job->first_tile_ms = render_time_ms();
+        }
+        if(--(job->pending) == 0) {
+            job->end_ms = render_time_ms();
+            if(job->orphaned) {
+                render_job_free(job);
+            }
+        }
+        pthread_mutex_unlock(&(pool->mtx));
     } // end while(1)
 
-    return NULL;
+    return worker;
+}
+
+// first number of a sysfs CPU list like "0,32" or "4-5", -1 if it can't be read
+int read_first_cpu(const char *path) {
+    FILE *f = fopen(path, "r");
+    if(f == NULL) { return -1; }
+    int cpu = -1;
+    if(fscanf(f, "%d", &cpu) != 1) { cpu = -1; }
+    fclose(f);
+    return cpu;
 }
 
-// start rendering asynchronously, return a RenderThreadSync_t to control/monitor the rendering.
-RenderThreadSync_t* DrawFractal_threaded_start(Image *image, Fractal fractal, void* cfg, uint32_t threads) {
-    pthread_t *tid = malloc(threads * sizeof(pthread_t));
+// NUMA node of the cpu from sysfs, -1 if unknown
+int cpu_numa_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if(dir == NULL) { return -1; }
+    int node = -1;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(sscanf(entry->d_name, "node%d", &node) == 1) { break; }
+        node = -1;
+    }
+    closedir(dir);
+    return node;
+}
 
-    RenderThreadSync_t *sync = malloc(sizeof(RenderThreadSync_t));
-    
-    sync->fractal = fractal;
-    sync->fractal_cfg = cfg,
-    sync->image = image;
-    sync->row_idx = 0;
-    sync->tid = tid;
-    sync->n_threads = threads;
-    sync->cancel = false;
+// CPUs for render threads: the process' affinity mask, without SMT siblings if asked to and without the reserved CPUs.
+// Returns the number of CPUs written to cpus (at most max), the reserved ones go to reserved.
+uint32_t render_usable_cpus(RenderPlacement_t placement, int *cpus, uint32_t max, cpu_set_t *reserved, uint32_t *n_reserved) {
+    cpu_set_t set;
+    CPU_ZERO(reserved);
+    *n_reserved = 0;
+    if(sched_getaffinity(0, sizeof(set), &set)) {
+        printf("sched_getaffinity failed, assuming a single CPU\n");
+        cpus[0] = -1;
+        return 1;
+    }
+    uint32_t n = 0;
+    for(int cpu = 0; cpu < CPU_SETSIZE && n < max; ++cpu) {
+        if(!CPU_ISSET(cpu, &set)) { continue; }
+        if(placement.skip_smt) {
+            char path[96];
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+            int first = read_first_cpu(path);
+            // another hardware thread of this core is used already
+            if(first >= 0 && first != cpu && CPU_ISSET(first, &set)) { continue; }
+        }
+        cpus[n++] = cpu;
+    }
+    // never reserve everything
+    while(*n_reserved < placement.reserved_cpus && n > 1) {
+        CPU_SET(cpus[--n], reserved);
+        ++(*n_reserved);
+    }
+    return n;
+}
 
-    // printf("w%i h%i\n", sync->image->width, sync->image->height);
+// start the render threads as placed, they wait for jobs
+void render_pool_init(RenderPool_t *pool, RenderPlacement_t placement) {
+    int cpus[CPU_SETSIZE];
+    uint32_t n_cpus = render_usable_cpus(placement, cpus, CPU_SETSIZE, &pool->reserved, &pool->n_reserved);
+    uint32_t threads = placement.n_threads > 0 ? placement.n_threads : n_cpus;
+    printf("%u render threads on %u usable CPUs, %u reserved\n", threads, n_cpus, pool->n_reserved);
 
+    pool->n_threads = threads;
+    pool->tid = malloc(threads * sizeof(pthread_t));
+    pool->launch = malloc(threads * sizeof(RenderWorker_t));
+    pool->tiles = NULL;
+    pool->n_tiles = 0;
+    pool->tiles_cap = 0;
+    pool->live_jobs = 0;
+    pool->shutdown = false;
 
     printf("Created mutex\n");
-    if(pthread_mutex_init(&(sync->mtx), NULL)) {
+    if(pthread_mutex_init(&(pool->mtx), NULL)) {
         printf("failed to create mutex :(\n");
     };
+    pthread_cond_init(&(pool->cv), NULL);
+
+    // unpinned threads float over the usable CPUs, not the whole mask, so they stay off the reserved and skipped ones
+    cpu_set_t usable;
+    CPU_ZERO(&usable);
+    for(uint32_t i = 0; i < n_cpus; ++i) {
+        if(cpus[i] >= 0) { CPU_SET(cpus[i], &usable); }
+    }
 
     for(uint32_t i = 0; i < threads; ++i) {
-        pthread_create(&(sync->tid[i]), NULL, (void* (*)(void*))&render_thread, (void*) sync);
+        // more threads than CPUs share them round robin
+        int cpu = placement.pin ? cpus[i % n_cpus] : -1;
+        pool->launch[i] = (RenderWorker_t) {.pool = pool, .index = i, .cpu = cpu, .node = cpu >= 0 ? cpu_numa_node(cpu) : -1};
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if(cpu >= 0) {
+            // pinned from the start, so everything the thread allocates is local to its node
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            pthread_attr_setaffinity_np(&attr, sizeof(one), &one);
+        } else if(CPU_COUNT(&usable) > 0) {
+            pthread_attr_setaffinity_np(&attr, sizeof(usable), &usable);
+        }
+        pthread_create(&(pool->tid[i]), &attr, (void* (*)(void*))&render_thread, (void*) &pool->launch[i]);
+        pthread_attr_destroy(&attr);
+    }
+}
+
+// Pin the calling thread (and threads it creates afterwards) to the CPUs reserved from the render threads.
+// Returns false if nothing was reserved.
+bool render_pool_pin_reserved(RenderPool_t *pool) {
+    if(pool->n_reserved == 0) { return false; }
+    return pthread_setaffinity_np(pthread_self(), sizeof(pool->reserved), &pool->reserved) == 0;
+}
+
+// stop and join the render threads. Cancel all jobs first, waiting tiles of cancelled jobs are freed here.
+void render_pool_destroy(RenderPool_t *pool) {
+    pthread_mutex_lock(&(pool->mtx));
+    pool->shutdown = true;
+    pthread_cond_broadcast(&(pool->cv));
+    pthread_mutex_unlock(&(pool->mtx));
+
+    // join threads
+    for(uint32_t i = 0; i < pool->n_threads; ++i) {
+        RenderWorker_t *worker = NULL;
+        pthread_join(pool->tid[i], (void**)&worker);
+        if(worker == NULL) { continue; }
+        printf("render thread %u (cpu %d, node %d): %" PRIu64 " tiles, %" PRIu64 " samples computed\n",
+               worker->index, worker->cpu, worker->node, worker->tiles, worker->kernel_calls);
+        free(worker);
+    }
+    free(pool->launch);
+    // no threads left, clean up what they didn't get to
+    for(uint32_t i = 0; i < pool->n_tiles; ++i) {
+        RenderJob_t *job = pool->tiles[i].job;
+        if(--(job->pending) == 0 && job->orphaned) {
+            render_job_free(job);
+        }
+    }
+    // clean up mutex
+    pthread_mutex_destroy(&(pool->mtx));
+    pthread_cond_destroy(&(pool->cv));
+
+    // free allocated memory
+    free(pool->tiles);
+    free(pool->tid);
+}
+
+// index of (x, y) along a Hilbert curve filling an n x n grid, n a power of 2
+uint64_t hilbert_index(uint32_t n, uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for(uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        // rotate the quadrant
+        if(ry == 0) {
+            if(rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            uint32_t t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+typedef struct OrderedTile_t {
+    double key;
+    RenderTile_t tile;
+} OrderedTile_t;
+
+int compare_ordered_tiles(const void *a, const void *b) {
+    double ka = ((const OrderedTile_t*)a)->key;
+    double kb = ((const OrderedTile_t*)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+// Sort key of tile (tx, ty) in a ntx x nty grid, lower keys render first.
+// focus_x/focus_y is the focus point for TILE_ORDER_CURSOR in tile units.
+double tile_order_key(TileOrder_t order, uint32_t tx, uint32_t ty, uint32_t ntx, uint32_t nty, double focus_x, double focus_y) {
+    // tile centre relative to the image centre
+    double dx = tx + 0.5 - ntx / 2.0;
+    double dy = ty + 0.5 - nty / 2.0;
+    switch(order) {
+        case TILE_ORDER_SPIRAL: {
+            // ring around the centre first, then angle within the ring
+            double ring = floor(fmax(fabs(dx), fabs(dy)));
+            double angle = atan2(dy, dx) + M_PI;
+            return ring + angle / (2.0 * M_PI + 1e-9);
+        }
+        case TILE_ORDER_HILBERT: {
+            uint32_t n = 1;
+            while(n < ntx || n < nty) { n *= 2; }
+            return (double)hilbert_index(n, tx, ty);
+        }
+        case TILE_ORDER_CURSOR: {
+            double fx = tx + 0.5 - focus_x;
+            double fy = ty + 0.5 - focus_y;
+            return fx * fx + fy * fy;
+        }
+        case TILE_ORDER_ROWS:
+        default:
+            return (double)ty * ntx + tx;
+    }
+}
+
+// start rendering asynchronously on the pool, return a RenderJob_t to control/monitor the rendering.
+// A PASS_SAMPLE render only computes samples on the step lattice that aren't flagged PIX_KNOWN yet,
+// a PASS_VERIFY render rechecks the edges of guessed regions on that lattice, a PASS_ANTIALIAS render supersamples
+// the edges between iteration counts (step 1 only).
+// Only tiles overlapping one of the n_regions pixel regions are rendered (regions NULL for the whole image).
+// Tiles are handed out in opts.order, (focus_x, focus_y) is the focus point in pixels for TILE_ORDER_CURSOR.
+RenderJob_t* DrawFractal_threaded_start(RenderPool_t *pool, FractalBuffer_t *buf, Fractal fractal, void* cfg, uint32_t step, RenderPass_t pass, RenderOptions_t opts, float focus_x, float focus_y, const PixelRect_t *regions, uint32_t n_regions) {
+    RenderJob_t *job = malloc(sizeof(RenderJob_t));
+
+    job->pool = pool;
+    job->buf = fractal_buffer_retain(buf);
+    atomic_fetch_add(&buf->jobs, 1);
+    job->fractal = fractal;
+    job->fractal_cfg = cfg,
+    job->step = step;
+    job->pass = pass;
+    job->opts = opts;
+    atomic_init(&job->cancel, false);
+
+    job->orphaned = false;
+    job->pending = 0;
+    job->done_samples = 0;
+    job->kernel_calls = 0;
+    job->guessed = 0;
+    job->corrected = 0;
+    job->start_ms = render_time_ms();
+    job->first_tile_ms = 0.0;
+    job->end_ms = 0.0;
+
+    // split the lattice into tiles and sort them by the tile order
+    Image *image = buf->image;
+    uint32_t nx = lattice_size(image->width, step);
+    uint32_t ny = lattice_size(image->height, step);
+    job->total_samples = 0;
+    uint32_t ntx = lattice_size(nx, RENDER_TILE_SIZE);
+    uint32_t nty = lattice_size(ny, RENDER_TILE_SIZE);
+    double tile_pixels = (double)RENDER_TILE_SIZE * step;
+    OrderedTile_t *ordered = malloc((size_t)ntx * nty * sizeof(OrderedTile_t));
+    uint32_t n_ordered = 0;
+    for(uint32_t ty = 0; ty < nty; ++ty) {
+        for(uint32_t tx = 0; tx < ntx; ++tx) {
+            RenderTile_t tile = {
+                tx * RENDER_TILE_SIZE, ty * RENDER_TILE_SIZE,
+                (tx + 1) * RENDER_TILE_SIZE, (ty + 1) * RENDER_TILE_SIZE
+            };
+            if(tile.x1 > nx) { tile.x1 = nx; }
+            if(tile.y1 > ny) { tile.y1 = ny; }
+            PixelRect_t rect = {tile.x0 * step, tile.y0 * step, tile.x1 * step, tile.y1 * step};
+            if(regions != NULL && !rect_overlaps(rect, regions, n_regions)) { continue; }
+            OrderedTile_t *o = &ordered[n_ordered++];
+            o->key = tile_order_key(opts.order, tx, ty, ntx, nty, focus_x / tile_pixels, focus_y / tile_pixels);
+            o->tile = tile;
+            job->total_samples += (uint64_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+        }
+    }
+    qsort(ordered, n_ordered, sizeof(OrderedTile_t), compare_ordered_tiles);
+    // the tiles are a stack, push them last to first
+    RenderTile_t *tiles = malloc((size_t)n_ordered * sizeof(RenderTile_t));
+    for(uint32_t i = 0; i < n_ordered; ++i) {
+        tiles[i] = ordered[n_ordered - 1 - i].tile;
     }
-    return sync;
+    free(ordered);
+
+    pthread_mutex_lock(&(pool->mtx));
+    ++(pool->live_jobs);
+    push_tiles(pool, job, tiles, n_ordered, opts.queue_last);
+    pthread_mutex_unlock(&(pool->mtx));
+    free(tiles);
+
+    return job;
 }
 
 typedef struct RenderThreadStatus_t {
@@ -109,111 +1115,266 @@ typedef struct RenderThreadStatus_t {
 } RenderThreadStatus_t;
 
 // Returns the status (percent and bool for done) of the rendering
-RenderThreadStatus_t check_threaded_render_status(RenderThreadSync_t *sync) {
-    if(sync == NULL) {
-        printf("Attempt to check status of null render thread object\n");
+RenderThreadStatus_t check_threaded_render_status(RenderJob_t *job) {
+    if(job == NULL) {
+        printf("Attempt to check status of null render job\n");
         return (RenderThreadStatus_t) {.done=false, .progress_pct = 0.0};
     }
-    pthread_mutex_lock(&(sync->mtx));
-    uint32_t next_row = sync->row_idx;
-    pthread_mutex_unlock(&(sync->mtx));
-
-
-    // printf("w%i h%i\n", sync->image->width, sync->image->height);
+    pthread_mutex_lock(&(job->pool->mtx));
+    uint32_t pending = job->pending;
+    uint64_t done_samples = job->done_samples;
+    pthread_mutex_unlock(&(job->pool->mtx));
 
     // check if we're done
-    if(next_row == sync->image->height + sync->n_threads) {
+    if(pending == 0) {
         return (RenderThreadStatus_t) {.done=true, .progress_pct = 1.0};
     } else {
-        return (RenderThreadStatus_t) {.done=false, .progress_pct = (float) next_row / (float) sync->image->height};
+        return (RenderThreadStatus_t) {.done=false, .progress_pct = (double) done_samples / (double) job->total_samples};
     }
 }
 
-// called once all threads are done rendering
-void DrawFractal_threaded_end (RenderThreadSync_t *sync) {
-    // join threads
-    for(uint32_t i = 0; i < sync->n_threads; ++i) {
-        pthread_join(sync->tid[i], NULL);
+// Cancel the job without waiting for it. Its waiting tiles are dropped and tiles in progress stop
+// within CANCEL_CHECK_INTERVAL iterations. The pool owns (and eventually frees) the job afterwards.
+void DrawFractal_threaded_cancel(RenderJob_t *job) {
+    atomic_store(&job->cancel, true);
+
+    RenderPool_t *pool = job->pool;
+    pthread_mutex_lock(&(pool->mtx));
+    uint32_t kept = 0;
+    for(uint32_t i = 0; i < pool->n_tiles; ++i) {
+        if(pool->tiles[i].job == job) {
+            --(job->pending);
+        } else {
+            pool->tiles[kept++] = pool->tiles[i];
+        }
     }
-    // clean up mutex
-    pthread_mutex_destroy(&(sync->mtx));
+    pool->n_tiles = kept;
+    if(job->pending == 0) {
+        render_job_free(job);
+    } else {
+        job->orphaned = true;
+    }
+    pthread_mutex_unlock(&(pool->mtx));
+}
 
-    // free allocated memory
-    free(sync->tid);
-    free(sync);
-    return;
+// Block until the job is done. Only for batch renders, the UI never waits on the render threads.
+void DrawFractal_threaded_wait(RenderJob_t *job) {
+    struct timespec poll = {0, RENDER_WAIT_POLL_NS};
+    while(!check_threaded_render_status(job).done) {
+        nanosleep(&poll, NULL);
+    }
+}
+
+// Cancel the job and wait until no render thread uses it anymore, for jobs whose fractal config doesn't outlive
+// the caller. Free it with DrawFractal_threaded_end afterwards.
+void DrawFractal_threaded_stop(RenderJob_t *job) {
+    atomic_store(&job->cancel, true);
+    DrawFractal_threaded_wait(job);
 }
 
+// free a finished job
+void DrawFractal_threaded_end (RenderJob_t *job) {
+    RenderPool_t *pool = job->pool;
+    pthread_mutex_lock(&(pool->mtx));
+    render_job_free(job);
+    pthread_mutex_unlock(&(pool->mtx));
+}
+
+// render the whole image in one go, blocking until done
 void DrawFractal_threaded(Image *image, Fractal fractal, void* cfg, uint32_t threads) {
-    pthread_t *tid = malloc(threads * sizeof(pthread_t));
-
-    RenderThreadSync_t sync = {
-        .fractal = fractal,
-        .fractal_cfg = cfg,
-        .image = image,
-        .row_idx = 0,
-        .tid = tid
-    };
-    pthread_mutex_init(&(sync.mtx), NULL);
+    RenderPool_t pool;
+    render_pool_init(&pool, (RenderPlacement_t) {.n_threads = threads});
+    FractalBuffer_t *buf = fractal_buffer_create(image->width, image->height);
 
-    for(uint32_t i = 0; i < threads; ++i) {
-        pthread_create(&(tid[i]), NULL, (void* (*)(void*))&render_thread, (void*) &sync);
-    }
-    for(uint32_t i = 0; i < threads; ++i) {
-        pthread_join(tid[i], NULL);
+    RenderJob_t *job = DrawFractal_threaded_start(&pool, buf, fractal, cfg, 1, PASS_SAMPLE, (RenderOptions_t) {0}, 0.0, 0.0, NULL, 0);
+    while(!check_threaded_render_status(job).done) {
+        sched_yield();
     }
-    pthread_mutex_destroy(&(sync.mtx));
+    DrawFractal_threaded_end(job);
+    ImageDraw(image, *buf->image, (Rectangle) {0, 0, image->width, image->height}, (Rectangle) {0, 0, image->width, image->height}, WHITE);
 
-    free(tid);
+    fractal_buffer_release(buf);
+    render_pool_destroy(&pool);
 }
 
 typedef enum {
-    IDLE, // no data, no threads
-    RENDERING, // threads running & filling in image
+    IDLE, // nothing rendering
+    RENDERING, // job running & filling in image
     FINISHED, // finished, image ready
 } RendererState_t;
 
 
+// fills in samples of buf that are known from elsewhere (e.g. a cache) before a render job is scheduled on it
+typedef void (*RenderPrefill)(FractalBuffer_t *buf, void *ctx);
+
 // Fractal renderer
 // API:
-// renderer_init(...) -> create and set up renderer
-// renderer_startRender(...) -> create image and start render threads
+// renderer_init(...) -> create and set up renderer, starts the render threads
+// renderer_destroy(...) -> cancel any render and stop the render threads
+// renderer_startRender(...) -> (re)allocate image if needed and start a render job for one lattice step
+// renderer_startVerify(...) -> recheck the edges of guessed regions at the last step, repeat until last_corrected is 0
+// renderer_startAntialias(...) -> supersample the pixels along edges between iteration counts, after the step 1 render
+// renderer_reset(...) -> forget previously rendered samples, next render starts from scratch
+// renderer_raiseIterations(...) -> after raising the iteration cap, render only the samples that didn't escape again
+// renderer_pan(...) -> shift the result by whole pixels and render only the exposed strips
+// renderer_zoom(...) -> resample the result into a zoomed view as a preview, keeping samples that line up exactly
 // renderer_progress(...) -> return progress (bool done/progress 0-1)
+// renderer_cancel(...) -> stop the current render without waiting for the render threads
+// renderer_wait(...) -> wait until cancelled renders are out of the result, the other calls do that themselves
+// renderer_stop(...) -> stop the current render and wait until the render threads are out of it
 // renderer_update(...) -> call repeatedly from UI thread to update status and see when the render is done.
-//                         Once the render is finished this call will close out and clean up the render threads.'
+//                         Once the render is finished this call will clean up the job. Never blocks on the render threads.
 // renderer_getResultImage(...) -> returns a pointer
+// renderer_takeDirty(...) -> regions of the result image that changed since the last call
 typedef struct FractalRenderer_t {
     void* fractal_cfg;
     Fractal fractal_fn;
 
     RendererState_t state;
 
-    RenderThreadSync_t *thread_sync; // only valid while in RENDERING state
+    RenderPool_t pool;
+    RenderJob_t *job; // only valid while in RENDERING state
+
+    FractalBuffer_t *buf; // result, shared by all lattice steps of a progressive render
+    uint32_t step; // lattice step of the current/last render
+    RenderPass_t pass; // kind of the current/last render
+    bool complete; // the last render ran to the end, no holes left on its lattice
+    RenderOptions_t opts; // turn off to compare against full rendering
+    float focus_x, focus_y; // focus point in image pixels for TILE_ORDER_CURSOR
+    RenderPrefill prefill; // called before every PASS_SAMPLE job, NULL for none
+    void *prefill_ctx;
+
+    // stats of the last finished render
+    uint64_t last_kernel_calls;
+    uint64_t last_corrected;
+    double last_render_ms;
 
     uint32_t n_threads;
 } FractalRenderer_t;
 
-void renderer_init(FractalRenderer_t *r, Fractal fractal, void* cfg, uint32_t threads) {
+void renderer_init(FractalRenderer_t *r, Fractal fractal, void* cfg, RenderPlacement_t placement) {
     r->fractal_fn = fractal;
     r->fractal_cfg = cfg;
     r->state = IDLE;
-    r->n_threads = threads;
-    r->thread_sync = NULL;
+    render_pool_init(&r->pool, placement);
+    r->n_threads = r->pool.n_threads;
+    r->job = NULL;
+    r->buf = NULL;
+    r->step = 1;
+    r->pass = PASS_SAMPLE;
+    r->opts = (RenderOptions_t) {.adaptive = false, .guess = false, .order = TILE_ORDER_SPIRAL};
+    r->focus_x = 0.0;
+    r->focus_y = 0.0;
+    r->prefill = NULL;
+    r->prefill_ctx = NULL;
+    r->last_kernel_calls = 0;
+    r->last_corrected = 0;
+    r->last_render_ms = 0.0;
+}
+
+// Wait until the cancelled jobs of the renderer are out of its buffer. Anything that reuses, copies or replaces the
+// buffer or changes the fractal config waits for this first, so a sample of a cancelled job never lands in a later
+// render. The renderer's calls do it themselves.
+void renderer_wait(FractalRenderer_t *r) {
+    if(r->buf != NULL) {
+        fractal_buffer_wait_jobs(r->buf);
+    }
+}
+
+// forget all known samples, the next render starts from scratch
+void renderer_reset(FractalRenderer_t *r) {
+    if(r->buf == NULL) { return; }
+    renderer_wait(r);
+    memset(r->buf->flags, 0, (size_t)r->buf->image->width * r->buf->image->height);
+}
+
+// The iteration cap of the fractal config was raised: samples that didn't escape have to be rendered again, the ones
+// with a PIX_ORBIT state continue from where they stopped. Samples that escaped keep their count.
+// Returns the number of samples that will be rendered again.
+uint64_t renderer_raiseIterations(FractalRenderer_t *r) {
+    if(r->buf == NULL) { return 0; }
+    renderer_wait(r);
+    uint64_t redo = 0;
+    size_t n = (size_t)r->buf->image->width * r->buf->image->height;
+    Color *pixels = (Color*)r->buf->image->data;
+    for(size_t i = 0; i < n; ++i) {
+        uint8_t flags = r->buf->flags[i];
+        if(flags & PIX_AA) {
+            // sub-samples may not have escaped either, the next antialias pass takes the pixel again
+            flags &= ~PIX_AA;
+            r->buf->flags[i] = flags;
+            pixels[i] = paletteColor(r->opts.palette, r->buf->iters[i]);
+        }
+        if((flags & PIX_KNOWN) && r->buf->iters[i] == UINT32_MAX) {
+            // guesses and fills have no state of their own, they start over
+            r->buf->flags[i] = flags & PIX_ORBIT;
+            ++redo;
+        }
+    }
+    r->complete = false;
+    return redo;
 }
 
-void renderer_startRender(FractalRenderer_t *r, uint32_t width, uint32_t height) {
-    printf("Start rendering w=%i h=%i\n", width, height);
+// Render the samples on the step lattice into the renderer's image.
+// Samples already known from a coarser step (or an earlier render at the same step) are reused, only the new ones get computed.
+void renderer_startRender(FractalRenderer_t *r, uint32_t width, uint32_t height, uint32_t step) {
+    printf("Start rendering w=%i h=%i step=%i\n", width, height, step);
     if(r->state == RENDERING) {
         printf("Cannot start rendering - render already in progress\n");
         return;
     }
-    Image* new_image = malloc(sizeof(Image));
-    *new_image = GenImageColor(width, height, (Color) {0,0,0,0});
+    renderer_wait(r);
+    if(r->buf == NULL || r->buf->image->width != width || r->buf->image->height != height) {
+        if(r->buf != NULL) {
+            fractal_buffer_release(r->buf);
+        }
+        r->buf = fractal_buffer_create(width, height);
+    }
+    if(r->opts.sample_info) {
+        fractal_buffer_enable_info(r->buf);
+    }
+    if(r->opts.keep_orbits) {
+        fractal_buffer_enable_orbits(r->buf);
+    }
+    r->step = step;
+    r->pass = PASS_SAMPLE;
+    // samples filled in beforehand are known, the job skips them
+    if(r->prefill != NULL) {
+        r->prefill(r->buf, r->prefill_ctx);
+    }
+
+    r->complete = false;
+    r->job = DrawFractal_threaded_start(&r->pool, r->buf, r->fractal_fn, r->fractal_cfg, step, PASS_SAMPLE, r->opts, r->focus_x, r->focus_y, NULL, 0);
+    r->state = RENDERING;
+}
+
+// Recheck the guessed samples along the edges of guessed regions on the lattice of the last render.
+void renderer_startVerify(FractalRenderer_t *r) {
+    printf("Start verify step=%i\n", r->step);
+    if(r->state == RENDERING || r->buf == NULL) {
+        printf("Cannot start verify - render in progress or nothing rendered yet\n");
+        return;
+    }
+    renderer_wait(r);
+    r->pass = PASS_VERIFY;
 
-    // printf("w%i h%i\n", new_image->width, new_image->height);
+    r->complete = false;
+    r->job = DrawFractal_threaded_start(&r->pool, r->buf, r->fractal_fn, r->fractal_cfg, r->step, PASS_VERIFY, r->opts, r->focus_x, r->focus_y, NULL, 0);
+    r->state = RENDERING;
+}
 
+// Antialias the result of the last render, which has to be at step 1. Pixels antialiased before are left as they are.
+void renderer_startAntialias(FractalRenderer_t *r) {
+    printf("Start antialias max=%u threshold=%u\n", r->opts.antialias, r->opts.aa_threshold);
+    if(r->state == RENDERING || r->buf == NULL || r->step != 1) {
+        printf("Cannot start antialias - render in progress or no step 1 render yet\n");
+        return;
+    }
+    renderer_wait(r);
+    r->pass = PASS_ANTIALIAS;
 
-    r->thread_sync = DrawFractal_threaded_start(new_image, r->fractal_fn, r->fractal_cfg, r->n_threads);
+    r->complete = false;
+    r->job = DrawFractal_threaded_start(&r->pool, r->buf, r->fractal_fn, r->fractal_cfg, 1, PASS_ANTIALIAS, r->opts, r->focus_x, r->focus_y, NULL, 0);
     r->state = RENDERING;
 }
 
@@ -221,25 +1382,237 @@ RenderThreadStatus_t renderer_progress(FractalRenderer_t *r) {
     if(r->state == IDLE) {
         return (RenderThreadStatus_t) {.done=false, .progress_pct = 0.0};
     } else {
-        return check_threaded_render_status(r->thread_sync);
+        return check_threaded_render_status(r->job);
     }
 }
 
-// cancel the render where it is and clean up
+// cancel the render where it is. Doesn't wait for the render threads, the next renderer call that touches the
+// result waits for the job to be out of it (renderer_wait).
 void renderer_cancel(FractalRenderer_t *r) {
     printf("Cancel rendering\n");
 
     if(r->state != RENDERING) {return;}
 
-    pthread_mutex_lock(&(r->thread_sync->mtx));
-    r->thread_sync->cancel = true;
-    pthread_mutex_unlock(&(r->thread_sync->mtx));
-
-    DrawFractal_threaded_end(r->thread_sync);
+    DrawFractal_threaded_cancel(r->job);
+    r->job = NULL;
+    r->complete = false;
 
     r->state = IDLE;
 }
 
+// Cancel the render and wait until no render thread is in a job of the pool anymore, e.g. before changing
+// what the fractal config points to. Cancelled jobs stop within CANCEL_CHECK_INTERVAL iterations.
+void renderer_stop(FractalRenderer_t *r) {
+    renderer_cancel(r);
+    struct timespec poll = {0, RENDER_WAIT_POLL_NS};
+    while(1) {
+        pthread_mutex_lock(&(r->pool.mtx));
+        uint32_t live = r->pool.live_jobs;
+        pthread_mutex_unlock(&(r->pool.mtx));
+        if(live == 0) { break; }
+        nanosleep(&poll, NULL);
+    }
+}
+
+// empty n samples of buf from idx on, as a freshly created buffer has them
+void fractal_buffer_clear_span(FractalBuffer_t *buf, size_t idx, size_t n) {
+    Color *pixels = (Color*)buf->image->data;
+    for(size_t i = idx; i < idx + n; ++i) { pixels[i] = BLACK; }
+    memset(&buf->flags[idx], 0, n * sizeof(uint8_t));
+    if(buf->info != NULL) { memset(&buf->info[idx], 0, n * sizeof(SampleInfo_t)); }
+}
+
+// Move the samples of buf by (dx, dy) pixels in place, row by row: pixel (x, y) gets what (x + dx, y + dy) had,
+// sample info and orbit states included. Pixels that weren't known keep their colour as a PIX_PREVIEW if preview is
+// set, the exposed strips are emptied. No job may be rendering into buf anymore (fractal_buffer_wait_jobs), the UI
+// may still be showing its image, the caller marks the whole of it dirty.
+void fractal_buffer_shift(FractalBuffer_t *buf, int32_t dx, int32_t dy, bool preview) {
+    int32_t w = buf->image->width;
+    int32_t h = buf->image->height;
+    Color *pixels = (Color*)buf->image->data;
+    int32_t x0 = dx < 0 ? -dx : 0; // first column that shows moved pixels
+    int32_t copy_w = abs(dx) < w ? w - abs(dx) : 0;
+    for(int32_t i = 0; i < h; ++i) {
+        // rows move up for dy > 0, go in the direction that reads every row before it gets overwritten
+        int32_t y = dy > 0 ? i : h - 1 - i;
+        int32_t old_y = y + dy;
+        size_t row = (size_t)y * w;
+        if(old_y < 0 || old_y >= h || copy_w == 0) {
+            fractal_buffer_clear_span(buf, row, w);
+            continue;
+        }
+        size_t dst = row + x0;
+        size_t src = (size_t)old_y * w + x0 + dx;
+        memmove(&pixels[dst], &pixels[src], copy_w * sizeof(Color));
+        memmove(&buf->iters[dst], &buf->iters[src], copy_w * sizeof(uint32_t));
+        memmove(&buf->flags[dst], &buf->flags[src], copy_w * sizeof(uint8_t));
+        if(buf->info != NULL) {
+            memmove(&buf->info[dst], &buf->info[src], copy_w * sizeof(SampleInfo_t));
+        }
+        if(buf->orbits != NULL) {
+            // the reference stays where it is, so the states stay valid for the moved samples
+            memmove(&buf->orbits[dst], &buf->orbits[src], copy_w * sizeof(OrbitState_t));
+        }
+        fractal_buffer_clear_span(buf, dx > 0 ? row + copy_w : row, w - copy_w);
+        if(preview) {
+            for(size_t j = dst; j < dst + copy_w; ++j) {
+                if(!(buf->flags[j] & PIX_KNOWN)) { buf->flags[j] = PIX_PREVIEW; }
+            }
+        }
+    }
+}
+
+// Move the view by (dx, dy) pixels: pixel (x, y) of the new view shows what (x + dx, y + dy) showed before.
+// The caller cancels the running render and waits for it (renderer_cancel, renderer_wait) before moving the
+// fractal's frame accordingly. Known samples are shifted along and only the exposed strips get rendered, at step 1.
+// Returns false without doing anything if the last render wasn't at step 1 or nothing would be left on screen,
+// the caller has to reset and render from scratch then.
+bool renderer_pan(FractalRenderer_t *r, int32_t dx, int32_t dy) {
+    if(r->buf == NULL || r->step != 1) { return false; }
+    Image *old = r->buf->image;
+    int32_t w = old->width;
+    int32_t h = old->height;
+    if(abs(dx) >= w || abs(dy) >= h) { return false; }
+
+    // a cancelled render may have left holes anywhere, not just in the strips
+    bool complete = r->complete;
+    renderer_cancel(r);
+    renderer_wait(r);
+    printf("Pan dx=%i dy=%i\n", dx, dy);
+
+    // nothing renders into the buffer anymore, the samples move within it
+    fractal_buffer_shift(r->buf, dx, dy, false);
+    // everything moved, the whole texture has to be updated
+    fractal_buffer_mark_dirty(r->buf, (PixelRect_t) {0, 0, w, h});
+
+    PixelRect_t strips[2];
+    uint32_t n_strips = 0;
+    if(dx != 0) {
+        strips[n_strips++] = dx > 0 ? (PixelRect_t) {w - dx, 0, w, h} : (PixelRect_t) {0, 0, -dx, h};
+    }
+    if(dy != 0) {
+        strips[n_strips++] = dy > 0 ? (PixelRect_t) {0, h - dy, w, h} : (PixelRect_t) {0, 0, w, -dy};
+    }
+
+    r->step = 1;
+    r->pass = PASS_SAMPLE;
+    if(r->prefill != NULL) {
+        r->prefill(r->buf, r->prefill_ctx);
+    }
+    r->complete = false;
+    r->job = DrawFractal_threaded_start(&r->pool, r->buf, r->fractal_fn, r->fractal_cfg, 1, PASS_SAMPLE, r->opts, r->focus_x, r->focus_y,
+                                        complete ? strips : NULL, n_strips);
+    r->state = RENDERING;
+    return true;
+}
+
+// Offset of the zoomed view's center from the current one, in current pixels along an axis of size pixels.
+// scale is the number of current pixels per pixel of the zoomed view (1 / zoom factor). The point at anchor stays
+// where it is as far as possible, the offset is snapped so pixel centers of the zoomed view land on pixel centers
+// of the current one wherever the scale allows it (every factor-th pixel for integer zoom factors).
+double zoom_center_offset(uint32_t size, double scale, double anchor) {
+    double base = 0.5 - size / 2.0 - (0.5 - size / 2.0) * scale;
+    double wanted = (anchor - size / 2.0) * (1.0 - scale);
+    return round(wanted - base) + base;
+}
+
+// bilinear interpolation between the colours at the corners (0, 0), (1, 0), (0, 1) and (1, 1), au/av in 0..1
+Color color_bilinear(Color c00, Color c10, Color c01, Color c11, double au, double av) {
+    return (Color) {
+        (unsigned char)((c00.r * (1 - au) + c10.r * au) * (1 - av) + (c01.r * (1 - au) + c11.r * au) * av + 0.5),
+        (unsigned char)((c00.g * (1 - au) + c10.g * au) * (1 - av) + (c01.g * (1 - au) + c11.g * au) * av + 0.5),
+        (unsigned char)((c00.b * (1 - au) + c10.b * au) * (1 - av) + (c01.b * (1 - au) + c11.b * au) * av + 0.5),
+        255
+    };
+}
+
+// Replace the result by the view zoomed by 1 / scale around the center offset (cdx, cdy), in current pixels
+// (see zoom_center_offset). Samples landing exactly on a pixel of the zoomed view are kept, the other pixels get a
+// PIX_PREVIEW colour interpolated from the current image until the next renders compute their samples.
+// The caller cancels the running render and waits for it before zooming the fractal's frame accordingly.
+void renderer_zoom(FractalRenderer_t *r, double scale, double cdx, double cdy) {
+    if(r->buf == NULL) { return; }
+    renderer_cancel(r);
+    renderer_wait(r);
+    printf("Zoom scale=%f offset=(%f, %f)\n", scale, cdx, cdy);
+
+    FractalBuffer_t *old = r->buf;
+    int32_t w = old->image->width;
+    int32_t h = old->image->height;
+    if(scale == 1.0 && cdx == round(cdx) && cdy == round(cdy)) {
+        // a drag, every pixel lands on one: shift the rows instead of resampling
+        fractal_buffer_shift(old, (int32_t)cdx, (int32_t)cdy, true);
+        fractal_buffer_mark_dirty(old, (PixelRect_t) {0, 0, w, h});
+        r->complete = false;
+        return;
+    }
+    Color *old_pixels = (Color*)old->image->data;
+    FractalBuffer_t *buf = fractal_buffer_create(w, h);
+    Color *pixels = (Color*)buf->image->data;
+    uint64_t reused = 0;
+    for(int32_t y = 0; y < h; ++y) {
+        // position of the pixel center in the current image, in pixels from the first pixel center
+        double v = h / 2.0 + cdy + (y + 0.5 - h / 2.0) * scale - 0.5;
+        for(int32_t x = 0; x < w; ++x) {
+            double u = w / 2.0 + cdx + (x + 0.5 - w / 2.0) * scale - 0.5;
+            size_t idx = (size_t)y * w + x;
+            // outside the current image there's nothing to show, coarse samples fill it in
+            if(u < -0.5 || v < -0.5 || u > w - 0.5 || v > h - 0.5) { continue; }
+
+            int32_t ou = (int32_t)round(u);
+            int32_t ov = (int32_t)round(v);
+            size_t oidx = (size_t)ov * w + ou;
+            if(fabs(u - ou) < 1e-6 && fabs(v - ov) < 1e-6 && (old->flags[oidx] & PIX_KNOWN)) {
+                buf->iters[idx] = old->iters[oidx];
+                buf->flags[idx] = old->flags[oidx] & ~PIX_AA;
+                // the sub-samples covered the old pixel's area, the zoomed pixel's is another one
+                pixels[idx] = (old->flags[oidx] & PIX_AA) ? paletteColor(r->opts.palette, old->iters[oidx]) : old_pixels[oidx];
+                if(old->info != NULL) {
+                    fractal_buffer_enable_info(buf);
+                    buf->info[idx] = old->info[oidx];
+                    // in kernel units, which cover scale times as much of the plane now
+                    buf->info[idx].distance /= scale;
+                }
+                if(old->orbits != NULL) {
+                    fractal_buffer_enable_orbits(buf);
+                    buf->orbits[idx] = old->orbits[oidx];
+                    // the kernel's x/y cover scale times as much of the plane now
+                    buf->orbits[idx].der_re *= scale;
+                    buf->orbits[idx].der_im *= scale;
+                }
+                ++reused;
+                continue;
+            }
+
+            // bilinear between the 4 surrounding pixel centers
+            double fu = fmin(fmax(u, 0.0), w - 1);
+            double fv = fmin(fmax(v, 0.0), h - 1);
+            int32_t u0 = fu < w - 1 ? (int32_t)fu : w - 2 < 0 ? 0 : w - 2;
+            int32_t v0 = fv < h - 1 ? (int32_t)fv : h - 2 < 0 ? 0 : h - 2;
+            int32_t u1 = u0 + 1 < w ? u0 + 1 : u0;
+            int32_t v1 = v0 + 1 < h ? v0 + 1 : v0;
+            pixels[idx] = color_bilinear(old_pixels[(size_t)v0 * w + u0], old_pixels[(size_t)v0 * w + u1],
+                                         old_pixels[(size_t)v1 * w + u0], old_pixels[(size_t)v1 * w + u1], fu - u0, fv - v0);
+            buf->flags[idx] = PIX_PREVIEW;
+        }
+    }
+    printf("Zoom kept %" PRIu64 " of %i samples\n", reused, w * h);
+
+    fractal_buffer_release(old);
+    r->buf = buf;
+    fractal_buffer_mark_dirty(buf, (PixelRect_t) {0, 0, w, h});
+    r->complete = false;
+}
+
+void renderer_destroy(FractalRenderer_t *r) {
+    renderer_cancel(r);
+    render_pool_destroy(&r->pool);
+    if(r->buf != NULL) {
+        fractal_buffer_release(r->buf);
+        r->buf = NULL;
+    }
+}
+
 RendererState_t renderer_update(FractalRenderer_t *r) {
     if(r->state == IDLE) {
         return IDLE;
@@ -248,9 +1621,18 @@ RendererState_t renderer_update(FractalRenderer_t *r) {
             // check status if rendering
             RenderThreadStatus_t stat = renderer_progress(r);
             if(stat.done) {
-                printf("render finished, cleaning up\n");
-                // close out threads & clean up
-                DrawFractal_threaded_end(r->thread_sync);
+                RenderJob_t *job = r->job;
+                printf("render finished (%" PRIu64 " of %" PRIu64 " samples computed, %" PRIu64 " guessed, %" PRIu64 " corrected), cleaning up\n",
+                       job->kernel_calls, job->total_samples, job->guessed, job->corrected);
+                printf("first tile after %.2f ms, total render time %.2f ms (%s order)\n",
+                       job->first_tile_ms - job->start_ms, job->end_ms - job->start_ms, TILE_ORDER_NAMES[job->opts.order]);
+                r->last_kernel_calls = job->kernel_calls;
+                r->last_corrected = job->corrected;
+                r->last_render_ms = job->end_ms - job->start_ms;
+                // clean up
+                DrawFractal_threaded_end(job);
+                r->job = NULL;
+                r->complete = true;
                 r->state = FINISHED;
             }
         }
@@ -266,5 +1648,13 @@ Image* renderer_getResultImage(FractalRenderer_t *r) {
         return NULL;
     }
 
-    return r->thread_sync->image;
-}
\ No newline at end of file
+    return r->buf->image;
+}
+
+uint32_t renderer_takeDirty(FractalRenderer_t *r, PixelRect_t *out, uint32_t max) {
+    if(r->buf == NULL) { return 0; }
+    return fractal_buffer_take_dirty(r->buf, out, max);
+}
+
+
+#endif // DRAW_FRACTAL_H
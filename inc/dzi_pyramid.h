@@ -0,0 +1,179 @@
+#ifndef DZI_PYRAMID_H
+#define DZI_PYRAMID_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "raylib.h"
+
+// Deep Zoom (DZI) tile pyramid: <name>.dzi describes the image, <name>_files/<level>/<column>_<row>.<format> are
+// tile_size x tile_size tiles (smaller at the right and bottom edges) without overlap. The finest level has the full
+// image size, each coarser one half of it, down to level 0 at 1 x 1 pixels.
+//
+// Rows of the finest level are fed in top to bottom. Every level buffers one row of tiles: once it's full it's written
+// out, halved and fed into the next coarser level. Nothing is rendered twice and memory stays at about two rows of
+// finest tiles, tiles show up on disk as soon as their rows are done.
+
+// writes one tile, e.g. ExportImage or a PPM writer
+typedef bool (*DziTileWriter)(Image *tile, const char *path);
+
+typedef struct PyramidLevel_t {
+    uint32_t width, height; // size of the level
+    Image rows; // width x tile_size, the current row of tiles
+    uint32_t y0; // level row of the first row in rows
+    uint32_t n_rows; // rows of rows filled
+} PyramidLevel_t;
+
+typedef struct DziPyramid_t {
+    char *dir; // <name>_files
+    const char *format; // file extension of the tiles
+    uint32_t tile_size;
+    uint32_t max_level; // the full size level
+    PyramidLevel_t *levels; // by level
+    DziTileWriter write;
+    uint64_t tiles_written;
+    bool ok; // false once writing a tile failed
+} DziPyramid_t;
+
+void dzi_free(DziPyramid_t *p);
+
+// Create the descriptor and directories for a width x height pyramid. path is the .dzi file.
+// tile_size has to be even: every full row of tiles is halved into the next level, an odd one would leave half a row.
+bool dzi_init(DziPyramid_t *p, const char *path, uint32_t width, uint32_t height, uint32_t tile_size, const char *format, DziTileWriter write) {
+    if(tile_size == 0 || tile_size % 2 != 0) {
+        printf("the tile size of a pyramid has to be even\n");
+        return false;
+    }
+    p->tile_size = tile_size;
+    p->format = format;
+    p->write = write;
+    p->tiles_written = 0;
+    p->ok = true;
+    p->max_level = 0;
+    while((1u << p->max_level) < width || (1u << p->max_level) < height) { ++(p->max_level); }
+
+    // foo.dzi -> foo_files
+    const char *ext = strrchr(path, '.');
+    size_t base_len = ext != NULL ? (size_t)(ext - path) : strlen(path);
+    p->dir = malloc(base_len + sizeof("_files"));
+    memcpy(p->dir, path, base_len);
+    strcpy(p->dir + base_len, "_files");
+
+    FILE *f = fopen(path, "w");
+    if(f == NULL) {
+        printf("can't write %s\n", path);
+        free(p->dir);
+        return false;
+    }
+    fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+               "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" TileSize=\"%u\" Overlap=\"0\" Format=\"%s\">\n"
+               "  <Size Width=\"%u\" Height=\"%u\"/>\n"
+               "</Image>\n", tile_size, format, width, height);
+    bool ok = fclose(f) == 0;
+
+    if(mkdir(p->dir, 0755) != 0 && errno != EEXIST) {
+        printf("can't create %s\n", p->dir);
+        ok = false;
+    }
+    p->levels = malloc((p->max_level + 1) * sizeof(PyramidLevel_t));
+    for(int32_t level = p->max_level; level >= 0; --level) {
+        PyramidLevel_t *l = &p->levels[level];
+        uint32_t shift = p->max_level - level;
+        l->width = (uint32_t)(((uint64_t)width + (1ull << shift) - 1) >> shift);
+        l->height = (uint32_t)(((uint64_t)height + (1ull << shift) - 1) >> shift);
+        l->rows = GenImageColor(l->width, tile_size, BLACK);
+        l->y0 = 0;
+        l->n_rows = 0;
+
+        char dir[4096];
+        snprintf(dir, sizeof(dir), "%s/%d", p->dir, level);
+        if(mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            printf("can't create %s\n", dir);
+            ok = false;
+        }
+    }
+    if(!ok) { dzi_free(p); }
+    return ok;
+}
+
+void dzi_add_rows(DziPyramid_t *p, uint32_t level, const Color *src, uint32_t n_rows);
+
+// write the buffered row of tiles of the level, then pass it on halved
+void dzi_flush_level(DziPyramid_t *p, uint32_t level) {
+    PyramidLevel_t *l = &p->levels[level];
+    Color *rows = (Color*)l->rows.data;
+    uint32_t tile_y = l->y0 / p->tile_size;
+    for(uint32_t x0 = 0; x0 < l->width && p->ok; x0 += p->tile_size) {
+        uint32_t tw = l->width - x0 < p->tile_size ? l->width - x0 : p->tile_size;
+        Image tile = GenImageColor(tw, l->n_rows, BLACK);
+        for(uint32_t y = 0; y < l->n_rows; ++y) {
+            memcpy(&((Color*)tile.data)[(size_t)y * tw], &rows[(size_t)y * l->width + x0], tw * sizeof(Color));
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%u/%u_%u.%s", p->dir, level, x0 / p->tile_size, tile_y, p->format);
+        if(!p->write(&tile, path)) {
+            printf("writing tile %s failed\n", path);
+            p->ok = false;
+        }
+        ++(p->tiles_written);
+        UnloadImage(tile);
+    }
+
+    if(level > 0) {
+        // box filter 2x2, the last row/column of odd sizes only averages what's there
+        PyramidLevel_t *coarse = &p->levels[level - 1];
+        uint32_t half_rows = (l->n_rows + 1) / 2;
+        Color *half = malloc((size_t)coarse->width * half_rows * sizeof(Color));
+        for(uint32_t y = 0; y < half_rows; ++y) {
+            uint32_t y1 = 2 * y + 1 < l->n_rows ? 2 * y + 1 : 2 * y;
+            for(uint32_t x = 0; x < coarse->width; ++x) {
+                uint32_t x1 = 2 * x + 1 < l->width ? 2 * x + 1 : 2 * x;
+                Color c00 = rows[(size_t)(2 * y) * l->width + 2 * x];
+                Color c10 = rows[(size_t)(2 * y) * l->width + x1];
+                Color c01 = rows[(size_t)y1 * l->width + 2 * x];
+                Color c11 = rows[(size_t)y1 * l->width + x1];
+                half[(size_t)y * coarse->width + x] = (Color) {
+                    (c00.r + c10.r + c01.r + c11.r + 2) / 4,
+                    (c00.g + c10.g + c01.g + c11.g + 2) / 4,
+                    (c00.b + c10.b + c01.b + c11.b + 2) / 4,
+                    255
+                };
+            }
+        }
+        dzi_add_rows(p, level - 1, half, half_rows);
+        free(half);
+    }
+    l->y0 += l->n_rows;
+    l->n_rows = 0;
+}
+
+// Append the next n_rows rows (the level's width each) to the level, writing every row of tiles that fills up.
+void dzi_add_rows(DziPyramid_t *p, uint32_t level, const Color *src, uint32_t n_rows) {
+    PyramidLevel_t *l = &p->levels[level];
+    for(uint32_t y = 0; y < n_rows; ++y) {
+        memcpy(&((Color*)l->rows.data)[(size_t)l->n_rows * l->width], &src[(size_t)y * l->width], l->width * sizeof(Color));
+        ++(l->n_rows);
+        if(l->n_rows == p->tile_size || l->y0 + l->n_rows == l->height) {
+            dzi_flush_level(p, level);
+        }
+    }
+}
+
+// feed the next rows of the full size image, image is as wide as the pyramid
+bool dzi_add_image(DziPyramid_t *p, Image *image) {
+    dzi_add_rows(p, p->max_level, (Color*)image->data, image->height);
+    return p->ok;
+}
+
+void dzi_free(DziPyramid_t *p) {
+    for(uint32_t level = 0; level <= p->max_level; ++level) {
+        UnloadImage(p->levels[level].rows);
+    }
+    free(p->levels);
+    free(p->dir);
+}
+
+#endif // DZI_PYRAMID_H
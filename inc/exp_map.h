@@ -0,0 +1,179 @@
+#ifndef EXP_MAP_H
+#define EXP_MAP_H
+
+#include <stdint.h>
+#include <math.h>
+#include "draw_fractal.h"
+#include "fractal_params.h"
+#include "zoom_sequence.h"
+
+// Exponential map of a zoom sequence: one strip in log-polar coordinates around the center holds every frame.
+// Column u is the angle 2 pi u / width, row v the radius r_max * exp(-2 pi v / width), so strip samples are square
+// and each row is a step of the same ratio deeper. The frames are resampled from the strip, only the disc inside
+// the deepest frame's corners comes from one ordinary render of the deepest frame.
+// The strip costs about half the frame diagonal in pixels times width samples per e-fold of zoom,
+// instead of width x height samples per frame.
+
+#define EXP_MAP_MARGIN_ROWS 2 // rows past the deepest frame's corners, so the resampler never runs off the strip
+
+// kernel wrapper rendering the strip: maps the lattice position of a strip sample to its point on the plane
+typedef struct ExpMapCFG {
+    Fractal inner;
+    void *inner_cfg;
+    uint32_t width, height; // strip size in samples
+    double log_r_max; // log of the radius of the first row, in kernel units of the deepest frame
+} ExpMapCFG;
+
+uint32_t exp_map_kernel(double x, double y, ExpMapCFG *cfg, const atomic_bool *cancel, SampleInfo_t *info, OrbitState_t *orbit) {
+    // undo compute_sample's mapping, (u, v) is the position in samples with the sample centers at +0.5
+    double u = x * cfg->width / 4.0 + cfg->width / 2.0;
+    double v = y * cfg->width / 4.0 + cfg->height / 2.0;
+    double angle = 2.0 * M_PI * u / cfg->width;
+    double r = exp(cfg->log_r_max - 2.0 * M_PI * v / cfg->width);
+    return cfg->inner(r * cos(angle), r * sin(angle), cfg->inner_cfg, cancel, info, orbit);
+}
+
+typedef struct ExpMap_t {
+    FractalBuffer_t *strip;
+    FractalBuffer_t *center; // the deepest frame, for the disc the strip doesn't reach
+    uint32_t frame_width, frame_height;
+    double log_r_max, log_r_min; // radius range of the strip in kernel units of the deepest frame
+    double strip_width, strip_height; // in samples, doubles until they're known to fit the budget
+} ExpMap_t;
+
+// Lay out the strip covering the zooms of the sequence, nothing is allocated yet
+void exp_map_layout(ExpMap_t *map, const ZoomSequence_t *seq, FractalSetup_t *setup) {
+    double log_end = sequence_log_zoom(setup->frame.zoom);
+    double log_start = sequence_frame_log_zoom(seq, log_end, 0);
+    // the deepest frame spans -2..2 across its width, the strip starts at its corners
+    map->frame_width = seq->width;
+    map->frame_height = seq->height;
+    map->log_r_min = log(2.0 * hypot(1.0, (double)seq->height / seq->width));
+    map->log_r_max = map->log_r_min + log_end - log_start;
+    // one strip sample per frame pixel at the corners, finer towards the center
+    map->strip_width = ceil(M_PI * hypot(seq->width, seq->height));
+    map->strip_height = ceil((map->log_r_max - map->log_r_min) * map->strip_width / (2.0 * M_PI)) + EXP_MAP_MARGIN_ROWS;
+}
+
+// memory the strip and the deepest frame take while the sequence is resampled
+double exp_map_bytes(const ExpMap_t *map) {
+    return (map->strip_width * map->strip_height + (double)map->frame_width * map->frame_height) * fractal_buffer_sample_bytes(false, false);
+}
+
+// Render the laid out strip and the deepest frame on the pool.
+// Returns the number of samples computed.
+uint64_t exp_map_render(ExpMap_t *map, const ZoomSequence_t *seq, RenderPool_t *pool, FractalSetup_t *setup) {
+    double log_end = sequence_log_zoom(setup->frame.zoom);
+    double log_start = sequence_frame_log_zoom(seq, log_end, 0);
+    uint32_t width = (uint32_t)map->strip_width;
+    uint32_t height = (uint32_t)map->strip_height;
+    printf("exponential map: %u x %u strip for zooms %g to %g\n", width, height, exp(log_start), exp(log_end));
+
+    ExpMapCFG cfg = {
+        .inner = fractal_setup_fn(setup),
+        .inner_cfg = fractal_setup_cfg(setup),
+        .width = width,
+        .height = height,
+        .log_r_max = map->log_r_max
+    };
+    map->strip = fractal_buffer_create(width, height);
+    map->center = fractal_buffer_create(seq->width, seq->height);
+    RenderJob_t *strip_job = DrawFractal_threaded_start(pool, map->strip, (Fractal) &exp_map_kernel, &cfg, 1, PASS_SAMPLE, seq->opts, 0.0, 0.0, NULL, 0);
+    RenderJob_t *center_job = DrawFractal_threaded_start(pool, map->center, cfg.inner, cfg.inner_cfg, 1, PASS_SAMPLE, seq->opts, 0.0, 0.0, NULL, 0);
+    DrawFractal_threaded_wait(strip_job);
+    DrawFractal_threaded_wait(center_job);
+    uint64_t kernel_calls = strip_job->kernel_calls + center_job->kernel_calls;
+    DrawFractal_threaded_end(strip_job);
+    DrawFractal_threaded_end(center_job);
+    return kernel_calls;
+}
+
+// bilinear sample of the image at (u, v) in pixels with pixel centers on integers, wrapping around horizontally if wrap is set
+Color exp_map_sample(Image *image, double u, double v, bool wrap) {
+    int32_t w = image->width;
+    int32_t h = image->height;
+    Color *pixels = (Color*)image->data;
+    v = fmin(fmax(v, 0.0), h - 1);
+    int32_t v0 = v < h - 1 ? (int32_t)v : (h > 1 ? h - 2 : 0);
+    int32_t v1 = v0 + 1 < h ? v0 + 1 : v0;
+    int32_t u0, u1;
+    if(wrap) {
+        u -= floor(u / w) * w;
+        u0 = (int32_t)u % w;
+        u1 = (u0 + 1) % w;
+    } else {
+        u = fmin(fmax(u, 0.0), w - 1);
+        u0 = u < w - 1 ? (int32_t)u : (w > 1 ? w - 2 : 0);
+        u1 = u0 + 1 < w ? u0 + 1 : u0;
+    }
+    return color_bilinear(pixels[(size_t)v0 * w + u0], pixels[(size_t)v0 * w + u1],
+                          pixels[(size_t)v1 * w + u0], pixels[(size_t)v1 * w + u1], u - u0, v - v0);
+}
+
+// resample the frame at log zoom log_zoom (at most the deepest frame's) into image
+void exp_map_frame(ExpMap_t *map, double log_zoom, double log_end, Image *image) {
+    int32_t w = map->frame_width;
+    int32_t h = map->frame_height;
+    Image *strip = map->strip->image;
+    Color *pixels = (Color*)image->data;
+    double samples_per_log = strip->width / (2.0 * M_PI);
+    // pixel offsets of the frame are scaled to the deepest frame's kernel units
+    double log_scale = log_end - log_zoom;
+    double to_center = exp(log_scale);
+    for(int32_t y = 0; y < h; ++y) {
+        double py = (y + 0.5 - h / 2.0) * 4.0 / w;
+        for(int32_t x = 0; x < w; ++x) {
+            double px = (x + 0.5 - w / 2.0) * 4.0 / w;
+            double dist = hypot(px, py);
+            double log_r = log(dist) + log_scale;
+            Color c;
+            if(dist > 0.0 && log_r >= map->log_r_min) {
+                double u = (atan2(py, px) / (2.0 * M_PI)) * strip->width - 0.5;
+                double v = (map->log_r_max - log_r) * samples_per_log - 0.5;
+                c = exp_map_sample(strip, u, v, true);
+            } else {
+                // inside the deepest frame's corners
+                c = exp_map_sample(map->center->image, px * to_center * w / 4.0 + w / 2.0 - 0.5, py * to_center * w / 4.0 + h / 2.0 - 0.5, false);
+            }
+            pixels[(size_t)y * w + x] = c;
+        }
+    }
+}
+
+void exp_map_free(ExpMap_t *map) {
+    fractal_buffer_release(map->strip);
+    fractal_buffer_release(map->center);
+}
+
+// Render the sequence through the exponential map and hand the frames to sink in order.
+// The whole strip is held in memory, a sequence whose strip doesn't fit in budget bytes isn't started.
+// Returns false if it wasn't or sink stopped the sequence early.
+bool exp_map_sequence_render(const ZoomSequence_t *seq, RenderPool_t *pool, FractalSetup_t *setup, uint64_t budget, ZoomFrameSink sink, void *ctx) {
+    ExpMap_t map;
+    exp_map_layout(&map, seq, setup);
+    if(exp_map_bytes(&map) > (double)budget) {
+        printf("exponential map: a %.0f x %.0f strip needs %.0f MiB, more than the %" PRIu64 " MiB allowed\n",
+               map.strip_width, map.strip_height, exp_map_bytes(&map) / (1 << 20), budget >> 20);
+        return false;
+    }
+    double start_ms = render_time_ms();
+    uint64_t kernel_calls = exp_map_render(&map, seq, pool, setup);
+    double render_ms = render_time_ms();
+    printf("exponential map: %" PRIu64 " samples computed in %.2f ms, %" PRIu64 " for the frames themselves\n",
+           kernel_calls, render_ms - start_ms, (uint64_t)seq->frames * seq->width * seq->height);
+
+    double log_end = sequence_log_zoom(setup->frame.zoom);
+    Image frame = GenImageColor(seq->width, seq->height, BLACK);
+    bool ok = true;
+    for(uint32_t i = 0; i < seq->frames && ok; ++i) {
+        exp_map_frame(&map, sequence_frame_log_zoom(seq, log_end, i), log_end, &frame);
+        ok = sink(&frame, i, ctx);
+    }
+    double ms = render_time_ms() - render_ms;
+    printf("exponential map: %u frames resampled in %.2f ms (%.2f ms per frame)\n", seq->frames, ms, ms / (seq->frames ? seq->frames : 1));
+    UnloadImage(frame);
+    exp_map_free(&map);
+    return ok;
+}
+
+#endif // EXP_MAP_H
@@ -0,0 +1,368 @@
+#ifndef FRACTAL_PARAMS_H
+#define FRACTAL_PARAMS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "gmp.h"
+#include "draw_fractal.h"
+#include "mandelbrot.h"
+
+// Location parameter files, one "key = value" per line, # starts a comment:
+//
+//   re = -0.1479946223325078880202580653442
+//   im = 0.0000009013973290203539801978
+//   zoom = 2e34
+//   iterations = 20000
+//   precision = 1024
+//   bailout = 10
+//   kernel = perturb
+//   palette = hsv
+//
+// re, im and zoom are kept as the exact strings from the file and only ever parsed by GMP, so no precision is lost
+// on the way in. Keys that are missing keep their defaults.
+
+typedef enum {
+    KERNEL_PERTURB, // perturbation around a GMP reference orbit, for deep zooms
+    KERNEL_DOUBLE, // plain double precision, only good down to zooms of about 1e13
+    N_KERNELS
+} FractalKernel_t;
+
+const char *KERNEL_NAMES[N_KERNELS] = {"perturb", "double"};
+
+typedef struct FractalParams_t {
+    char *re, *im, *zoom; // decimal strings as GMP reads them
+    uint32_t iterations;
+    uint32_t precision; // bits of the center and the reference orbit
+    double bailout; // escape radius
+    FractalKernel_t kernel;
+    Palette_t palette;
+} FractalParams_t;
+
+// index of name in names, -1 if it isn't one of them
+int params_lookup_name(const char *name, const char **names, int n) {
+    for(int i = 0; i < n; ++i) {
+        if(strcmp(name, names[i]) == 0) { return i; }
+    }
+    return -1;
+}
+
+void params_set_str(char **field, const char *value) {
+    free(*field);
+    *field = strdup(value);
+}
+
+void params_default(FractalParams_t *p) {
+    *p = (FractalParams_t) {
+        .iterations = 20000,
+        .precision = 1024,
+        .bailout = 10.0,
+        .kernel = KERNEL_PERTURB,
+        .palette = PALETTE_HSV
+    };
+    params_set_str(&p->re, "-147994622332507888020258065344200153e-35");
+    params_set_str(&p->im, "0000901397329020353980197791866e-30");
+    params_set_str(&p->zoom, "2e34");
+}
+
+void params_free(FractalParams_t *p) {
+    free(p->re);
+    free(p->im);
+    free(p->zoom);
+    p->re = p->im = p->zoom = NULL;
+}
+
+// Set one parameter from its key and value strings. Returns false (with a message) for unknown keys and bad values.
+bool params_set(FractalParams_t *p, const char *key, const char *value) {
+    char *end;
+    if(strcmp(key, "re") == 0 || strcmp(key, "im") == 0 || strcmp(key, "zoom") == 0) {
+        // only checked here, parsed at the frame's precision by params_to_frame
+        mpf_t check;
+        mpf_init(check);
+        bool ok = mpf_set_str(check, value, 10) == 0;
+        mpf_clear(check);
+        if(!ok) {
+            printf("invalid number for %s: %s\n", key, value);
+            return false;
+        }
+        params_set_str(key[0] == 'r' ? &p->re : key[0] == 'i' ? &p->im : &p->zoom, value);
+    } else if(strcmp(key, "iterations") == 0 || strcmp(key, "precision") == 0) {
+        unsigned long n = strtoul(value, &end, 10);
+        if(*end != '\0' || n == 0 || n > UINT32_MAX - 2) {
+            printf("invalid %s: %s\n", key, value);
+            return false;
+        }
+        *(key[0] == 'i' ? &p->iterations : &p->precision) = n;
+    } else if(strcmp(key, "bailout") == 0) {
+        p->bailout = strtod(value, &end);
+        if(*end != '\0' || !(p->bailout >= 2.0)) {
+            printf("invalid bailout (at least 2): %s\n", value);
+            return false;
+        }
+    } else if(strcmp(key, "kernel") == 0) {
+        int k = params_lookup_name(value, KERNEL_NAMES, N_KERNELS);
+        if(k < 0) {
+            printf("unknown kernel: %s\n", value);
+            return false;
+        }
+        p->kernel = k;
+    } else if(strcmp(key, "palette") == 0) {
+        int k = params_lookup_name(value, PALETTE_NAMES, N_PALETTES);
+        if(k < 0) {
+            printf("unknown palette: %s\n", value);
+            return false;
+        }
+        p->palette = k;
+    } else {
+        printf("unknown parameter: %s\n", key);
+        return false;
+    }
+    return true;
+}
+
+// trim whitespace in place
+char* params_trim(char *s) {
+    while(isspace((unsigned char)*s)) { ++s; }
+    char *end = s + strlen(s);
+    while(end > s && isspace((unsigned char)end[-1])) { --end; }
+    *end = '\0';
+    return s;
+}
+
+// Read parameters from f on top of what's in p already, name is for messages. Returns false on the first bad line.
+bool params_read(FractalParams_t *p, FILE *f, const char *name) {
+    char *line = NULL;
+    size_t cap = 0;
+    uint32_t line_no = 0;
+    bool ok = true;
+    while(ok && getline(&line, &cap, f) != -1) {
+        ++line_no;
+        char *comment = strchr(line, '#');
+        if(comment != NULL) { *comment = '\0'; }
+        char *key = params_trim(line);
+        if(*key == '\0') { continue; }
+        char *eq = strchr(key, '=');
+        if(eq == NULL) {
+            printf("%s:%u: expected key = value\n", name, line_no);
+            ok = false;
+            break;
+        }
+        *eq = '\0';
+        if(!params_set(p, params_trim(key), params_trim(eq + 1))) {
+            printf("%s:%u: in this line\n", name, line_no);
+            ok = false;
+        }
+    }
+    free(line);
+    return ok;
+}
+
+// Load a parameter file on top of what's in p already. Returns false on the first bad line.
+bool params_load(FractalParams_t *p, const char *path) {
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        printf("can't open parameter file %s\n", path);
+        return false;
+    }
+    bool ok = params_read(p, f, path);
+    fclose(f);
+    return ok;
+}
+
+void params_write(const FractalParams_t *p, FILE *f) {
+    fprintf(f, "re = %s\n", p->re);
+    fprintf(f, "im = %s\n", p->im);
+    fprintf(f, "zoom = %s\n", p->zoom);
+    fprintf(f, "iterations = %u\n", p->iterations);
+    fprintf(f, "precision = %u\n", p->precision);
+    fprintf(f, "bailout = %.17g\n", p->bailout);
+    fprintf(f, "kernel = %s\n", KERNEL_NAMES[p->kernel]);
+    fprintf(f, "palette = %s\n", PALETTE_NAMES[p->palette]);
+}
+
+bool params_save(const FractalParams_t *p, const char *path) {
+    FILE *f = fopen(path, "w");
+    if(f == NULL) {
+        printf("can't write parameter file %s\n", path);
+        return false;
+    }
+    params_write(p, f);
+    return fclose(f) == 0;
+}
+
+// Exact decimal string of x: enough digits to read back every bit of its precision.
+char* params_mpf_to_str(mpf_t x) {
+    size_t digits = (size_t)(mpf_get_prec(x) * 0.30103) + 2;
+    mp_exp_t exp;
+    char *mantissa = mpf_get_str(NULL, &exp, 10, digits, x);
+    size_t len = strlen(mantissa) + 32;
+    char *out = malloc(len);
+    if(mantissa[0] == '\0') {
+        snprintf(out, len, "0");
+    } else if(mantissa[0] == '-') {
+        snprintf(out, len, "-0.%se%ld", mantissa + 1, (long)exp);
+    } else {
+        snprintf(out, len, "0.%se%ld", mantissa, (long)exp);
+    }
+    free(mantissa);
+    return out;
+}
+
+// store the frame's (possibly moved) location in p
+void params_from_frame(FractalParams_t *p, ArbPrecFrame *frame) {
+    free(p->re);
+    free(p->im);
+    free(p->zoom);
+    p->re = params_mpf_to_str(frame->c_re);
+    p->im = params_mpf_to_str(frame->c_im);
+    p->zoom = params_mpf_to_str(frame->zoom);
+}
+
+// init the frame's values at the parameters' precision
+bool params_to_frame(const FractalParams_t *p, ArbPrecFrame *frame) {
+    mpf_init2(frame->c_re, p->precision);
+    mpf_init2(frame->c_im, p->precision);
+    mpf_init2(frame->zoom, p->precision);
+    return mpf_set_str(frame->c_re, p->re, 10) == 0 && mpf_set_str(frame->c_im, p->im, 10) == 0
+        && mpf_set_str(frame->zoom, p->zoom, 10) == 0;
+}
+
+// the parameters as they'd be saved, free the result
+char* params_to_str(const FractalParams_t *p) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    params_write(p, f);
+    fclose(f);
+    return text;
+}
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+
+// 64 bit FNV-1a of n bytes, continuing from hash (FNV_OFFSET_BASIS to start)
+uint64_t fnv1a(uint64_t hash, const void *data, size_t n) {
+    const uint8_t *bytes = data;
+    for(size_t i = 0; i < n; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// 64 bit FNV-1a over the parameters as they'd be saved, for naming and caching renders
+uint64_t params_hash(const FractalParams_t *p) {
+    char *text = params_to_str(p);
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS, text, strlen(text));
+    free(text);
+    return hash;
+}
+
+// Everything a renderer needs for one location, built from FractalParams_t by fractal_setup_init.
+typedef struct FractalSetup_t {
+    FractalKernel_t kernel;
+    ArbPrecFrame frame;
+    RefIter ref; // KERNEL_PERTURB only
+    PerturbMandelbrotCFG perturb;
+    MandelbrotCFG plain;
+} FractalSetup_t;
+
+// call after moving the frame
+void fractal_setup_update(FractalSetup_t *s) {
+    if(s->kernel == KERNEL_PERTURB) {
+        perturb_update_cfg(&s->perturb);
+    } else {
+        s->plain.cx = mpf_get_d(s->frame.c_re);
+        s->plain.cy = mpf_get_d(s->frame.c_im);
+        s->plain.zoom = mpf_get_d(s->frame.zoom);
+    }
+}
+
+// Parse the location and set up the reference orbit if the kernel needs one: from ref_re and ref_im (p->iterations
+// points each, taken over by the setup) if they're given, otherwise it's built.
+bool fractal_setup_init_with_ref(FractalSetup_t *s, const FractalParams_t *p, double *ref_re, double *ref_im) {
+    s->kernel = p->kernel;
+    if(!params_to_frame(p, &s->frame)) {
+        printf("invalid location\n");
+        free(ref_re);
+        free(ref_im);
+        return false;
+    }
+    double bailout2 = p->bailout * p->bailout;
+    if(s->kernel == KERNEL_PERTURB) {
+        s->ref = ref_re != NULL ? wrap_ref_iter(&s->frame, p->precision, p->iterations, ref_re, ref_im)
+                                : build_ref_iter(&s->frame, p->precision, p->iterations);
+        if(s->ref.re == NULL) {
+            drop_ref_iter(&s->ref);
+            mpf_clears(s->frame.c_re, s->frame.c_im, s->frame.zoom, NULL);
+            return false;
+        }
+        s->perturb = (PerturbMandelbrotCFG) {
+            .iterations = p->iterations,
+            .bailout2 = bailout2,
+            .frame = &s->frame,
+            .reference = &s->ref
+        };
+    } else {
+        free(ref_re);
+        free(ref_im);
+        s->plain = (MandelbrotCFG) {.iterations = p->iterations, .bailout2 = bailout2};
+    }
+    fractal_setup_update(s);
+    return true;
+}
+
+// parse the location and build the reference orbit if the kernel needs one
+bool fractal_setup_init(FractalSetup_t *s, const FractalParams_t *p) {
+    return fractal_setup_init_with_ref(s, p, NULL, NULL);
+}
+
+void fractal_setup_free(FractalSetup_t *s) {
+    if(s->kernel == KERNEL_PERTURB) {
+        drop_ref_iter(&s->ref);
+    }
+    mpf_clears(s->frame.c_re, s->frame.c_im, s->frame.zoom, NULL);
+}
+
+// Change the iteration cap. A longer reference orbit is built at the old one's c, so it starts with the same points
+// and orbit states of samples rendered with the old one stay valid (see renderer_raiseIterations).
+// Returns false, leaving the setup as it was, if there's no memory for the longer orbit.
+bool fractal_setup_set_iterations(FractalSetup_t *s, uint32_t iterations) {
+    if(s->kernel != KERNEL_PERTURB) {
+        s->plain.iterations = iterations;
+        return true;
+    }
+    if(iterations > s->ref.iterations) {
+        // only c is read from the frame
+        mp_bitcnt_t precision = mpf_get_prec(s->ref.c_re);
+        ArbPrecFrame at_ref;
+        mpf_init2(at_ref.c_re, precision);
+        mpf_init2(at_ref.c_im, precision);
+        mpf_set(at_ref.c_re, s->ref.c_re);
+        mpf_set(at_ref.c_im, s->ref.c_im);
+        RefIter longer = build_ref_iter(&at_ref, precision, iterations);
+        mpf_clears(at_ref.c_re, at_ref.c_im, NULL);
+        if(longer.re == NULL) {
+            drop_ref_iter(&longer);
+            return false;
+        }
+        drop_ref_iter(&s->ref);
+        s->ref = longer;
+    }
+    s->perturb.iterations = iterations;
+    return true;
+}
+
+Fractal fractal_setup_fn(FractalSetup_t *s) {
+    return s->kernel == KERNEL_PERTURB ? (Fractal) &perturb_mandelbrot : (Fractal) &mandelbrot;
+}
+
+void* fractal_setup_cfg(FractalSetup_t *s) {
+    return s->kernel == KERNEL_PERTURB ? (void*) &s->perturb : (void*) &s->plain;
+}
+
+uint32_t* fractal_setup_iterations(FractalSetup_t *s) {
+    return s->kernel == KERNEL_PERTURB ? &s->perturb.iterations : &s->plain.iterations;
+}
+
+#endif // FRACTAL_PARAMS_H
@@ -0,0 +1,47 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "raylib.h"
+
+// image files of the batch tools, raylib's ExportImage for everything but PPM
+
+// the image as packed 8 bit RGB, the pixel data of binary PPM and rgb24 raw video
+bool write_rgb(Image *image, FILE *f) {
+    Color *pixels = (Color*)image->data;
+    uint8_t *row = malloc((size_t)image->width * 3);
+    bool ok = true;
+    for(int y = 0; y < image->height && ok; ++y) {
+        for(int x = 0; x < image->width; ++x) {
+            Color c = pixels[(size_t)y * image->width + x];
+            row[x * 3] = c.r;
+            row[x * 3 + 1] = c.g;
+            row[x * 3 + 2] = c.b;
+        }
+        ok = fwrite(row, 3, image->width, f) == (size_t)image->width;
+    }
+    free(row);
+    return ok;
+}
+
+// binary PPM (P6), raylib can't export those
+bool write_ppm(Image *image, const char *path) {
+    FILE *f = fopen(path, "wb");
+    if(f == NULL) { return false; }
+    fprintf(f, "P6\n%d %d\n255\n", image->width, image->height);
+    bool ok = write_rgb(image, f);
+    return fclose(f) == 0 && ok;
+}
+
+bool write_image(Image *image, const char *path) {
+    const char *ext = strrchr(path, '.');
+    if(ext != NULL && strcmp(ext, ".ppm") == 0) {
+        return write_ppm(image, path);
+    }
+    return ExportImage(*image, path);
+}
+
+#endif // IMAGE_IO_H
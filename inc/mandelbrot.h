@@ -1,22 +1,50 @@
+#ifndef MANDELBROT_H
+#define MANDELBROT_H
+
 #include <stdint.h>
 #include "gmp.h"
+#include "draw_fractal.h"
 
 typedef struct MandelbrotCFG {
     uint32_t iterations;
+    double bailout2; // squared escape radius
     double cx, cy; // center x/y
     double zoom;
 } MandelbrotCFG;
 
-uint32_t mandelbrot(double x, double y, MandelbrotCFG *cfg) {
+// Continuous escape iteration from |z|^2 right after escaping. Normalized to the bailout, so it runs from iter to iter + 1
+// without jumps between neighbouring iteration counts.
+float smooth_iteration(uint32_t iter, double abs_z2, double bailout2) {
+    return (float)(iter + 1 - log2(log(abs_z2) / log(bailout2)));
+}
+
+// Exterior distance estimate (Milnor) from |z|^2 and |dz|^2 right after escaping, dz the derivative of z by the point.
+// The true distance to the set lies between a quarter of it and it, in the units dz was taken in.
+float distance_estimate(double abs_z2, double abs_der2) {
+    return (float)(sqrt(abs_z2 / abs_der2) * log(abs_z2)); // 2 |z| ln|z| / |dz|
+}
+
+uint32_t mandelbrot(double x, double y, MandelbrotCFG *cfg, const atomic_bool *cancel, SampleInfo_t *info, OrbitState_t *orbit) {
     uint32_t iter = 0;
 
     double re_c = x / cfg->zoom + cfg->cx;
     double im_c = y / cfg->zoom + cfg->cy;
-    // start at zero
+    // start at zero, or where the orbit stopped before
     double re = 0.0;
     double im = 0.0;
-    double re2 = 0.0;
-    double im2 = 0.0;
+    // dz/dx for the distance estimate, by the kernel's x instead of c so it doesn't overflow at deep zooms
+    double der_re = 0.0;
+    double der_im = 0.0;
+    double scale = 1.0 / cfg->zoom;
+    if(orbit != NULL) {
+        re = orbit->re;
+        im = orbit->im;
+        iter = orbit->iteration;
+        der_re = orbit->der_re;
+        der_im = orbit->der_im;
+    }
+    double re2 = re * re;
+    double im2 = im * im;
 
     /*
     "Optimized escape time algorithm" from wikipedia
@@ -33,17 +61,37 @@ uint32_t mandelbrot(double x, double y, MandelbrotCFG *cfg) {
         iteration:= iteration + 1
     */
     while(iter < cfg->iterations) {
+        if((iter & (CANCEL_CHECK_INTERVAL - 1)) == 0 && cancel != NULL && atomic_load_explicit(cancel, memory_order_relaxed)) {
+            return ITER_CANCELLED;
+        }
+        if(info != NULL) {
+            // dz' = 2 z dz + dc/dx
+            double t = 2 * (re * der_re - im * der_im) + scale;
+            der_im = 2 * (re * der_im + im * der_re);
+            der_re = t;
+        }
         im = 2 * re * im + im_c;
         re = re2 - im2 + re_c;
         re2 = re * re;
         im2 = im * im;
 
-        if(re2 + im2 > 4.0) {
+        if(re2 + im2 > cfg->bailout2) {
+            if(info != NULL) {
+                info->smooth = smooth_iteration(iter, re2 + im2, cfg->bailout2);
+                info->distance = distance_estimate(re2 + im2, der_re * der_re + der_im * der_im);
+            }
             return iter;
         }
         ++iter;
     }
-    return INT32_MAX;
+    if(info != NULL) {
+        info->smooth = (float)cfg->iterations;
+        info->distance = 0.0f;
+    }
+    if(orbit != NULL) {
+        *orbit = (OrbitState_t) {re, im, der_re, der_im, iter, 0};
+    }
+    return UINT32_MAX;
 }
 
 typedef struct ArbPrecFrame {
@@ -51,6 +99,52 @@ typedef struct ArbPrecFrame {
     mpf_t zoom;
 } ArbPrecFrame;
 
+// Make sure the center keeps enough bits to move by fractions of a pixel at the frame's zoom.
+void frame_fit_prec(ArbPrecFrame *frame) {
+    signed long zoom_exp;
+    mpf_get_d_2exp(&zoom_exp, frame->zoom);
+    mp_bitcnt_t bits = (zoom_exp > 0 ? zoom_exp : 0) + 128;
+    if(mpf_get_prec(frame->c_re) < bits) { mpf_set_prec(frame->c_re, bits); }
+    if(mpf_get_prec(frame->c_im) < bits) { mpf_set_prec(frame->c_im, bits); }
+}
+
+// Move the frame's center by (dx, dy) pixels of a width pixels wide image (re/im range -2 to 2 across the width at zoom 1).
+void frame_pan(ArbPrecFrame *frame, double dx, double dy, uint32_t width) {
+    frame_fit_prec(frame);
+    mpf_t d;
+    mpf_init2(d, mpf_get_prec(frame->c_re));
+
+    mpf_set_d(d, dx * 4.0 / width);
+    mpf_div(d, d, frame->zoom);
+    mpf_add(frame->c_re, frame->c_re, d);
+
+    mpf_set_d(d, dy * 4.0 / width);
+    mpf_div(d, d, frame->zoom);
+    mpf_add(frame->c_im, frame->c_im, d);
+
+    mpf_clear(d);
+}
+
+// copy src into the already initialised dst
+void frame_set(ArbPrecFrame *dst, const ArbPrecFrame *src) {
+    mpf_set_prec(dst->c_re, mpf_get_prec(src->c_re));
+    mpf_set_prec(dst->c_im, mpf_get_prec(src->c_im));
+    mpf_set_prec(dst->zoom, mpf_get_prec(src->zoom));
+    mpf_set(dst->c_re, src->c_re);
+    mpf_set(dst->c_im, src->c_im);
+    mpf_set(dst->zoom, src->zoom);
+}
+
+// Zoom the frame in (or out) by an integer factor around its center.
+void frame_zoom(ArbPrecFrame *frame, uint32_t factor, bool out) {
+    if(out) {
+        mpf_div_ui(frame->zoom, frame->zoom, factor);
+    } else {
+        mpf_mul_ui(frame->zoom, frame->zoom, factor);
+    }
+    frame_fit_prec(frame);
+}
+
 typedef struct ArbPrecMandelbrotCFG {
     uint32_t iterations;
     mpf_t c_re, c_im; // center x/y
@@ -59,7 +153,8 @@ typedef struct ArbPrecMandelbrotCFG {
 } ArbPrecMandelbrotCFG;
 
 // This leaks memory like crazy by not clear-ing the mpf_t's. not used anyway so not going to fix.
-uint32_t arb_prec_mandelbrot(double x, double y, ArbPrecMandelbrotCFG *cfg) {
+// Always starts over, a double orbit state can't hold its z. Leaves the distance estimate unknown (0).
+uint32_t arb_prec_mandelbrot(double x, double y, ArbPrecMandelbrotCFG *cfg, const atomic_bool *cancel, SampleInfo_t *info, OrbitState_t *orbit) {
     uint32_t iter = 0;
 
     // C value
@@ -103,6 +198,9 @@ uint32_t arb_prec_mandelbrot(double x, double y, ArbPrecMandelbrotCFG *cfg) {
         iteration:= iteration + 1
     */
     while(iter < cfg->iterations) {
+        if((iter & (CANCEL_CHECK_INTERVAL - 1)) == 0 && cancel != NULL && atomic_load_explicit(cancel, memory_order_relaxed)) {
+            return ITER_CANCELLED;
+        }
         // im = 2 * re * im + im_c;
         mpf_mul(im, re, im);
         mpf_mul_2exp(im, im, 1);
@@ -119,6 +217,9 @@ uint32_t arb_prec_mandelbrot(double x, double y, ArbPrecMandelbrotCFG *cfg) {
         mpf_mul(im2, im, im);
 
         if(mpf_get_d(re2) + mpf_get_d(im2) > 4.0) {
+            if(info != NULL) {
+                info->smooth = smooth_iteration(iter, mpf_get_d(re2) + mpf_get_d(im2), 4.0);
+            }
             return iter;
         }
         ++iter;
@@ -131,11 +232,29 @@ typedef struct RefIter {
     uint32_t iterations;
     double *re;
     double *im;
+    mpf_t c_re, c_im; // c of the reference orbit, the frame may move away from it
 } RefIter;
 
+// reference orbit at the frame's center from points computed before (e.g. loaded from a checkpoint), takes re_pts and im_pts
+RefIter wrap_ref_iter(ArbPrecFrame *frame, mp_bitcnt_t precision_bits, uint32_t iterations, double *re_pts, double *im_pts) {
+    RefIter ref = {iterations, re_pts, im_pts};
+    mpf_init2(ref.c_re, precision_bits);
+    mpf_init2(ref.c_im, precision_bits);
+    mpf_set(ref.c_re, frame->c_re);
+    mpf_set(ref.c_im, frame->c_im);
+    return ref;
+}
+
+// Returns an orbit without points (re NULL, drop it all the same) if they can't be allocated.
 RefIter build_ref_iter(ArbPrecFrame *frame, mp_bitcnt_t precision_bits, uint32_t iterations) {
-    double *re_pts = (double*) malloc(iterations * sizeof(double));
-    double *im_pts = (double*) malloc(iterations * sizeof(double));
+    double *re_pts = (double*) malloc((size_t)iterations * sizeof(double));
+    double *im_pts = (double*) malloc((size_t)iterations * sizeof(double));
+    if(re_pts == NULL || im_pts == NULL) {
+        printf("not enough memory for a reference orbit of %u iterations\n", iterations);
+        free(re_pts);
+        free(im_pts);
+        return wrap_ref_iter(frame, precision_bits, 0, NULL, NULL);
+    }
 
     // C value
     mpf_t re_c;
@@ -208,35 +327,83 @@ RefIter build_ref_iter(ArbPrecFrame *frame, mp_bitcnt_t precision_bits, uint32_t
     // deallocate memory from arb-precision floats
     mpf_clears(&re, &im, &re2, &im2, &re_c, &im_c, NULL);
 
-    return (RefIter) {iterations, re_pts, im_pts};
+    return wrap_ref_iter(frame, precision_bits, iterations, re_pts, im_pts);
 }
 
 void drop_ref_iter(RefIter *ref) {
     free(ref->im);
     free(ref->re);
+    mpf_clears(ref->c_re, ref->c_im, NULL);
 }
 
 typedef struct PerturbMandelbrotCFG {
     uint32_t iterations;
+    double bailout2; // squared escape radius
     RefIter *reference;
     ArbPrecFrame *frame;
+
+    // derived from frame and reference by perturb_update_cfg, so the render threads never touch GMP values
+    double scale; // 1 / zoom
+    double ref_off_re, ref_off_im; // frame center - reference c
 } PerturbMandelbrotCFG;
 
-uint32_t perturb_mandelbrot(double x, double y, PerturbMandelbrotCFG *cfg) {
+// call after changing the frame or reference
+void perturb_update_cfg(PerturbMandelbrotCFG *cfg) {
+    mpf_t d;
+    mpf_init2(d, mpf_get_prec(cfg->frame->c_re));
+
+    cfg->scale = 1.0 / mpf_get_d(cfg->frame->zoom);
+    mpf_sub(d, cfg->frame->c_re, cfg->reference->c_re);
+    cfg->ref_off_re = mpf_get_d(d);
+    mpf_sub(d, cfg->frame->c_im, cfg->reference->c_im);
+    cfg->ref_off_im = mpf_get_d(d);
+
+    mpf_clear(d);
+}
+
+#define GLITCH_TOLERANCE2 1e-6 // |z|^2 below this fraction of |Z_ref|^2 counts as a glitch (Pauldelbrot's criterion)
+
+uint32_t perturb_mandelbrot(double x, double y, PerturbMandelbrotCFG *cfg, const atomic_bool *cancel, SampleInfo_t *info, OrbitState_t *orbit) {
     double reDz = 0.0;
     double imDz = 0.0;
-    double scale = 1.0 / mpf_get_d(cfg->frame->zoom);
-    double reDc = x * scale;
-    double imDc = y * scale;
+    double reDc = x * cfg->scale + cfg->ref_off_re;
+    double imDc = y * cfg->scale + cfg->ref_off_im;
+
+    // derivative of the full z by the kernel's x for the distance estimate, only tracked if info is wanted.
+    // Rebasing changes how z is split up, not z itself, so it carries on through rebases.
+    double reDer = 0.0;
+    double imDer = 0.0;
 
     uint32_t iteration = 0;
     uint32_t ref_iteration = 0;
+    if(orbit != NULL) {
+        // continue where the orbit stopped at a lower cap, the reference is still the same
+        reDz = orbit->re;
+        imDz = orbit->im;
+        reDer = orbit->der_re;
+        imDer = orbit->der_im;
+        iteration = orbit->iteration;
+        ref_iteration = orbit->ref_iteration;
+    }
 
     // TODO SIMDify
     while(iteration < cfg->iterations) {
+        if((iteration & (CANCEL_CHECK_INTERVAL - 1)) == 0 && cancel != NULL && atomic_load_explicit(cancel, memory_order_relaxed)) {
+            return ITER_CANCELLED;
+        }
+
         double reRef = cfg->reference->re[ref_iteration];
         double imRef = cfg->reference->im[ref_iteration];
 
+        if(info != NULL) {
+            // dz' = 2 z dz + dc/dx with the full z = Z_ref + dz
+            double re_z = reRef + reDz;
+            double im_z = imRef + imDz;
+            double t = 2 * (re_z * reDer - im_z * imDer) + cfg->scale;
+            imDer = 2 * (re_z * imDer + im_z * reDer);
+            reDer = t;
+        }
+
         double temp_reDz = 2 * (reDz * reRef - imDz * imRef) + reDz * reDz - imDz * imDz + reDc;
         double temp_imDz = 2 * (reDz * imRef + imDz * reRef + reDz * imDz) + imDc;
 
@@ -252,9 +419,16 @@ uint32_t perturb_mandelbrot(double x, double y, PerturbMandelbrotCFG *cfg) {
         double im_z = imRef + imDz;
 
         double abs_z2 = re_z * re_z + im_z * im_z;
-        if(abs_z2 > 100.0) {
+        if(abs_z2 > cfg->bailout2) {
+            if(info != NULL) {
+                info->smooth = smooth_iteration(iteration, abs_z2, cfg->bailout2);
+                info->distance = distance_estimate(abs_z2, reDer * reDer + imDer * imDer);
+            }
             return iteration;
         }
+        if(info != NULL && abs_z2 < GLITCH_TOLERANCE2 * (reRef * reRef + imRef * imRef)) {
+            info->flags |= SAMPLE_GLITCH;
+        }
 
         double abs_dz2 = reDz * reDz + imDz * imDz;
 
@@ -267,7 +441,14 @@ uint32_t perturb_mandelbrot(double x, double y, PerturbMandelbrotCFG *cfg) {
 
         iteration++;
     }
-    
+
+    if(info != NULL) {
+        info->smooth = (float)cfg->iterations;
+        info->distance = 0.0f;
+    }
+    if(orbit != NULL) {
+        *orbit = (OrbitState_t) {reDz, imDz, reDer, imDer, iteration, ref_iteration};
+    }
     return UINT32_MAX;
 }
 /*
@@ -310,4 +491,6 @@ while (Iteration < MaxIteration) {
     Iteration++;
 
 }
-*/
\ No newline at end of file
+*/
+
+#endif // MANDELBROT_H
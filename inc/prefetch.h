@@ -0,0 +1,167 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "gmp.h"
+#include "draw_fractal.h"
+#include "mandelbrot.h"
+#include "fractal_params.h"
+#include "tile_cache.h"
+
+// Idle time prefetch: once a view is done, the views the user is likely to go to next are rendered into the tile
+// cache, so going there comes up from the cache like going back does. The 2x zoom under the cursor goes first, then
+// the views a screen to each side. The jobs run on the viewer's pool below everything else (queue_last) and are
+// cancelled as soon as there's real work.
+
+#define PREFETCH_TARGETS 5
+
+// a view to prefetch, relative to the view it was planned from
+typedef struct PrefetchTarget_t {
+    double cdx, cdy; // center offset in pixels of the planned view
+    bool zoom_in; // zoomed in by 2 around the offset center
+} PrefetchTarget_t;
+
+typedef struct Prefetcher_t {
+    RenderPool_t *pool;
+    TileCache_t *cache;
+    FractalSetup_t *source; // the viewer's setup, prefetch renders share its reference orbit
+    FractalSetup_t setup; // the view being prefetched, only the frame is its own
+    ArbPrecFrame base; // frame of the planned view
+    uint32_t width, height;
+    RenderOptions_t opts;
+    PrefetchTarget_t targets[PREFETCH_TARGETS];
+    uint32_t n_targets, next;
+
+    FractalBuffer_t *buf; // of the current or last job, a cancelled job may still hold a reference
+    RenderJob_t *job; // NULL while none is running
+    uint64_t views, kernel_calls; // prefetched so far
+} Prefetcher_t;
+
+void prefetch_init(Prefetcher_t *p, RenderPool_t *pool, TileCache_t *cache, FractalSetup_t *source) {
+    p->pool = pool;
+    p->cache = cache;
+    p->source = source;
+    mpf_inits(p->setup.frame.c_re, p->setup.frame.c_im, p->setup.frame.zoom, NULL);
+    mpf_inits(p->base.c_re, p->base.c_im, p->base.zoom, NULL);
+    p->width = 0;
+    p->height = 0;
+    p->n_targets = 0;
+    p->next = 0;
+    p->buf = NULL;
+    p->job = NULL;
+    p->views = 0;
+    p->kernel_calls = 0;
+}
+
+// Forget the plan and cancel the running job without waiting for it.
+void prefetch_cancel(Prefetcher_t *p) {
+    p->n_targets = 0;
+    p->next = 0;
+    if(p->job != NULL) {
+        DrawFractal_threaded_cancel(p->job);
+        p->job = NULL;
+    }
+}
+
+// Plan the prefetch around the source's current view, width x height pixels. cursor_x/y is where the next zoom in is
+// expected, in image pixels. opts are the viewer's, prefetching renders without guessing and antialiasing.
+void prefetch_plan(Prefetcher_t *p, uint32_t width, uint32_t height, double cursor_x, double cursor_y, RenderOptions_t opts) {
+    prefetch_cancel(p);
+    frame_set(&p->base, &p->source->frame);
+    p->width = width;
+    p->height = height;
+    p->opts = opts;
+    p->opts.guess = false;
+    p->opts.antialias = 0;
+    p->opts.sample_info = false;
+    p->opts.keep_orbits = false;
+    p->opts.queue_last = true;
+    p->opts.order = TILE_ORDER_SPIRAL;
+
+    PrefetchTarget_t *t = p->targets;
+    t[0] = (PrefetchTarget_t) {zoom_center_offset(width, 0.5, cursor_x), zoom_center_offset(height, 0.5, cursor_y), true};
+    t[1] = (PrefetchTarget_t) {width, 0.0, false};
+    t[2] = (PrefetchTarget_t) {-(double)width, 0.0, false};
+    t[3] = (PrefetchTarget_t) {0.0, height, false};
+    t[4] = (PrefetchTarget_t) {0.0, -(double)height, false};
+    p->n_targets = PREFETCH_TARGETS;
+}
+
+// Start the job of the next target that isn't cached completely yet. No job may be using the buffer anymore.
+void prefetch_start_next(Prefetcher_t *p) {
+    while(p->next < p->n_targets) {
+        PrefetchTarget_t t = p->targets[p->next++];
+        FractalSetup_t *s = &p->setup;
+        s->kernel = p->source->kernel;
+        s->perturb = p->source->perturb;
+        s->perturb.frame = &s->frame;
+        s->plain = p->source->plain;
+        frame_set(&s->frame, &p->base);
+        frame_pan(&s->frame, t.cdx, t.cdy, p->width);
+        if(t.zoom_in) {
+            frame_zoom(&s->frame, 2, false);
+        }
+        fractal_setup_update(s);
+
+        if(p->buf != NULL && (p->buf->image->width != p->width || p->buf->image->height != p->height)) {
+            fractal_buffer_release(p->buf);
+            p->buf = NULL;
+        }
+        if(p->buf == NULL) {
+            p->buf = fractal_buffer_create(p->width, p->height);
+        } else {
+            memset(p->buf->flags, 0, (size_t)p->width * p->height);
+        }
+        CacheView_t view = tile_cache_view(s, p->width, p->height);
+        if(!view.valid) { continue; }
+        uint64_t cached = tile_cache_fill(p->cache, &view, p->buf, p->opts.palette);
+        if(cached == (uint64_t)p->width * p->height) { continue; }
+
+        p->job = DrawFractal_threaded_start(p->pool, p->buf, fractal_setup_fn(s), fractal_setup_cfg(s), 1, PASS_SAMPLE, p->opts, p->width / 2.0, p->height / 2.0, NULL, 0);
+        return;
+    }
+}
+
+// Call regularly while the viewer has nothing to render: stores the finished job's samples and starts the next one.
+// Returns true while there's prefetching left to do.
+bool prefetch_update(Prefetcher_t *p) {
+    if(p->job != NULL) {
+        if(!check_threaded_render_status(p->job).done) { return true; }
+        p->kernel_calls += p->job->kernel_calls;
+        DrawFractal_threaded_end(p->job);
+        p->job = NULL;
+        CacheView_t view = tile_cache_view(&p->setup, p->width, p->height);
+        tile_cache_store(p->cache, &view, p->buf);
+        ++(p->views);
+        printf("prefetched view %u of %u (%" PRIu64 " views, %" PRIu64 " samples so far)\n", p->next, p->n_targets, p->views, p->kernel_calls);
+    }
+    // the config of a cancelled job has to stay as it is until the job let go of its buffer
+    if(p->buf != NULL && atomic_load(&p->buf->refs) > 1) { return p->next < p->n_targets; }
+    prefetch_start_next(p);
+    return p->job != NULL;
+}
+
+// Cancel and wait until no render thread is in a prefetch job anymore, e.g. before the source's reference orbit
+// the jobs share is rebuilt. Cancelled jobs stop within CANCEL_CHECK_INTERVAL iterations.
+void prefetch_wait(Prefetcher_t *p) {
+    prefetch_cancel(p);
+    if(p->buf == NULL) { return; }
+    struct timespec poll = {0, RENDER_WAIT_POLL_NS};
+    while(atomic_load(&p->buf->refs) > 1) {
+        nanosleep(&poll, NULL);
+    }
+}
+
+// stop prefetching for good, before the pool and the source go away
+void prefetch_destroy(Prefetcher_t *p) {
+    prefetch_wait(p);
+    if(p->buf != NULL) {
+        fractal_buffer_release(p->buf);
+        p->buf = NULL;
+    }
+    mpf_clears(p->setup.frame.c_re, p->setup.frame.c_im, p->setup.frame.zoom, NULL);
+    mpf_clears(p->base.c_re, p->base.c_im, p->base.zoom, NULL);
+}
+
+#endif // PREFETCH_H
@@ -0,0 +1,287 @@
+#ifndef RAW_FORMAT_H
+#define RAW_FORMAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "raylib.h"
+#include "pthread.h"
+#include "draw_fractal.h"
+
+// Raw render data (.gfr) for recolouring without rendering again. Layout, all little endian:
+//
+//   RawHeader_t
+//   params_len bytes of location parameters as written by params_write, padded to 8 bytes
+//   n_tiles RawTileEntry_t, tiles in rows of RAW_TILE_SIZE x RAW_TILE_SIZE pixels (smaller at the right and bottom)
+//   tile data
+//
+// A tile holds one array per channel in the order of the RAW_CH_* bits, row major within the tile:
+// uint32_t iteration counts (UINT32_MAX inside), float smooth iterations, float distance estimates in pixels (0 inside),
+// uint8_t SAMPLE_* flags.
+// Uncompressed tiles start at multiples of 8 bytes, so the arrays can be used straight from a mapping of the file.
+// Compressed tiles are DEFLATE streams (raylib's CompressData) of the same bytes.
+
+#define RAW_MAGIC "GMPFRAW1"
+#define RAW_VERSION 1
+#define RAW_TILE_SIZE 64
+
+#define RAW_CH_ITERS 0x01
+#define RAW_CH_SMOOTH 0x02
+#define RAW_CH_DISTANCE 0x04
+#define RAW_CH_FLAGS 0x08
+
+typedef struct RawHeader_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t tile_size;
+    uint32_t channels; // RAW_CH_*
+    uint32_t compressed; // 1 if tiles are DEFLATE compressed
+    uint32_t params_len;
+    uint32_t n_tiles;
+    uint64_t index_offset; // file offset of the tile entries
+} RawHeader_t;
+
+typedef struct RawTileEntry_t {
+    uint64_t offset; // file offset of the tile data
+    uint64_t size; // bytes in the file
+    uint64_t raw_size; // bytes once decompressed
+} RawTileEntry_t;
+
+uint64_t raw_align8(uint64_t n) {
+    return (n + 7) & ~(uint64_t)7;
+}
+
+// bytes per pixel of the channels
+uint32_t raw_pixel_size(uint32_t channels) {
+    return (channels & RAW_CH_ITERS ? sizeof(uint32_t) : 0) + (channels & RAW_CH_SMOOTH ? sizeof(float) : 0)
+        + (channels & RAW_CH_DISTANCE ? sizeof(float) : 0) + (channels & RAW_CH_FLAGS ? sizeof(uint8_t) : 0);
+}
+
+// pixel rect of tile i
+PixelRect_t raw_tile_rect(const RawHeader_t *h, uint32_t i) {
+    uint32_t tiles_x = (h->width + h->tile_size - 1) / h->tile_size;
+    uint32_t x0 = (i % tiles_x) * h->tile_size;
+    uint32_t y0 = (i / tiles_x) * h->tile_size;
+    return (PixelRect_t) {
+        x0, y0,
+        x0 + h->tile_size < h->width ? x0 + h->tile_size : h->width,
+        y0 + h->tile_size < h->height ? y0 + h->tile_size : h->height
+    };
+}
+
+// pointers to the channel arrays of a tile's (decompressed) data
+typedef struct RawTileData_t {
+    uint32_t *iters;
+    float *smooth;
+    float *distance;
+    uint8_t *flags;
+} RawTileData_t;
+
+RawTileData_t raw_tile_arrays(uint32_t channels, uint8_t *data, uint32_t n_pixels) {
+    RawTileData_t t = {NULL, NULL, NULL, NULL};
+    if(channels & RAW_CH_ITERS) { t.iters = (uint32_t*)data; data += n_pixels * sizeof(uint32_t); }
+    if(channels & RAW_CH_SMOOTH) { t.smooth = (float*)data; data += n_pixels * sizeof(float); }
+    if(channels & RAW_CH_DISTANCE) { t.distance = (float*)data; data += n_pixels * sizeof(float); }
+    if(channels & RAW_CH_FLAGS) { t.flags = data; }
+    return t;
+}
+
+typedef struct RawWriteTask_t {
+    const RawHeader_t *header;
+    FractalBuffer_t *buf;
+    uint8_t **data; // per tile, packed (and compressed) by the writer threads
+    RawTileEntry_t *entries;
+    atomic_uint next_tile;
+} RawWriteTask_t;
+
+// packs tiles until none are left
+void* raw_pack_thread(RawWriteTask_t *task) {
+    const RawHeader_t *h = task->header;
+    FractalBuffer_t *buf = task->buf;
+    uint32_t width = buf->image->width;
+    uint32_t i;
+    while((i = atomic_fetch_add(&task->next_tile, 1)) < h->n_tiles) {
+        PixelRect_t r = raw_tile_rect(h, i);
+        uint32_t tw = r.x1 - r.x0;
+        uint32_t n_pixels = tw * (r.y1 - r.y0);
+        uint64_t raw_size = (uint64_t)n_pixels * raw_pixel_size(h->channels);
+        uint8_t *data = malloc(raw_size);
+        RawTileData_t t = raw_tile_arrays(h->channels, data, n_pixels);
+        for(uint32_t y = r.y0; y < r.y1; ++y) {
+            for(uint32_t x = r.x0; x < r.x1; ++x) {
+                size_t idx = (size_t)y * width + x;
+                size_t ti = (size_t)(y - r.y0) * tw + (x - r.x0);
+                SampleInfo_t info = buf->info != NULL ? buf->info[idx] : (SampleInfo_t) {(float)buf->iters[idx], 0, 0.0f};
+                if(t.iters != NULL) { t.iters[ti] = buf->iters[idx]; }
+                if(t.smooth != NULL) { t.smooth[ti] = info.smooth; }
+                if(t.distance != NULL) { t.distance[ti] = info.distance * width / 4.0f; }
+                if(t.flags != NULL) { t.flags[ti] = info.flags; }
+            }
+        }
+        task->entries[i].raw_size = raw_size;
+        if(h->compressed) {
+            int size = 0;
+            task->data[i] = CompressData(data, (int)raw_size, &size);
+            task->entries[i].size = size;
+            free(data);
+        } else {
+            task->data[i] = data;
+            task->entries[i].size = raw_size;
+        }
+    }
+    return NULL;
+}
+
+// Write the samples of buf (all of them known, at step 1) to path with the location parameters params_text.
+// Tiles are packed and compressed on threads writer threads of their own (not the render pool's), then written in order.
+bool raw_write(const char *path, FractalBuffer_t *buf, const char *params_text, bool compress, uint32_t threads) {
+    RawHeader_t h = {
+        .version = RAW_VERSION,
+        .width = buf->image->width,
+        .height = buf->image->height,
+        .tile_size = RAW_TILE_SIZE,
+        .channels = RAW_CH_ITERS | RAW_CH_SMOOTH | RAW_CH_DISTANCE | RAW_CH_FLAGS,
+        .compressed = compress ? 1 : 0,
+        .params_len = strlen(params_text),
+    };
+    memcpy(h.magic, RAW_MAGIC, sizeof(h.magic));
+    uint32_t tiles_x = (h.width + RAW_TILE_SIZE - 1) / RAW_TILE_SIZE;
+    uint32_t tiles_y = (h.height + RAW_TILE_SIZE - 1) / RAW_TILE_SIZE;
+    h.n_tiles = tiles_x * tiles_y;
+    h.index_offset = raw_align8(sizeof(RawHeader_t) + h.params_len);
+
+    RawWriteTask_t task = {.header = &h, .buf = buf};
+    task.data = malloc(h.n_tiles * sizeof(uint8_t*));
+    task.entries = malloc(h.n_tiles * sizeof(RawTileEntry_t));
+    atomic_init(&task.next_tile, 0);
+    if(threads == 0) { threads = 1; }
+    pthread_t *tid = malloc(threads * sizeof(pthread_t));
+    for(uint32_t i = 0; i < threads; ++i) {
+        pthread_create(&tid[i], NULL, (void* (*)(void*)) &raw_pack_thread, &task);
+    }
+    for(uint32_t i = 0; i < threads; ++i) {
+        pthread_join(tid[i], NULL);
+    }
+    free(tid);
+
+    uint64_t offset = raw_align8(h.index_offset + h.n_tiles * sizeof(RawTileEntry_t));
+    for(uint32_t i = 0; i < h.n_tiles; ++i) {
+        task.entries[i].offset = offset;
+        offset = raw_align8(offset + task.entries[i].size);
+    }
+
+    FILE *f = fopen(path, "wb");
+    bool ok = f != NULL;
+    static const uint8_t zeros[8] = {0};
+    if(ok) {
+        ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(params_text, 1, h.params_len, f) == h.params_len
+            && fwrite(zeros, 1, h.index_offset - sizeof(h) - h.params_len, f) == h.index_offset - sizeof(h) - h.params_len
+            && fwrite(task.entries, sizeof(RawTileEntry_t), h.n_tiles, f) == h.n_tiles;
+        uint64_t pos = h.index_offset + h.n_tiles * sizeof(RawTileEntry_t);
+        for(uint32_t i = 0; i < h.n_tiles && ok; ++i) {
+            uint64_t pad = task.entries[i].offset - pos;
+            ok = fwrite(zeros, 1, pad, f) == pad && fwrite(task.data[i], 1, task.entries[i].size, f) == task.entries[i].size;
+            pos = task.entries[i].offset + task.entries[i].size;
+        }
+        ok = fclose(f) == 0 && ok;
+    }
+    for(uint32_t i = 0; i < h.n_tiles; ++i) {
+        if(compress) {
+            MemFree(task.data[i]);
+        } else {
+            free(task.data[i]);
+        }
+    }
+    free(task.data);
+    free(task.entries);
+    return ok;
+}
+
+// a .gfr file mapped for reading
+typedef struct RawFile_t {
+    uint8_t *map;
+    size_t size;
+    const RawHeader_t *header;
+    const char *params; // not terminated, header->params_len bytes
+    const RawTileEntry_t *entries;
+} RawFile_t;
+
+// Whether everything the header and the tile index say fits the file: the tile count matches the image, every tile
+// has the size of its pixels' channels, and the parameters, the index and the tile data are inside the mapping.
+// Anything reading the file after raw_open relies on this. Sets raw->entries once they're known to be in the file.
+bool raw_valid(RawFile_t *raw) {
+    const RawHeader_t *h = raw->header;
+    if(memcmp(h->magic, RAW_MAGIC, sizeof(h->magic)) != 0 || h->version != RAW_VERSION) { return false; }
+    if(h->width == 0 || h->height == 0 || h->tile_size == 0 || (h->channels & ~(uint32_t)0x0F) != 0) { return false; }
+    uint64_t tiles_x = ((uint64_t)h->width + h->tile_size - 1) / h->tile_size;
+    uint64_t tiles_y = ((uint64_t)h->height + h->tile_size - 1) / h->tile_size;
+    if(h->n_tiles != tiles_x * tiles_y) { return false; }
+    if(raw_align8(h->params_len) > raw->size - sizeof(RawHeader_t)) { return false; }
+    // the entries are read in place, 8 byte aligned
+    if(h->index_offset % 8 != 0 || h->index_offset > raw->size
+       || (uint64_t)h->n_tiles * sizeof(RawTileEntry_t) > raw->size - h->index_offset) { return false; }
+    raw->entries = (const RawTileEntry_t*)(raw->map + h->index_offset);
+    for(uint32_t i = 0; i < h->n_tiles; ++i) {
+        const RawTileEntry_t *e = &raw->entries[i];
+        PixelRect_t r = raw_tile_rect(h, i);
+        uint64_t bytes = (uint64_t)(r.x1 - r.x0) * (r.y1 - r.y0) * raw_pixel_size(h->channels);
+        if(e->raw_size != bytes || e->offset > raw->size || e->size > raw->size - e->offset) { return false; }
+        if(h->compressed ? e->size > INT32_MAX : e->size != bytes || e->offset % 8 != 0) { return false; }
+    }
+    return true;
+}
+
+bool raw_open(RawFile_t *raw, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        printf("can't open %s\n", path);
+        return false;
+    }
+    struct stat st;
+    raw->map = NULL;
+    if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(RawHeader_t)) {
+        raw->size = st.st_size;
+        raw->map = mmap(NULL, raw->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(raw->map == MAP_FAILED) { raw->map = NULL; }
+    }
+    close(fd);
+    if(raw->map == NULL) {
+        printf("can't map %s\n", path);
+        return false;
+    }
+    raw->header = (const RawHeader_t*)raw->map;
+    raw->params = (const char*)raw->map + sizeof(RawHeader_t);
+    raw->entries = NULL;
+    if(!raw_valid(raw)) {
+        printf("%s isn't a valid raw render file\n", path);
+        munmap(raw->map, raw->size);
+        return false;
+    }
+    return true;
+}
+
+// Data of tile i. Uncompressed tiles point into the mapping, compressed ones are decompressed into
+// *scratch (which the caller frees with MemFree). Returns NULL if the tile is damaged.
+uint8_t* raw_tile(RawFile_t *raw, uint32_t i, uint8_t **scratch) {
+    const RawTileEntry_t *e = &raw->entries[i];
+    if(!raw->header->compressed) { return raw->map + e->offset; }
+    int size = 0;
+    *scratch = DecompressData(raw->map + e->offset, (int)e->size, &size);
+    if(*scratch != NULL && (uint64_t)size != e->raw_size) {
+        MemFree(*scratch);
+        *scratch = NULL;
+    }
+    return *scratch;
+}
+
+void raw_close(RawFile_t *raw) {
+    munmap(raw->map, raw->size);
+}
+
+#endif // RAW_FORMAT_H
@@ -0,0 +1,628 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "gmp.h"
+#include "draw_fractal.h"
+#include "mandelbrot.h"
+#include "fractal_params.h"
+#include "tile_cache.h"
+#include "server_protocol.h"
+
+// Render server: the requests of all clients render on one pool and go through one tile cache.
+// Locations keep their reference orbit once their requests are done. A request whose view contains the reference c
+// of a kept location (and needs no more iterations or precision than it has) renders with that orbit instead of
+// building its own, e.g. every tile of a view and the views panned or zoomed from it.
+// A few requests render at once, in priority order. One that outranks everything running starts right away with its
+// tiles on top of the pool's stack. Finished tiles are streamed back while the rest of the request renders, as long as
+// the client keeps up: its queued output is capped, tiles that don't fit wait for it to read. The render buffers of
+// its requests stay until then, they're capped as well, per client and for the whole server: a request whose buffers
+// don't fit waits before it starts.
+// The sockets are the caller's: messages come in through server_submit/server_cancel, replies are queued in the
+// client's output, server_update moves everything along.
+
+#define SERVER_STREAM_TILE 64 // edge of the tiles a render is streamed back in
+#define SERVER_MAX_LOCATIONS 16 // kept reference orbits, the least recently used idle one is dropped first
+#define SERVER_SCAN_INTERVAL_MS 20.0 // how often running requests are checked for finished tiles
+#define SERVER_MAX_REGION 8192 // longest edge of a request's region
+#define SERVER_MAX_VIEW (1u << 30) // longest edge of a view
+#define SERVER_MAX_OUTPUT (64u << 20) // bytes of tiles queued for one client, more wait until it has read them
+#define SERVER_MAX_CLIENT_REQUESTS 64 // pending, running and sending requests of one client
+#define SERVER_MAX_CLIENT_BUFFERS (1024ull << 20) // bytes of render buffers one client's requests hold at once
+#define SERVER_MAX_BUFFERS (4096ull << 20) // bytes of render buffers all requests hold at once
+
+// bytes waiting to be sent to a client
+typedef struct ServerOutput_t {
+    uint8_t *data;
+    size_t len, cap;
+    size_t sent; // bytes at the front that are out already
+} ServerOutput_t;
+
+typedef struct ServerClient_t {
+    int fd;
+    uint8_t *in; // received bytes of the message that isn't complete yet
+    size_t in_len, in_cap;
+    ServerOutput_t out;
+    bool failed; // a reply couldn't be queued, the client has to be disconnected
+} ServerClient_t;
+
+// a location and its reference orbit, shared by the requests rendering with it
+typedef struct ServerLocation_t {
+    bool used; // slot holds a location
+    FractalSetup_t setup;
+    uint32_t users; // requests holding it, including cancelled ones still in a render thread
+    double last_used_ms;
+} ServerLocation_t;
+
+typedef struct ServerRequest_t {
+    ServerClient_t *client; // NULL once the client is gone
+    uint32_t id;
+    int32_t priority;
+    uint64_t seq; // arrival order among requests of the same priority
+    uint32_t format;
+    uint32_t width, height; // of the view
+    uint32_t x, y, w, h; // region of the view
+    FractalParams_t params;
+    FractalSetup_t setup; // the region as a view of its own: own frame, the rest from the location
+    ServerLocation_t *location; // NULL until started
+    FractalBuffer_t *buf;
+    RenderJob_t *job;
+    uint32_t ntx, nty; // stream tiles of the region
+    uint8_t *sent; // per stream tile
+    uint64_t cached; // samples filled in from the tile cache
+    uint64_t kernel_calls; // once the render is done
+    double start_ms, next_scan_ms;
+    struct ServerRequest_t *next;
+} ServerRequest_t;
+
+typedef struct RenderServer_t {
+    RenderPool_t pool;
+    TileCache_t cache;
+    RenderOptions_t opts;
+    uint32_t in_flight; // requests rendering at once, unless a new one outranks them all
+    ServerLocation_t locations[SERVER_MAX_LOCATIONS];
+    ServerRequest_t *pending; // by priority, then arrival
+    ServerRequest_t *running;
+    ServerRequest_t *sending; // rendered, but the client hasn't taken all tiles yet
+    ServerRequest_t *cancelled; // until no render thread is in their job anymore
+    uint64_t seq;
+} RenderServer_t;
+
+// bytes queued that aren't sent yet
+size_t server_output_queued(const ServerOutput_t *o) {
+    return o->len - o->sent;
+}
+
+// Make room for n more bytes, returns false if there's no memory for them
+bool server_output_reserve(ServerOutput_t *o, size_t n) {
+    if(o->len + n <= o->cap) { return true; }
+    if(o->sent > 0) {
+        // what's out already goes before growing
+        memmove(o->data, o->data + o->sent, o->len - o->sent);
+        o->len -= o->sent;
+        o->sent = 0;
+        if(o->len + n <= o->cap) { return true; }
+    }
+    size_t cap = (o->len + n) * 2;
+    uint8_t *data = realloc(o->data, cap);
+    if(data == NULL) { return false; }
+    o->data = data;
+    o->cap = cap;
+    return true;
+}
+
+void server_output_append(ServerOutput_t *o, const void *data, size_t n) {
+    memcpy(o->data + o->len, data, n);
+    o->len += n;
+}
+
+// n more bytes were sent
+void server_output_consumed(ServerOutput_t *o, size_t n) {
+    o->sent += n;
+    if(o->sent == o->len) {
+        o->sent = 0;
+        o->len = 0;
+    }
+}
+
+// Queue a reply. If there's no memory for it the client is marked failed, a reply can't just go missing.
+void server_reply(ServerClient_t *client, ReplyType_t type, uint32_t id, uint32_t format, PixelRect_t rect, const void *data, uint32_t data_len) {
+    if(client == NULL || client->failed) { return; }
+    ReplyHeader_t h = {REPLY_MAGIC, type, id, format, rect.x0, rect.y0, rect.x1 - rect.x0, rect.y1 - rect.y0, data_len};
+    if(!server_output_reserve(&client->out, sizeof(h) + data_len)) {
+        printf("no memory for a reply to client %i\n", client->fd);
+        client->failed = true;
+        return;
+    }
+    server_output_append(&client->out, &h, sizeof(h));
+    if(data_len > 0) {
+        server_output_append(&client->out, data, data_len);
+    }
+}
+
+void server_reply_error(ServerClient_t *client, uint32_t id, const char *reason) {
+    printf("request %u rejected: %s\n", id, reason);
+    server_reply(client, REPLY_ERROR, id, 0, (PixelRect_t) {0, 0, 0, 0}, reason, strlen(reason));
+}
+
+void server_init(RenderServer_t *s, RenderPlacement_t placement, RenderOptions_t opts, size_t cache_bytes, uint32_t in_flight) {
+    render_pool_init(&s->pool, placement);
+    tile_cache_init(&s->cache, cache_bytes);
+    s->opts = opts;
+    s->in_flight = in_flight > 0 ? in_flight : 1;
+    memset(s->locations, 0, sizeof(s->locations));
+    s->pending = NULL;
+    s->running = NULL;
+    s->sending = NULL;
+    s->cancelled = NULL;
+    s->seq = 0;
+}
+
+void server_request_free(ServerRequest_t *r) {
+    params_free(&r->params);
+    mpf_clears(r->setup.frame.c_re, r->setup.frame.c_im, r->setup.frame.zoom, NULL);
+    if(r->buf != NULL) {
+        fractal_buffer_release(r->buf);
+    }
+    free(r->sent);
+    free(r);
+}
+
+void server_location_release(ServerLocation_t *loc) {
+    --(loc->users);
+    loc->last_used_ms = render_time_ms();
+}
+
+// true if the location's reference orbit serves the request's view
+bool server_location_serves(ServerLocation_t *loc, ServerRequest_t *r) {
+    const FractalSetup_t *ls = &loc->setup;
+    if(ls->kernel != r->params.kernel) { return false; }
+    if(ls->kernel != KERNEL_PERTURB) { return true; }
+    if(ls->ref.iterations < r->params.iterations || mpf_get_prec(ls->ref.c_re) < r->params.precision) { return false; }
+    // the reference c has to be in the view, in pixels from its center
+    mpf_t d;
+    mpf_init2(d, mpf_get_prec(r->setup.frame.c_re) + 64);
+    bool inside = true;
+    for(int axis = 0; axis < 2 && inside; ++axis) {
+        mpf_sub(d, axis == 0 ? ls->ref.c_re : ls->ref.c_im, axis == 0 ? r->setup.frame.c_re : r->setup.frame.c_im);
+        mpf_mul(d, d, r->setup.frame.zoom);
+        mpf_mul_ui(d, d, r->width);
+        mpf_div_2exp(d, d, 2);
+        inside = fabs(mpf_get_d(d)) <= (axis == 0 ? r->width : r->height) / 2.0;
+    }
+    mpf_clear(d);
+    return inside;
+}
+
+// A location whose reference orbit serves the request, set up for it if there's none. Returns NULL if every slot
+// is in use, or with invalid set if the location can't be set up.
+ServerLocation_t* server_location_for(RenderServer_t *s, ServerRequest_t *r, bool *invalid) {
+    *invalid = false;
+    ServerLocation_t *free_slot = NULL;
+    for(uint32_t i = 0; i < SERVER_MAX_LOCATIONS; ++i) {
+        ServerLocation_t *loc = &s->locations[i];
+        if(loc->used && server_location_serves(loc, r)) { return loc; }
+        if(!loc->used) {
+            free_slot = free_slot == NULL ? loc : free_slot;
+        }
+    }
+    if(free_slot == NULL) {
+        for(uint32_t i = 0; i < SERVER_MAX_LOCATIONS; ++i) {
+            ServerLocation_t *loc = &s->locations[i];
+            if(loc->users == 0 && (free_slot == NULL || loc->last_used_ms < free_slot->last_used_ms)) {
+                free_slot = loc;
+            }
+        }
+        if(free_slot == NULL) { return NULL; }
+        fractal_setup_free(&free_slot->setup);
+        free_slot->used = false;
+    }
+    double start_ms = render_time_ms();
+    if(!fractal_setup_init(&free_slot->setup, &r->params)) {
+        *invalid = true;
+        return NULL;
+    }
+    printf("new location for request %u: %.2f ms\n", r->id, render_time_ms() - start_ms);
+    free_slot->used = true;
+    free_slot->users = 0;
+    return free_slot;
+}
+
+// Render REQ_RENDER on the pool. The view's frame is moved and scaled to the region, so the region renders as a view
+// of its own with the same samples. Returns false if it has to wait for a location slot.
+bool server_start(RenderServer_t *s, ServerRequest_t *r, bool on_top) {
+    bool invalid;
+    ServerLocation_t *loc = server_location_for(s, r, &invalid);
+    if(loc == NULL) {
+        if(invalid) {
+            server_reply_error(r->client, r->id, "invalid location");
+            server_request_free(r);
+            return true;
+        }
+        return false;
+    }
+    ++(loc->users);
+    r->location = loc;
+
+    FractalSetup_t *rs = &r->setup;
+    rs->kernel = loc->setup.kernel;
+    rs->perturb = loc->setup.perturb;
+    rs->perturb.frame = &rs->frame;
+    rs->plain = loc->setup.plain;
+    double bailout2 = r->params.bailout * r->params.bailout;
+    rs->perturb.iterations = rs->plain.iterations = r->params.iterations;
+    rs->perturb.bailout2 = rs->plain.bailout2 = bailout2;
+    frame_pan(&rs->frame, r->x + r->w / 2.0 - r->width / 2.0, r->y + r->h / 2.0 - r->height / 2.0, r->width);
+    mpf_mul_ui(rs->frame.zoom, rs->frame.zoom, r->width);
+    mpf_div_ui(rs->frame.zoom, rs->frame.zoom, r->w);
+    frame_fit_prec(&rs->frame);
+    fractal_setup_update(rs);
+
+    RenderOptions_t opts = s->opts;
+    opts.palette = r->params.palette;
+    opts.queue_last = !on_top;
+    r->buf = fractal_buffer_create(r->w, r->h);
+    CacheView_t view = tile_cache_view(rs, r->w, r->h);
+    r->cached = tile_cache_fill(&s->cache, &view, r->buf, opts.palette);
+    r->ntx = lattice_size(r->w, SERVER_STREAM_TILE);
+    r->nty = lattice_size(r->h, SERVER_STREAM_TILE);
+    r->sent = calloc((size_t)r->ntx * r->nty, 1);
+    r->start_ms = render_time_ms();
+    r->next_scan_ms = r->start_ms;
+    r->job = DrawFractal_threaded_start(&s->pool, r->buf, fractal_setup_fn(rs), fractal_setup_cfg(rs), 1, PASS_SAMPLE, opts, r->w / 2.0, r->h / 2.0, NULL, 0);
+
+    r->next = s->running;
+    s->running = r;
+    return true;
+}
+
+// the client's request id in the list, NULL if it isn't there
+ServerRequest_t* server_find(ServerRequest_t *list, ServerClient_t *client, uint32_t id) {
+    for(ServerRequest_t *r = list; r != NULL; r = r->next) {
+        if(r->client == client && r->id == id) { return r; }
+    }
+    return NULL;
+}
+
+// number of the client's requests in the list
+uint32_t server_count(ServerRequest_t *list, ServerClient_t *client) {
+    uint32_t n = 0;
+    for(ServerRequest_t *r = list; r != NULL; r = r->next) {
+        n += r->client == client;
+    }
+    return n;
+}
+
+// bytes of the render buffer a request holds from its start until its last tile is queued
+uint64_t server_request_bytes(const ServerRequest_t *r) {
+    return (uint64_t)r->w * r->h * fractal_buffer_sample_bytes(false, false);
+}
+
+// bytes of render buffers held by the requests in the list, only by the client's if client isn't NULL
+uint64_t server_buffer_bytes(ServerRequest_t *list, ServerClient_t *client) {
+    uint64_t n = 0;
+    for(ServerRequest_t *r = list; r != NULL; r = r->next) {
+        if(r->buf != NULL && (client == NULL || r->client == client)) { n += server_request_bytes(r); }
+    }
+    return n;
+}
+
+// true if the request's buffers fit the budgets next to the ones held already. A request that would be alone in a
+// budget always fits it, however large.
+bool server_fits(RenderServer_t *s, ServerRequest_t *r) {
+    uint64_t need = server_request_bytes(r);
+    uint64_t client = server_buffer_bytes(s->running, r->client) + server_buffer_bytes(s->sending, r->client);
+    uint64_t all = server_buffer_bytes(s->running, NULL) + server_buffer_bytes(s->sending, NULL) + server_buffer_bytes(s->cancelled, NULL);
+    return (client == 0 || client + need <= SERVER_MAX_CLIENT_BUFFERS) && (all == 0 || all + need <= SERVER_MAX_BUFFERS);
+}
+
+// Queue REQ_RENDER of the client, params is the payload of h->params_len bytes.
+void server_submit(RenderServer_t *s, ServerClient_t *client, const RequestHeader_t *h, const char *params) {
+    if(h->format != FMT_ITERS && h->format != FMT_RGBA) {
+        server_reply_error(client, h->id, "unknown format");
+        return;
+    }
+    if(h->width == 0 || h->height == 0 || h->width > SERVER_MAX_VIEW || h->height > SERVER_MAX_VIEW) {
+        server_reply_error(client, h->id, "invalid view size");
+        return;
+    }
+    bool whole = h->w == 0 || h->h == 0;
+    uint32_t w = whole ? h->width : h->w;
+    uint32_t hh = whole ? h->height : h->h;
+    uint32_t x = whole ? 0 : h->x;
+    uint32_t y = whole ? 0 : h->y;
+    if((uint64_t)x + w > h->width || (uint64_t)y + hh > h->height || w > SERVER_MAX_REGION || hh > SERVER_MAX_REGION) {
+        server_reply_error(client, h->id, "region outside the view or too large");
+        return;
+    }
+    if(server_find(s->pending, client, h->id) != NULL || server_find(s->running, client, h->id) != NULL
+       || server_find(s->sending, client, h->id) != NULL) {
+        server_reply_error(client, h->id, "request id in use");
+        return;
+    }
+    if(server_count(s->pending, client) + server_count(s->running, client) + server_count(s->sending, client) >= SERVER_MAX_CLIENT_REQUESTS) {
+        server_reply_error(client, h->id, "too many requests");
+        return;
+    }
+
+    ServerRequest_t *r = calloc(1, sizeof(ServerRequest_t));
+    params_default(&r->params);
+    bool ok = true;
+    if(h->params_len > 0) {
+        FILE *f = fmemopen((void*)params, h->params_len, "r");
+        ok = f != NULL && params_read(&r->params, f, "request");
+        if(f != NULL) { fclose(f); }
+    }
+    ok = params_to_frame(&r->params, &r->setup.frame) && ok;
+    if(!ok) {
+        server_reply_error(client, h->id, "invalid location parameters");
+        server_request_free(r);
+        return;
+    }
+    r->client = client;
+    r->id = h->id;
+    r->priority = h->priority;
+    r->seq = s->seq++;
+    r->format = h->format;
+    r->width = h->width;
+    r->height = h->height;
+    r->x = x;
+    r->y = y;
+    r->w = w;
+    r->h = hh;
+
+    ServerRequest_t **at = &s->pending;
+    while(*at != NULL && (*at)->priority >= r->priority) {
+        at = &(*at)->next;
+    }
+    r->next = *at;
+    *at = r;
+}
+
+// remove r from the list starting at *head
+void server_unlink(ServerRequest_t **head, ServerRequest_t *r) {
+    for(ServerRequest_t **at = head; *at != NULL; at = &(*at)->next) {
+        if(*at == r) {
+            *at = r->next;
+            r->next = NULL;
+            return;
+        }
+    }
+}
+
+// cancel the job of a running request, it's freed once no render thread is in it anymore
+void server_drop(RenderServer_t *s, ServerRequest_t *r) {
+    server_unlink(&s->running, r);
+    DrawFractal_threaded_cancel(r->job);
+    r->job = NULL;
+    r->next = s->cancelled;
+    s->cancelled = r;
+}
+
+// REQ_CANCEL, requests that finished already are left alone (their REPLY_DONE is on the way)
+void server_cancel(RenderServer_t *s, ServerClient_t *client, uint32_t id) {
+    ServerRequest_t *r = server_find(s->pending, client, id);
+    if(r != NULL) {
+        server_unlink(&s->pending, r);
+        server_reply(client, REPLY_CANCELLED, id, r->format, (PixelRect_t) {0, 0, 0, 0}, NULL, 0);
+        server_request_free(r);
+    } else if((r = server_find(s->running, client, id)) != NULL) {
+        server_drop(s, r);
+        server_reply(client, REPLY_CANCELLED, id, r->format, (PixelRect_t) {0, 0, 0, 0}, NULL, 0);
+    } else if((r = server_find(s->sending, client, id)) != NULL) {
+        server_unlink(&s->sending, r);
+        server_reply(client, REPLY_CANCELLED, id, r->format, (PixelRect_t) {0, 0, 0, 0}, NULL, 0);
+        server_location_release(r->location);
+        server_request_free(r);
+    }
+}
+
+// the client disconnected, drop everything it asked for
+void server_client_gone(RenderServer_t *s, ServerClient_t *client) {
+    ServerRequest_t **at = &s->pending;
+    while(*at != NULL) {
+        ServerRequest_t *r = *at;
+        if(r->client == client) {
+            *at = r->next;
+            server_request_free(r);
+        } else {
+            at = &r->next;
+        }
+    }
+    at = &s->sending;
+    while(*at != NULL) {
+        ServerRequest_t *r = *at;
+        if(r->client == client) {
+            *at = r->next;
+            server_location_release(r->location);
+            server_request_free(r);
+        } else {
+            at = &r->next;
+        }
+    }
+    ServerRequest_t *r = s->running;
+    while(r != NULL) {
+        ServerRequest_t *next = r->next;
+        if(r->client == client) {
+            server_drop(s, r);
+        }
+        r = next;
+    }
+    for(r = s->cancelled; r != NULL; r = r->next) {
+        if(r->client == client) {
+            r->client = NULL;
+        }
+    }
+}
+
+// Queue the stream tiles of the request that are complete and weren't sent yet, all of them if the job is done,
+// as far as the client's output cap allows. Returns true once every tile is queued.
+bool server_stream(ServerRequest_t *r, bool all) {
+    if(r->client == NULL || r->client->failed) { return true; }
+    size_t tile_bytes = sizeof(ReplyHeader_t) + (size_t)SERVER_STREAM_TILE * SERVER_STREAM_TILE * sizeof(uint32_t);
+    uint32_t *data = malloc((size_t)SERVER_STREAM_TILE * SERVER_STREAM_TILE * sizeof(uint32_t));
+    if(data == NULL) { return false; }
+    bool done = true;
+    for(uint32_t ty = 0; ty < r->nty; ++ty) {
+        for(uint32_t tx = 0; tx < r->ntx; ++tx) {
+            if(r->sent[ty * r->ntx + tx]) { continue; }
+            if(server_output_queued(&r->client->out) + tile_bytes > SERVER_MAX_OUTPUT) {
+                done = false;
+                break;
+            }
+            PixelRect_t t = {tx * SERVER_STREAM_TILE, ty * SERVER_STREAM_TILE, (tx + 1) * SERVER_STREAM_TILE, (ty + 1) * SERVER_STREAM_TILE};
+            if(t.x1 > r->w) { t.x1 = r->w; }
+            if(t.y1 > r->h) { t.y1 = r->h; }
+            // a sample's count and colour are stored before its flags are published, see fractal_buffer_publish
+            bool complete = true;
+            for(uint32_t y = t.y0; y < t.y1 && complete; ++y) {
+                for(uint32_t x = t.x0; x < t.x1 && complete; ++x) {
+                    complete = all || (fractal_buffer_flags(r->buf, (size_t)y * r->w + x) & PIX_KNOWN);
+                }
+            }
+            if(!complete) {
+                done = false;
+                continue;
+            }
+            uint32_t *d = data;
+            for(uint32_t y = t.y0; y < t.y1; ++y) {
+                size_t row = (size_t)y * r->w;
+                const void *src = r->format == FMT_RGBA ? (void*)((Color*)r->buf->image->data + row + t.x0) : (void*)(r->buf->iters + row + t.x0);
+                memcpy(d, src, (t.x1 - t.x0) * sizeof(uint32_t));
+                d += t.x1 - t.x0;
+            }
+            PixelRect_t in_view = {r->x + t.x0, r->y + t.y0, r->x + t.x1, r->y + t.y1};
+            server_reply(r->client, REPLY_TILE, r->id, r->format, in_view, data, (uint32_t)((char*)d - (char*)data));
+            r->sent[ty * r->ntx + tx] = 1;
+        }
+        if(!done && server_output_queued(&r->client->out) + tile_bytes > SERVER_MAX_OUTPUT) { break; }
+    }
+    free(data);
+    return done;
+}
+
+// finish a request whose every tile is queued
+void server_complete(ServerRequest_t *r, double now) {
+    server_reply(r->client, REPLY_DONE, r->id, r->format, (PixelRect_t) {0, 0, 0, 0}, NULL, 0);
+    printf("request %u: %ux%u at (%u, %u), %" PRIu64 " samples computed, %" PRIu64 " from the cache, %.2f ms\n",
+           r->id, r->w, r->h, r->x, r->y, r->kernel_calls, r->cached, now - r->start_ms);
+    server_location_release(r->location);
+    server_request_free(r);
+}
+
+// Move all requests along: stream finished tiles, complete finished requests and start pending ones.
+// Call regularly, returns true while there's anything left to do.
+bool server_update(RenderServer_t *s) {
+    double now = render_time_ms();
+    // cancelled jobs let go of their buffer when the last render thread leaves them
+    ServerRequest_t **at = &s->cancelled;
+    while(*at != NULL) {
+        ServerRequest_t *r = *at;
+        if(atomic_load(&r->buf->refs) == 1) {
+            *at = r->next;
+            server_location_release(r->location);
+            server_request_free(r);
+        } else {
+            at = &r->next;
+        }
+    }
+
+    at = &s->running;
+    while(*at != NULL) {
+        ServerRequest_t *r = *at;
+        if(!check_threaded_render_status(r->job).done) {
+            if(now >= r->next_scan_ms) {
+                server_stream(r, false);
+                r->next_scan_ms = now + SERVER_SCAN_INTERVAL_MS;
+            }
+            at = &r->next;
+            continue;
+        }
+        r->kernel_calls = r->job->kernel_calls;
+        DrawFractal_threaded_end(r->job);
+        r->job = NULL;
+        CacheView_t view = tile_cache_view(&r->setup, r->w, r->h);
+        tile_cache_store(&s->cache, &view, r->buf);
+        *at = r->next;
+        if(server_stream(r, true)) {
+            server_complete(r, now);
+        } else {
+            // the render's slot is free, the rest goes out as the client reads
+            r->next = s->sending;
+            s->sending = r;
+        }
+    }
+
+    at = &s->sending;
+    while(*at != NULL) {
+        ServerRequest_t *r = *at;
+        if(server_stream(r, true)) {
+            *at = r->next;
+            server_complete(r, now);
+        } else {
+            at = &r->next;
+        }
+    }
+
+    // pending requests start in order while there's room, or right away if they outrank everything running.
+    // One whose buffers don't fit the budgets waits, the ones after it go first
+    at = &s->pending;
+    while(*at != NULL) {
+        uint32_t n_running = 0;
+        int32_t top = INT32_MIN;
+        for(ServerRequest_t *r = s->running; r != NULL; r = r->next) {
+            ++n_running;
+            top = r->priority > top ? r->priority : top;
+        }
+        ServerRequest_t *r = *at;
+        bool outranks = n_running > 0 && r->priority > top;
+        if(n_running >= s->in_flight && !outranks) { break; }
+        if(!server_fits(s, r)) {
+            at = &r->next;
+            continue;
+        }
+        *at = r->next;
+        if(!server_start(s, r, outranks)) {
+            // every location is in use, wait for one
+            r->next = *at;
+            *at = r;
+            break;
+        }
+    }
+    return s->pending != NULL || s->running != NULL || s->sending != NULL || s->cancelled != NULL;
+}
+
+// cancel everything and wait for the render threads to leave, then stop them
+void server_destroy(RenderServer_t *s) {
+    while(s->pending != NULL) {
+        ServerRequest_t *r = s->pending;
+        s->pending = r->next;
+        server_request_free(r);
+    }
+    while(s->running != NULL) {
+        server_drop(s, s->running);
+    }
+    while(s->sending != NULL) {
+        ServerRequest_t *r = s->sending;
+        s->sending = r->next;
+        server_location_release(r->location);
+        server_request_free(r);
+    }
+    struct timespec poll = {0, RENDER_WAIT_POLL_NS};
+    while(server_update(s)) {
+        nanosleep(&poll, NULL);
+    }
+    for(uint32_t i = 0; i < SERVER_MAX_LOCATIONS; ++i) {
+        if(s->locations[i].used) {
+            fractal_setup_free(&s->locations[i].setup);
+        }
+    }
+    render_pool_destroy(&s->pool);
+    tile_cache_destroy(&s->cache);
+}
+
+#endif // RENDER_SERVER_H
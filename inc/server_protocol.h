@@ -0,0 +1,64 @@
+#ifndef SERVER_PROTOCOL_H
+#define SERVER_PROTOCOL_H
+
+#include <stdint.h>
+
+// Protocol of the render server (gmpfract_server), over a Unix domain socket or a localhost TCP connection.
+// Messages are a fixed header followed by a payload, all integers in the host's byte order (clients are local).
+//
+// Client to server, RequestHeader_t then params_len bytes:
+//   REQ_RENDER  render region (x, y, w, h) of a width x height view of the location in the payload, which is in the
+//               parameter file format ("re = ...\nim = ...\nzoom = ...\n", missing keys keep their defaults).
+//               w = h = 0 renders the whole view. Requests with a higher priority are rendered first.
+//   REQ_CANCEL  drop the request id of this connection, no payload
+//
+// Server to client, ReplyHeader_t then data_len bytes:
+//   REPLY_TILE       a finished tile of the request, at (x, y, w, h) in the view. FMT_ITERS data is w * h uint32_t
+//                    iteration counts (UINT32_MAX inside the set), FMT_RGBA w * h RGBA pixels in the location's
+//                    palette, row by row. Tiles come in the order they finish.
+//   REPLY_DONE       all tiles of the request were sent
+//   REPLY_CANCELLED  the request was cancelled, no more tiles follow
+//   REPLY_ERROR      the request was rejected, the data is the reason as text
+// A connection's requests end when it closes.
+
+#define REQUEST_MAGIC 0x51524647u // "GFRQ"
+#define REPLY_MAGIC 0x50524647u // "GFRP"
+
+typedef enum {
+    REQ_RENDER = 1,
+    REQ_CANCEL = 2
+} RequestType_t;
+
+typedef enum {
+    FMT_ITERS = 0,
+    FMT_RGBA = 1
+} TileFormat_t;
+
+typedef enum {
+    REPLY_TILE = 1,
+    REPLY_DONE = 2,
+    REPLY_CANCELLED = 3,
+    REPLY_ERROR = 4
+} ReplyType_t;
+
+typedef struct RequestHeader_t {
+    uint32_t magic; // REQUEST_MAGIC
+    uint32_t type; // RequestType_t
+    uint32_t id; // chosen by the client, the replies carry it
+    int32_t priority;
+    uint32_t width, height; // of the whole view
+    uint32_t x, y, w, h; // region of the view to render
+    uint32_t format; // TileFormat_t
+    uint32_t params_len; // bytes of location parameters after the header
+} RequestHeader_t;
+
+typedef struct ReplyHeader_t {
+    uint32_t magic; // REPLY_MAGIC
+    uint32_t type; // ReplyType_t
+    uint32_t id;
+    uint32_t format;
+    uint32_t x, y, w, h; // REPLY_TILE only
+    uint32_t data_len; // bytes after the header
+} ReplyHeader_t;
+
+#endif // SERVER_PROTOCOL_H
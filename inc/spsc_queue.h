@@ -0,0 +1,62 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Lock-free ring buffer of fixed size elements between exactly one producer and one consumer thread.
+// head and tail count up forever, their difference is the number of queued elements.
+typedef struct SpscQueue_t {
+    uint8_t *data;
+    size_t elem_size;
+    uint32_t capacity; // power of 2
+    atomic_uint head; // next element to pop, only written by the consumer
+    atomic_uint tail; // next free slot, only written by the producer
+} SpscQueue_t;
+
+void spsc_init(SpscQueue_t *q, size_t elem_size, uint32_t capacity) {
+    uint32_t cap = 1;
+    while(cap < capacity) { cap *= 2; }
+    q->data = malloc(elem_size * cap);
+    q->elem_size = elem_size;
+    q->capacity = cap;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+}
+
+void spsc_destroy(SpscQueue_t *q) {
+    free(q->data);
+    q->data = NULL;
+}
+
+// number of elements the producer can push right now
+uint32_t spsc_space(SpscQueue_t *q) {
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    return q->capacity - (tail - head);
+}
+
+// producer side, returns false if the queue is full
+bool spsc_push(SpscQueue_t *q, const void *elem) {
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if(tail - head == q->capacity) { return false; }
+    memcpy(&q->data[(size_t)(tail & (q->capacity - 1)) * q->elem_size], elem, q->elem_size);
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// consumer side, returns false if the queue is empty
+bool spsc_pop(SpscQueue_t *q, void *elem) {
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if(head == tail) { return false; }
+    memcpy(elem, &q->data[(size_t)(head & (q->capacity - 1)) * q->elem_size], q->elem_size);
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
+
+#endif // SPSC_QUEUE_H
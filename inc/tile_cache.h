@@ -0,0 +1,349 @@
+#ifndef TILE_CACHE_H
+#define TILE_CACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "gmp.h"
+#include "draw_fractal.h"
+#include "fractal_params.h"
+
+// Cache of rendered samples, so views that were seen before (or overlap one) come up without rendering them again.
+// Every zoom level (a factor 2 apart) has lattices of sample positions on the plane, anchored at the reference orbit's c.
+// Panning moves a view by whole samples along its lattice, zooming in keeps every other sample on the lattice of the
+// level above (a quadtree). Views reached by navigating therefore share lattices, and the samples one of them rendered
+// fill in those of any other view on the same lattice overlapping it. A lattice that's off the anchor by a fraction of
+// a sample is a lattice of its own. The lattices are cut into CACHE_TILE_SIZE x CACHE_TILE_SIZE tiles, kept in LRU
+// order within a memory budget. All functions lock the cache, it can be shared between threads.
+
+#define CACHE_TILE_SIZE 64
+#define CACHE_PHASE_BITS 16 // lattices off the anchor are told apart by their offset from it, in 1/2^16 samples
+#define CACHE_SPACING_BITS 40 // sample spacings that agree to this many bits are the same lattice
+#define TILE_CACHE_MIN_BUCKETS 1024
+
+// where the samples of a view are in the cache, from tile_cache_view
+typedef struct CacheView_t {
+    bool valid; // false if the view is too far from the anchor to put on a lattice
+    uint64_t lattices; // anchor, kernel, bailout and sample spacing (up to the binary exponent)
+    uint64_t location; // lattices and the offset of the view's lattice from the anchor
+    int32_t level; // binary exponent of the samples per unit (zoom times width)
+    uint32_t iterations;
+    int64_t pos_x, pos_y; // position of pixel (0, 0) from the anchor, in 1/2^CACHE_PHASE_BITS samples
+    int64_t x0, y0; // lattice position of pixel (0, 0), whole samples
+    uint32_t width, height;
+} CacheView_t;
+
+typedef struct TileKey_t {
+    uint64_t location;
+    int32_t level;
+    uint32_t iterations;
+    int64_t tx, ty; // in tiles along the lattice
+} TileKey_t;
+
+typedef struct CachedTile_t {
+    TileKey_t key;
+    uint32_t iters[CACHE_TILE_SIZE * CACHE_TILE_SIZE];
+    uint8_t flags[CACHE_TILE_SIZE * CACHE_TILE_SIZE]; // PIX_KNOWN, PIX_FILLED and PIX_GUESSED, 0 where nothing was rendered
+    struct CachedTile_t *chain; // next tile in the same bucket
+    struct CachedTile_t *newer, *older; // LRU list
+} CachedTile_t;
+
+typedef struct TileCache_t {
+    pthread_mutex_t mtx; // guards everything below
+    CachedTile_t **buckets;
+    uint32_t n_buckets; // power of 2
+    CachedTile_t *newest, *oldest;
+    size_t n_tiles, max_tiles; // max_tiles from the memory budget
+    uint64_t hits, misses; // tile lookups of tile_cache_fill
+} TileCache_t;
+
+void tile_cache_init(TileCache_t *c, size_t budget_bytes) {
+    pthread_mutex_init(&(c->mtx), NULL);
+    c->max_tiles = budget_bytes / sizeof(CachedTile_t);
+    if(c->max_tiles == 0) { c->max_tiles = 1; }
+    c->n_buckets = TILE_CACHE_MIN_BUCKETS;
+    while(c->n_buckets < c->max_tiles) { c->n_buckets *= 2; }
+    c->buckets = calloc(c->n_buckets, sizeof(CachedTile_t*));
+    c->newest = NULL;
+    c->oldest = NULL;
+    c->n_tiles = 0;
+    c->hits = 0;
+    c->misses = 0;
+}
+
+void tile_cache_destroy(TileCache_t *c) {
+    CachedTile_t *t = c->newest;
+    while(t != NULL) {
+        CachedTile_t *older = t->older;
+        free(t);
+        t = older;
+    }
+    free(c->buckets);
+    pthread_mutex_destroy(&(c->mtx));
+}
+
+bool tile_key_equal(const TileKey_t *a, const TileKey_t *b) {
+    return a->location == b->location && a->level == b->level && a->iterations == b->iterations && a->tx == b->tx && a->ty == b->ty;
+}
+
+CachedTile_t** tile_cache_bucket(TileCache_t *c, const TileKey_t *key) {
+    uint64_t h = fnv1a(key->location, &key->level, sizeof(key->level));
+    h = fnv1a(h, &key->iterations, sizeof(key->iterations));
+    h = fnv1a(h, &key->tx, sizeof(key->tx));
+    h = fnv1a(h, &key->ty, sizeof(key->ty));
+    return &c->buckets[h & (c->n_buckets - 1)];
+}
+
+// Caller holds the lock.
+CachedTile_t* tile_cache_find(TileCache_t *c, const TileKey_t *key) {
+    for(CachedTile_t *t = *tile_cache_bucket(c, key); t != NULL; t = t->chain) {
+        if(tile_key_equal(&t->key, key)) { return t; }
+    }
+    return NULL;
+}
+
+// Caller holds the lock.
+void tile_cache_unlink(TileCache_t *c, CachedTile_t *t) {
+    if(t->newer != NULL) { t->newer->older = t->older; } else { c->newest = t->older; }
+    if(t->older != NULL) { t->older->newer = t->newer; } else { c->oldest = t->newer; }
+}
+
+// move t to the front of the LRU list. Caller holds the lock.
+void tile_cache_touch(TileCache_t *c, CachedTile_t *t) {
+    if(c->newest == t) { return; }
+    tile_cache_unlink(c, t);
+    t->newer = NULL;
+    t->older = c->newest;
+    c->newest->newer = t;
+    c->newest = t;
+}
+
+// Caller holds the lock.
+void tile_cache_evict_oldest(TileCache_t *c) {
+    CachedTile_t *t = c->oldest;
+    tile_cache_unlink(c, t);
+    CachedTile_t **p = tile_cache_bucket(c, &t->key);
+    while(*p != t) { p = &(*p)->chain; }
+    *p = t->chain;
+    free(t);
+    --(c->n_tiles);
+}
+
+// a new, empty tile for key at the front of the LRU list, evicting the oldest tile if the budget is used up.
+// Caller holds the lock.
+CachedTile_t* tile_cache_insert(TileCache_t *c, const TileKey_t *key) {
+    if(c->n_tiles >= c->max_tiles) {
+        tile_cache_evict_oldest(c);
+    }
+    CachedTile_t *t = malloc(sizeof(CachedTile_t));
+    t->key = *key;
+    memset(t->flags, 0, sizeof(t->flags));
+    CachedTile_t **bucket = tile_cache_bucket(c, key);
+    t->chain = *bucket;
+    *bucket = t;
+    t->newer = NULL;
+    t->older = c->newest;
+    if(c->newest != NULL) { c->newest->newer = t; } else { c->oldest = t; }
+    c->newest = t;
+    ++(c->n_tiles);
+    return t;
+}
+
+int64_t floor_div(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+// Position of the first pixel center along one axis from the anchor, in 1/2^CACHE_PHASE_BITS samples.
+// offset is the frame center minus the anchor scaled to samples.
+bool lattice_position(const mpf_t offset, uint32_t size, int64_t *pos) {
+    mpf_t x, t;
+    mpf_inits(x, t, NULL);
+    mpf_set_prec(x, mpf_get_prec(offset));
+    mpf_set_d(t, 0.5 - size / 2.0);
+    mpf_add(x, offset, t);
+    // rounded to the nearest 1/2^CACHE_PHASE_BITS
+    mpf_mul_2exp(x, x, CACHE_PHASE_BITS);
+    mpf_set_d(t, 0.5);
+    mpf_add(x, x, t);
+    mpf_floor(x, x);
+    // far enough from overflowing for the tile arithmetic
+    bool ok = mpf_fits_slong_p(x) && sizeof(long) >= sizeof(int64_t) && labs(mpf_get_si(x)) < (1l << 62);
+    *pos = ok ? mpf_get_si(x) : 0;
+    mpf_clears(x, t, NULL);
+    return ok;
+}
+
+// finish a view from its lattices and position
+CacheView_t cache_view_at(CacheView_t v, int32_t level, int64_t pos_x, int64_t pos_y) {
+    int64_t unit = (int64_t)1 << CACHE_PHASE_BITS;
+    v.level = level;
+    v.pos_x = pos_x;
+    v.pos_y = pos_y;
+    v.x0 = floor_div(pos_x, unit);
+    v.y0 = floor_div(pos_y, unit);
+    int64_t phase[2] = {pos_x - v.x0 * unit, pos_y - v.y0 * unit};
+    v.location = fnv1a(v.lattices, phase, sizeof(phase));
+    return v;
+}
+
+// Where the samples of a width x height view of the setup's current frame are on the lattice. Views of any size with
+// the same sample spacing share lattices, e.g. a tile rendered on its own and the whole view around it.
+CacheView_t tile_cache_view(FractalSetup_t *s, uint32_t width, uint32_t height) {
+    CacheView_t v = {.valid = false, .width = width, .height = height, .iterations = *fractal_setup_iterations(s)};
+    mp_bitcnt_t prec = mpf_get_prec(s->frame.c_re) + 64;
+    mpf_t d, units;
+    mpf_init2(d, prec);
+    mpf_init2(units, mpf_get_prec(s->frame.zoom) + 64);
+    // samples are 4 / (zoom * width) apart
+    mpf_mul_ui(units, s->frame.zoom, width);
+    long level;
+    double mantissa = ldexp(round(ldexp(mpf_get_d_2exp(&level, units), CACHE_SPACING_BITS)), -CACHE_SPACING_BITS);
+
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS, &s->kernel, sizeof(s->kernel));
+    hash = fnv1a(hash, &mantissa, sizeof(mantissa));
+    double bailout2 = s->kernel == KERNEL_PERTURB ? s->perturb.bailout2 : s->plain.bailout2;
+    hash = fnv1a(hash, &bailout2, sizeof(bailout2));
+
+    // the perturbation kernel is anchored at the reference, the plain one at 0
+    int64_t pos[2];
+    bool ok = true;
+    for(int axis = 0; axis < 2 && ok; ++axis) {
+        mpf_set(d, axis == 0 ? s->frame.c_re : s->frame.c_im);
+        if(s->kernel == KERNEL_PERTURB) {
+            mpf_ptr anchor = axis == 0 ? s->perturb.reference->c_re : s->perturb.reference->c_im;
+            mpf_sub(d, d, anchor);
+            mp_exp_t exp;
+            char *digits = mpf_get_str(NULL, &exp, 16, 0, anchor);
+            hash = fnv1a(hash, digits, strlen(digits));
+            hash = fnv1a(hash, &exp, sizeof(exp));
+            free(digits);
+        }
+        // re/im range -2 to 2 across the width
+        mpf_mul(d, d, units);
+        mpf_div_2exp(d, d, 2);
+        ok = lattice_position(d, axis == 0 ? width : height, &pos[axis]);
+    }
+    mpf_clears(d, units, NULL);
+    if(!ok) { return v; }
+    v.lattices = hash;
+    v.valid = true;
+    return cache_view_at(v, (int32_t)level, pos[0], pos[1]);
+}
+
+// The view zoomed out by 2 with its pixel (0, 0) on pixel (ux, uy) of v. Zooming out has a choice of two lattices
+// along each axis, the view zoomed in from is on one of them: the parity of (ux, uy) picks which.
+CacheView_t cache_view_zoom_out(const CacheView_t *v, int64_t ux, int64_t uy) {
+    int64_t unit = (int64_t)1 << CACHE_PHASE_BITS;
+    return cache_view_at(*v, v->level - 1, floor_div(v->pos_x + ux * unit, 2), floor_div(v->pos_y + uy * unit, 2));
+}
+
+// true if the tile under the center of the view is cached
+bool tile_cache_has_view(TileCache_t *c, const CacheView_t *v) {
+    if(!v->valid) { return false; }
+    TileKey_t key = {
+        v->location, v->level, v->iterations,
+        floor_div(v->x0 + v->width / 2, CACHE_TILE_SIZE), floor_div(v->y0 + v->height / 2, CACHE_TILE_SIZE)
+    };
+    pthread_mutex_lock(&(c->mtx));
+    bool found = tile_cache_find(c, &key) != NULL;
+    pthread_mutex_unlock(&(c->mtx));
+    return found;
+}
+
+// the part of tile (tx, ty) in the view, in view pixels. Empty if they don't overlap.
+PixelRect_t tile_cache_overlap(const CacheView_t *v, int64_t tx, int64_t ty) {
+    int64_t x0 = tx * CACHE_TILE_SIZE - v->x0;
+    int64_t y0 = ty * CACHE_TILE_SIZE - v->y0;
+    int64_t x1 = x0 + CACHE_TILE_SIZE;
+    int64_t y1 = y0 + CACHE_TILE_SIZE;
+    if(x0 < 0) { x0 = 0; }
+    if(y0 < 0) { y0 = 0; }
+    if(x1 > v->width) { x1 = v->width; }
+    if(y1 > v->height) { y1 = v->height; }
+    if(x1 < x0) { x1 = x0; }
+    if(y1 < y0) { y1 = y0; }
+    return (PixelRect_t) {x0, y0, x1, y1};
+}
+
+// Fill in the samples of the view that aren't known in buf yet from the cache, and draw them.
+// Returns the number of samples filled in.
+uint64_t tile_cache_fill(TileCache_t *c, const CacheView_t *v, FractalBuffer_t *buf, Palette_t palette) {
+    if(!v->valid || buf->image->width != v->width || buf->image->height != v->height) { return 0; }
+    Color *pixels = (Color*)buf->image->data;
+    int64_t tx0 = floor_div(v->x0, CACHE_TILE_SIZE);
+    int64_t ty0 = floor_div(v->y0, CACHE_TILE_SIZE);
+    int64_t tx1 = floor_div(v->x0 + v->width - 1, CACHE_TILE_SIZE);
+    int64_t ty1 = floor_div(v->y0 + v->height - 1, CACHE_TILE_SIZE);
+    uint64_t filled = 0;
+    pthread_mutex_lock(&(c->mtx));
+    for(int64_t ty = ty0; ty <= ty1; ++ty) {
+        for(int64_t tx = tx0; tx <= tx1; ++tx) {
+            TileKey_t key = {v->location, v->level, v->iterations, tx, ty};
+            CachedTile_t *t = tile_cache_find(c, &key);
+            if(t == NULL) {
+                ++(c->misses);
+                continue;
+            }
+            ++(c->hits);
+            tile_cache_touch(c, t);
+            PixelRect_t r = tile_cache_overlap(v, tx, ty);
+            uint64_t tile_filled = 0;
+            for(uint32_t y = r.y0; y < r.y1; ++y) {
+                for(uint32_t x = r.x0; x < r.x1; ++x) {
+                    size_t ti = (size_t)(v->y0 + y - ty * CACHE_TILE_SIZE) * CACHE_TILE_SIZE + (v->x0 + x - tx * CACHE_TILE_SIZE);
+                    size_t idx = (size_t)y * v->width + x;
+                    if(!(t->flags[ti] & PIX_KNOWN) || (buf->flags[idx] & PIX_KNOWN)) { continue; }
+                    buf->iters[idx] = t->iters[ti];
+                    buf->flags[idx] = t->flags[ti];
+                    fractal_buffer_set_estimated(buf, idx, t->iters[ti]);
+                    pixels[idx] = paletteColor(palette, t->iters[ti]);
+                    ++tile_filled;
+                }
+            }
+            if(tile_filled > 0) {
+                fractal_buffer_mark_dirty(buf, r);
+                filled += tile_filled;
+            }
+        }
+    }
+    pthread_mutex_unlock(&(c->mtx));
+    return filled;
+}
+
+// Store the known samples of the view from buf, which no job may be rendering into.
+// Tiles it only partly covers are merged with what's cached of them already.
+void tile_cache_store(TileCache_t *c, const CacheView_t *v, FractalBuffer_t *buf) {
+    if(!v->valid || buf->image->width != v->width || buf->image->height != v->height) { return; }
+    int64_t tx0 = floor_div(v->x0, CACHE_TILE_SIZE);
+    int64_t ty0 = floor_div(v->y0, CACHE_TILE_SIZE);
+    int64_t tx1 = floor_div(v->x0 + v->width - 1, CACHE_TILE_SIZE);
+    int64_t ty1 = floor_div(v->y0 + v->height - 1, CACHE_TILE_SIZE);
+    pthread_mutex_lock(&(c->mtx));
+    for(int64_t ty = ty0; ty <= ty1; ++ty) {
+        for(int64_t tx = tx0; tx <= tx1; ++tx) {
+            TileKey_t key = {v->location, v->level, v->iterations, tx, ty};
+            CachedTile_t *t = tile_cache_find(c, &key);
+            PixelRect_t r = tile_cache_overlap(v, tx, ty);
+            for(uint32_t y = r.y0; y < r.y1; ++y) {
+                for(uint32_t x = r.x0; x < r.x1; ++x) {
+                    size_t idx = (size_t)y * v->width + x;
+                    if(!(buf->flags[idx] & PIX_KNOWN)) { continue; }
+                    if(t == NULL) {
+                        t = tile_cache_insert(c, &key);
+                    }
+                    size_t ti = (size_t)(v->y0 + y - ty * CACHE_TILE_SIZE) * CACHE_TILE_SIZE + (v->x0 + x - tx * CACHE_TILE_SIZE);
+                    t->iters[ti] = buf->iters[idx];
+                    t->flags[ti] = buf->flags[idx] & (PIX_KNOWN | PIX_FILLED | PIX_GUESSED);
+                }
+            }
+            if(t != NULL) {
+                tile_cache_touch(c, t);
+            }
+        }
+    }
+    pthread_mutex_unlock(&(c->mtx));
+}
+
+#endif // TILE_CACHE_H
@@ -0,0 +1,114 @@
+#ifndef ZOOM_SEQUENCE_H
+#define ZOOM_SEQUENCE_H
+
+#include <stdint.h>
+#include <math.h>
+#include "gmp.h"
+#include "draw_fractal.h"
+#include "mandelbrot.h"
+#include "fractal_params.h"
+
+// Zoom video: frames at exponentially spaced zooms from zoom_start to the zoom of the location, all around its center.
+// The reference orbit of the deepest frame is built once (by fractal_setup_init) and serves every frame, frames
+// only differ in their scale. Several frames render at once on the same pool and are handed out in order.
+typedef struct ZoomSequence_t {
+    uint32_t frames;
+    double zoom_start; // zoom of the first frame
+    uint32_t width, height;
+    uint32_t in_flight; // frames rendering at the same time, 0: one more than the pool has threads
+    RenderOptions_t opts;
+} ZoomSequence_t;
+
+// called with every finished frame in order, returns false to stop the sequence
+typedef bool (*ZoomFrameSink)(Image *image, uint32_t index, void *ctx);
+
+// one frame that's being rendered, with its own copy of the kernel configuration
+typedef struct SequenceFrame_t {
+    uint32_t index;
+    FractalBuffer_t *buf;
+    RenderJob_t *job;
+    PerturbMandelbrotCFG perturb;
+    MandelbrotCFG plain;
+} SequenceFrame_t;
+
+// natural log of the frame's zoom, also for zooms beyond the range of a double
+double sequence_log_zoom(mpf_t zoom) {
+    signed long exp;
+    double mantissa = mpf_get_d_2exp(&exp, zoom);
+    return log(mantissa) + exp * M_LN2;
+}
+
+// zoom of frame i as log, evenly spaced in log between the first and the last frame
+double sequence_frame_log_zoom(const ZoomSequence_t *seq, double log_end, uint32_t i) {
+    double log_start = log(seq->zoom_start);
+    if(seq->frames < 2) { return log_end; }
+    return log_start + (log_end - log_start) * i / (seq->frames - 1);
+}
+
+void sequence_start_frame(const ZoomSequence_t *seq, RenderPool_t *pool, FractalSetup_t *setup, double log_end, SequenceFrame_t *f, uint32_t i) {
+    double log_zoom = sequence_frame_log_zoom(seq, log_end, i);
+    f->index = i;
+    f->buf = fractal_buffer_create(seq->width, seq->height);
+    void *cfg;
+    if(setup->kernel == KERNEL_PERTURB) {
+        // same reference and center, only the pixel spacing changes
+        f->perturb = setup->perturb;
+        f->perturb.scale = exp(-log_zoom);
+        cfg = &f->perturb;
+    } else {
+        f->plain = setup->plain;
+        f->plain.zoom = exp(log_zoom);
+        cfg = &f->plain;
+    }
+    f->job = DrawFractal_threaded_start(pool, f->buf, fractal_setup_fn(setup), cfg, 1, PASS_SAMPLE, seq->opts, 0.0, 0.0, NULL, 0);
+}
+
+// Render all frames of the sequence on the pool and hand them to sink in order.
+// Returns false if sink stopped the sequence early.
+bool zoom_sequence_render(const ZoomSequence_t *seq, RenderPool_t *pool, FractalSetup_t *setup, ZoomFrameSink sink, void *ctx) {
+    double log_end = sequence_log_zoom(setup->frame.zoom);
+    ZoomSequence_t s = *seq;
+    // older frames first, so they can be handed out while the later ones are still rendering
+    s.opts.queue_last = true;
+    uint32_t window = s.in_flight > 0 ? s.in_flight : pool->n_threads + 1;
+    if(window > s.frames) { window = s.frames; }
+
+    // ring of the frames in flight, slot i % window holds frame i
+    SequenceFrame_t *frames = malloc(window * sizeof(SequenceFrame_t));
+    uint32_t started = 0;
+    for(; started < window; ++started) {
+        sequence_start_frame(&s, pool, setup, log_end, &frames[started], started);
+    }
+
+    bool ok = true;
+    uint64_t kernel_calls = 0;
+    double start_ms = render_time_ms();
+    for(uint32_t next = 0; next < s.frames; ++next) {
+        SequenceFrame_t *f = &frames[next % window];
+        if(ok) {
+            DrawFractal_threaded_wait(f->job);
+            kernel_calls += f->job->kernel_calls;
+            DrawFractal_threaded_end(f->job);
+            ok = sink(f->buf->image, f->index, ctx);
+        } else {
+            // stopped, drop what's still rendering. The frame's config goes away with frames.
+            DrawFractal_threaded_stop(f->job);
+            DrawFractal_threaded_end(f->job);
+        }
+        fractal_buffer_release(f->buf);
+        if(ok && started < s.frames) {
+            sequence_start_frame(&s, pool, setup, log_end, f, started++);
+        } else if(!ok) {
+            // frames that were never started don't need to be waited for
+            s.frames = started;
+        }
+    }
+    free(frames);
+
+    double ms = render_time_ms() - start_ms;
+    printf("sequence: %u frames in %.2f ms (%.2f ms per frame), %" PRIu64 " samples computed\n",
+           s.frames, ms, ms / (s.frames ? s.frames : 1), kernel_calls);
+    return ok;
+}
+
+#endif // ZOOM_SEQUENCE_H
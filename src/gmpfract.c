@@ -3,12 +3,17 @@
 #include "clay_renderer_raylib.c"
 #include "draw_fractal.h"
 #include "mandelbrot.h"
+#include "fractal_params.h"
+#include "spsc_queue.h"
+#include "tile_cache.h"
+#include "prefetch.h"
 #include "gmp.h"
 #include "pthread.h"
 
 #define RAYLIB_VECTOR2_TO_CLAY_VECTOR2(vector) (Clay_Vector2) { .x = vector.x, .y = vector.y }
 
-#define N_THREADS 12
+// one render thread per physical core of the affinity mask, one core is left to the UI and coordinator threads
+const RenderPlacement_t RENDER_PLACEMENT = {.n_threads = 0, .pin = true, .skip_smt = true, .reserved_cpus = 1};
 
 const uint32_t FONT_ID_BODY_24 = 0;
 const uint32_t FONT_ID_BODY_16 = 1;
@@ -19,69 +24,131 @@ const Clay_Color COLOR_ORANGE = (Clay_Color) {225, 138, 50, 255};
 
 Clay_Dimensions prev_screen_dims = {0.0, 0.0};
 
+// The render coordinator thread owns the renderer and everything below up to the UI section: it runs the
+// decimation chain and reacts to commands from the UI thread. The UI thread only sends commands, uploads the
+// regions the coordinator publishes and draws. Both directions go through lock-free queues.
+typedef enum {
+    CMD_RESIZE, // x/y: screen size
+    CMD_CURSOR, // x/y: mouse position
+    CMD_RERENDER,
+    CMD_TOGGLE_ADAPTIVE,
+    CMD_TOGGLE_GUESS,
+    CMD_TOGGLE_ANTIALIAS,
+    CMD_TOGGLE_PREFETCH,
+    CMD_CYCLE_ORDER,
+    CMD_PAN, // dx/dy: pixels of the fractal image
+    CMD_ZOOM, // out, x/y: anchor in screen coordinates
+    CMD_SAVE, // write the current location to SAVE_PARAMS_PATH
+    CMD_MORE_ITERATIONS, // double the iteration cap
+    CMD_QUIT
+} RenderCommandType_t;
+
+typedef struct RenderCommand_t {
+    RenderCommandType_t type;
+    int32_t dx, dy;
+    bool out;
+    float x, y;
+} RenderCommand_t;
+
+typedef enum {
+    EV_BUFFER, // the renderer switched to buf, the event holds a reference for the UI
+    EV_DIRTY // rect of the last published buffer changed
+} RenderEventType_t;
+
+typedef struct RenderEvent_t {
+    RenderEventType_t type;
+    FractalBuffer_t *buf;
+    PixelRect_t rect;
+} RenderEvent_t;
+
+#define RENDER_QUEUE_SIZE 1024
+#define COORDINATOR_POLL_NS 1000000 // 1 ms
+SpscQueue_t render_commands; // UI -> coordinator
+SpscQueue_t render_events; // coordinator -> UI
+pthread_t coordinator_tid;
+
 // todo settings/split this logic to another file
 uint32_t decimation_level;
 #define N_DECIMATIONS 5
-const float DECIMATION_FAC = 2.0;
-const float final_pixel_scale = 2.0;
+const uint32_t DECIMATION_FAC = 2; // integer so every decimation level lies on the next finer level's pixel lattice
+const float final_pixel_scale = 1.0; // edges get supersampled by the antialias pass instead of every pixel
+#define ANTIALIAS_SAMPLES 4 // 2 x 2 sub-samples per pixel, only along edges
 
-Image *fractal_image[N_DECIMATIONS];
-Texture2D fractal_tex[N_DECIMATIONS];
+Clay_Dimensions render_screen_dims = {0.0, 0.0}; // screen size the coordinator renders for
+Vector2 render_cursor = {0.0, 0.0};
+FractalBuffer_t *published_buf = NULL; // last buffer handed to the UI
 
 
 
 FractalRenderer_t renderer;
-PerturbMandelbrotCFG fractal_config;
-RefIter fractal_ref_iter;
-ArbPrecFrame fractal_frame;
+FractalParams_t fractal_params; // defaults or the file given on the command line
+FractalSetup_t fractal_setup;
+
+#define TILE_CACHE_MIB 512
+TileCache_t tile_cache; // samples of the views seen so far, finished views are stored at the end of their render chain
+Prefetcher_t prefetcher; // renders the views likely to come next into tile_cache while the renderer is idle
+bool prefetch_enabled = true;
+#define SAVE_PARAMS_PATH "location.params"
+
+// while the view is moved every render is planned to fit in a frame, full quality resumes once input stops
+#define FRAME_BUDGET_MS 16.0
+#define INPUT_IDLE_MS 250.0
+#define MIN_INTERACTIVE_ITERATIONS 256
+#define MAX_ITERATIONS (UINT32_MAX - 2) // the most a location file may ask for, UINT32_MAX means inside
+bool interacting = false;
+double last_input_time;
+uint32_t full_iterations; // iteration cap outside of interaction
+bool iterations_capped = false; // samples rendered meanwhile have to be redone at full quality
+double sample_iters_per_ms = 0.0; // measured throughput: samples per ms times the iteration cap they ran with
 
 // set configurations and generate reference orbit
-void configure_renderer(void) {
-    uint32_t prec = 1024; // bits
-    uint32_t ref_iterations = 20000;
-    mpf_init_set_str(fractal_frame.c_re, "-147994622332507888020258065344200153e-35", 10);
-    mpf_init_set_str(fractal_frame.c_im,  "0000901397329020353980197791866e-30", 10);
-    mpf_init_set_str(fractal_frame.zoom, "2e34", 10);
-
+bool configure_renderer(void) {
     printf("building reference iteration...\n");
-    double currentTime = GetTime();
+    double currentTime = render_time_ms();
 
-    // TODO For some reason ref always has iterations set to 0 :/
-    fractal_ref_iter = build_ref_iter(&fractal_frame, prec, ref_iterations);
+    if(!fractal_setup_init(&fractal_setup, &fractal_params)) { return false; }
 
-    printf("ref iter time: %f ms\n", (GetTime() - currentTime) * 1000);
-
-    // set configuration
-    fractal_config = (PerturbMandelbrotCFG){
-        .iterations = 20000,
-        .frame = &fractal_frame,
-        .reference = &fractal_ref_iter
-    };
+    printf("ref iter time: %f ms\n", render_time_ms() - currentTime);
+    full_iterations = fractal_params.iterations;
+    return true;
 }
 
 void reset_decimation_level(void) {
     decimation_level = N_DECIMATIONS - 1;
-    for(uint32_t i = 0; i < N_DECIMATIONS; ++i) {
-        if(fractal_image[i] != NULL && IsImageValid(*fractal_image[i])){
-            UnloadImage(*fractal_image[i]);
-        }
-        free(fractal_image[i]);
-        fractal_image[i] = NULL;
+    renderer_reset(&renderer);
+}
 
-        if(IsTextureValid(fractal_tex[i])) {
-            UnloadTexture(fractal_tex[i]);
+#define MAX_DIRTY_RECTS 256
+PixelRect_t dirty_rects[MAX_DIRTY_RECTS];
+
+// hand the renderer's current buffer and the regions that changed since the last call to the UI thread
+void publish_render_events(void) {
+    if(renderer.buf == NULL) { return; }
+    if(renderer.buf != published_buf) {
+        // the UI keeps the published buffer alive, so a new buffer can't show up at the same address
+        RenderEvent_t ev = {EV_BUFFER, fractal_buffer_retain(renderer.buf)};
+        if(!spsc_push(&render_events, &ev)) {
+            fractal_buffer_release(ev.buf);
+            return;
         }
+        published_buf = renderer.buf;
+    }
+    // whatever doesn't fit stays in the buffer's dirty list until the next call
+    uint32_t space = spsc_space(&render_events);
+    uint32_t n = renderer_takeDirty(&renderer, dirty_rects, space < MAX_DIRTY_RECTS ? space : MAX_DIRTY_RECTS);
+    for(uint32_t i = 0; i < n; ++i) {
+        RenderEvent_t ev = {EV_DIRTY, NULL, dirty_rects[i]};
+        spsc_push(&render_events, &ev);
     }
 }
 
-void update_texture_from_image(void) {
-    if(IsTextureValid(fractal_tex[decimation_level])) { UnloadTexture(fractal_tex[decimation_level]); }
-    fractal_tex[decimation_level] = LoadTextureFromImage(*fractal_image[decimation_level]);
-}
 void redraw_fractal_dec(uint32_t screen_width, uint32_t screen_height) {
-    float pixel_scale = final_pixel_scale / pow(DECIMATION_FAC, decimation_level);
-    renderer_startRender(&renderer, screen_width * pixel_scale, screen_height * pixel_scale);
-    fractal_image[decimation_level] = renderer_getResultImage(&renderer);
+    uint32_t step = 1;
+    for(uint32_t i = 0; i < decimation_level; ++i) { step *= DECIMATION_FAC; }
+    // tiles under the cursor go first with TILE_ORDER_CURSOR
+    renderer.focus_x = render_cursor.x * final_pixel_scale;
+    renderer.focus_y = render_cursor.y * final_pixel_scale;
+    renderer_startRender(&renderer, screen_width * final_pixel_scale, screen_height * final_pixel_scale, step);
 }
 
 
@@ -122,43 +189,340 @@ ScrollbarData scrollbarData = {};
 
 bool debugEnabled = false;
 
-void fractal_render_update(Clay_Dimensions *screen_dims) {
-    RendererState_t r_state = renderer_update(&renderer);
-    if(memcmp(screen_dims, &prev_screen_dims, sizeof(screen_dims))) {
-        prev_screen_dims = *screen_dims;
-        if(r_state == RENDERING) {
-            renderer_cancel(&renderer);
+// renderer prefill: samples of the view that are cached don't get rendered
+void prefill_from_cache(FractalBuffer_t *buf, void *ctx) {
+    CacheView_t view = tile_cache_view(&fractal_setup, buf->image->width, buf->image->height);
+    uint64_t filled = tile_cache_fill(&tile_cache, &view, buf, renderer.opts.palette);
+    if(filled > 0) {
+        printf("%" PRIu64 " samples from the tile cache\n", filled);
+    }
+}
+
+// start the next decimation level or verify pass once a render finished
+void continue_render_chain(Clay_Dimensions *screen_dims) {
+    if(decimation_level > 0) {
+        decimation_level--;
+        redraw_fractal_dec(screen_dims->width, screen_dims->height);
+    } else if(renderer.opts.guess && (renderer.pass == PASS_SAMPLE || renderer.last_corrected > 0)) {
+        // guesses along the edges of guessed regions are rechecked until none of them were wrong
+        renderer_startVerify(&renderer);
+    } else if(renderer.opts.antialias > 0 && renderer.pass != PASS_ANTIALIAS) {
+        renderer_startAntialias(&renderer);
+    } else if(renderer.complete) {
+        // the view is done
+        CacheView_t view = tile_cache_view(&fractal_setup, renderer.buf->image->width, renderer.buf->image->height);
+        tile_cache_store(&tile_cache, &view, renderer.buf);
+        printf("tile cache: %zu tiles, %" PRIu64 " hits, %" PRIu64 " misses\n", tile_cache.n_tiles, tile_cache.hits, tile_cache.misses);
+        if(prefetch_enabled) {
+            prefetch_plan(&prefetcher, renderer.buf->image->width, renderer.buf->image->height,
+                          render_cursor.x * final_pixel_scale, render_cursor.y * final_pixel_scale, renderer.opts);
         }
+    }
+}
+
+// update the throughput estimate from the render that just finished, tiny renders are mostly overhead
+void measure_render_rate(void) {
+    if(renderer.pass != PASS_SAMPLE || renderer.last_kernel_calls < 1000 || renderer.last_render_ms <= 0.0) { return; }
+    double rate = renderer.last_kernel_calls / renderer.last_render_ms * *fractal_setup_iterations(&fractal_setup);
+    sample_iters_per_ms = sample_iters_per_ms == 0.0 ? rate : 0.8 * sample_iters_per_ms + 0.2 * rate;
+}
+
+// Pick the finest decimation level that renders within FRAME_BUDGET_MS at the measured throughput.
+// If even the coarsest level doesn't fit, the iteration cap is lowered as well.
+void plan_interactive_render(uint32_t width, uint32_t height) {
+    uint32_t *iterations = fractal_setup_iterations(&fractal_setup);
+    *iterations = full_iterations;
+    decimation_level = N_DECIMATIONS - 1;
+    if(sample_iters_per_ms == 0.0) { return; } // nothing measured yet, start coarse
+
+    double samples_per_ms = sample_iters_per_ms / full_iterations;
+    double samples = 0.0;
+    uint32_t step = 1;
+    for(uint32_t level = 0; level < N_DECIMATIONS; ++level) {
+        samples = (double)lattice_size(width, step) * lattice_size(height, step);
+        if(samples / samples_per_ms <= FRAME_BUDGET_MS) {
+            decimation_level = level;
+            return;
+        }
+        step *= DECIMATION_FAC;
+    }
+
+    double cap = full_iterations * FRAME_BUDGET_MS * samples_per_ms / samples;
+    *iterations = cap > MIN_INTERACTIVE_ITERATIONS ? (uint32_t)cap : MIN_INTERACTIVE_ITERATIONS;
+    iterations_capped |= *iterations < full_iterations;
+}
+
+// called on every navigation input, after the running render was cancelled
+void begin_interaction(uint32_t width, uint32_t height) {
+    interacting = true;
+    last_input_time = render_time_ms();
+    plan_interactive_render(width, height);
+}
+
+// move the view by (dx, dy) pixels of the fractal image
+void pan_view(int32_t dx, int32_t dy, Clay_Dimensions *screen_dims) {
+    if(renderer.buf == NULL || (dx == 0 && dy == 0)) { return; }
+    uint32_t width = renderer.buf->image->width;
+    uint32_t height = renderer.buf->image->height;
+    // the workers read the frame, it only moves once they've left
+    renderer_cancel(&renderer);
+    renderer_wait(&renderer);
+    frame_pan(&fractal_setup.frame, dx, dy, width);
+    fractal_setup_update(&fractal_setup);
+    begin_interaction(width, height);
+    if(decimation_level == 0 && renderer_pan(&renderer, dx, dy)) {
+        // only the exposed strips get rendered
+        return;
+    }
+    // keep the shifted image as preview, the planned level renders on top of it
+    renderer_zoom(&renderer, 1.0, dx, dy);
+    redraw_fractal_dec(screen_dims->width, screen_dims->height);
+}
+
+// zoom in (or out) by 2 around anchor, in screen coordinates. The current image is resampled as a preview meanwhile.
+void zoom_view(bool out, Vector2 anchor, Clay_Dimensions *screen_dims) {
+    if(renderer.buf == NULL) { return; }
+    uint32_t width = renderer.buf->image->width;
+    uint32_t height = renderer.buf->image->height;
+    double scale = out ? 2.0 : 0.5;
+    double cdx = zoom_center_offset(width, scale, anchor.x * final_pixel_scale);
+    double cdy = zoom_center_offset(height, scale, anchor.y * final_pixel_scale);
+    if(out) {
+        // of the lattices a level up, go back to the one that's cached if there is one (e.g. the view zoomed in from)
+        CacheView_t view = tile_cache_view(&fractal_setup, width, height);
+        for(uint32_t i = 0; i < 4; ++i) {
+            double dx = cdx + i % 2;
+            double dy = cdy + i / 2;
+            // pixel of the current view the zoomed out view's pixel (0, 0) is on
+            int64_t ux = (int64_t)round(width / 2.0 + dx + (0.5 - width / 2.0) * scale - 0.5);
+            int64_t uy = (int64_t)round(height / 2.0 + dy + (0.5 - height / 2.0) * scale - 0.5);
+            CacheView_t up = cache_view_zoom_out(&view, ux, uy);
+            if(tile_cache_has_view(&tile_cache, &up)) {
+                cdx = dx;
+                cdy = dy;
+                break;
+            }
+        }
+    }
+    // the workers read the frame, it only moves once they've left
+    renderer_cancel(&renderer);
+    renderer_wait(&renderer);
+    frame_pan(&fractal_setup.frame, cdx, cdy, width);
+    frame_zoom(&fractal_setup.frame, 2, out);
+    fractal_setup_update(&fractal_setup);
+    // samples that line up with the previous view are kept, no renderer_reset
+    renderer_zoom(&renderer, scale, cdx, cdy);
+    begin_interaction(width, height);
+    redraw_fractal_dec(screen_dims->width, screen_dims->height);
+}
+
+// apply one command from the UI thread, returns false on CMD_QUIT
+bool handle_render_command(RenderCommand_t *cmd, Clay_Dimensions *screen_dims) {
+    if(cmd->type != CMD_CURSOR && cmd->type != CMD_SAVE) {
+        // real work goes first, the prefetch is planned again once the view is done
+        prefetch_cancel(&prefetcher);
+    }
+    switch(cmd->type) {
+    case CMD_RESIZE:
+        *screen_dims = (Clay_Dimensions) {cmd->x, cmd->y};
+        renderer_cancel(&renderer);
         reset_decimation_level();
         redraw_fractal_dec(screen_dims->width, screen_dims->height);
+        break;
+    case CMD_CURSOR:
+        render_cursor = (Vector2) {cmd->x, cmd->y};
+        break;
+    case CMD_RERENDER:
+        renderer_cancel(&renderer);
+        reset_decimation_level();
+        redraw_fractal_dec(screen_dims->width, screen_dims->height);
+        break;
+    case CMD_TOGGLE_ADAPTIVE:
+        // re-render to compare with full rendering
+        renderer.opts.adaptive = !renderer.opts.adaptive;
+        printf("adaptive rendering %s\n", renderer.opts.adaptive ? "on" : "off");
+        renderer_cancel(&renderer);
+        reset_decimation_level();
+        redraw_fractal_dec(screen_dims->width, screen_dims->height);
+        break;
+    case CMD_TOGGLE_GUESS:
+        renderer.opts.guess = !renderer.opts.guess;
+        printf("guessing %s\n", renderer.opts.guess ? "on" : "off");
+        renderer_cancel(&renderer);
+        reset_decimation_level();
+        redraw_fractal_dec(screen_dims->width, screen_dims->height);
+        break;
+    case CMD_TOGGLE_ANTIALIAS:
+        renderer.opts.antialias = renderer.opts.antialias > 0 ? 0 : ANTIALIAS_SAMPLES;
+        printf("antialiasing %s\n", renderer.opts.antialias > 0 ? "on" : "off");
+        renderer_cancel(&renderer);
+        reset_decimation_level();
+        redraw_fractal_dec(screen_dims->width, screen_dims->height);
+        break;
+    case CMD_TOGGLE_PREFETCH:
+        prefetch_enabled = !prefetch_enabled;
+        printf("prefetching %s\n", prefetch_enabled ? "on, from the next finished view" : "off");
+        break;
+    case CMD_CYCLE_ORDER:
+        renderer.opts.order = (renderer.opts.order + 1) % N_TILE_ORDERS;
+        printf("tile order %s\n", TILE_ORDER_NAMES[renderer.opts.order]);
+        renderer_cancel(&renderer);
+        reset_decimation_level();
+        redraw_fractal_dec(screen_dims->width, screen_dims->height);
+        break;
+    case CMD_PAN:
+        pan_view(cmd->dx, cmd->dy, screen_dims);
+        break;
+    case CMD_ZOOM:
+        zoom_view(cmd->out, (Vector2) {cmd->x, cmd->y}, screen_dims);
+        break;
+    case CMD_SAVE:
+        params_from_frame(&fractal_params, &fractal_setup.frame);
+        if(params_save(&fractal_params, SAVE_PARAMS_PATH)) {
+            printf("saved location to %s\n", SAVE_PARAMS_PATH);
+        }
+        break;
+    case CMD_MORE_ITERATIONS: {
+        if(full_iterations >= MAX_ITERATIONS) {
+            printf("iteration cap %u is the maximum\n", full_iterations);
+            break;
+        }
+        uint32_t more = full_iterations > MAX_ITERATIONS / 2 ? MAX_ITERATIONS : full_iterations * 2;
+        // the reference orbit may be rebuilt longer, no render thread may be reading it meanwhile,
+        // the prefetch jobs included, they share it
+        prefetch_wait(&prefetcher);
+        renderer_stop(&renderer);
+        if(fractal_setup_set_iterations(&fractal_setup, more)) {
+            full_iterations = more;
+            fractal_params.iterations = full_iterations;
+            iterations_capped = false;
+            uint64_t redo = renderer_raiseIterations(&renderer);
+            printf("iteration cap %u, %" PRIu64 " samples to continue\n", full_iterations, redo);
+        } else {
+            printf("iteration cap stays at %u\n", full_iterations);
+        }
+        decimation_level = N_DECIMATIONS - 1;
+        redraw_fractal_dec(screen_dims->width, screen_dims->height);
+        break;
+    }
+    case CMD_QUIT:
+        return false;
+    }
+    return true;
+}
+
+void fractal_render_update(Clay_Dimensions *screen_dims) {
+    // input stopped, go back to full quality
+    if(interacting && render_time_ms() - last_input_time > INPUT_IDLE_MS) {
+        interacting = false;
+        if(iterations_capped) {
+            // samples that escaped below the lowered cap are final, the others continue where they stopped.
+            // The workers read the cap, it only changes once they've left
+            renderer_cancel(&renderer);
+            renderer_wait(&renderer);
+            *fractal_setup_iterations(&fractal_setup) = full_iterations;
+            iterations_capped = false;
+            renderer_raiseIterations(&renderer);
+            decimation_level = N_DECIMATIONS - 1;
+            redraw_fractal_dec(screen_dims->width, screen_dims->height);
+        } else if(renderer.state == IDLE) {
+            continue_render_chain(screen_dims);
+        }
     }
 
-    r_state = renderer_update(&renderer);
-    if(r_state == RENDERING) {
-        // update texture from image
-        update_texture_from_image();
-    } else {
-        // render finished, load texture one last time
-        if(r_state == FINISHED) {
-            update_texture_from_image();
+    if(renderer_update(&renderer) == FINISHED) {
+        renderer.state = IDLE;
+        measure_render_rate();
+
+        // check if we still have to do the next decimation level, held while the view is being moved
+        if(!interacting) {
+            continue_render_chain(screen_dims);
+        }
+    }
+
+    // the view is done, spend the idle render threads on the next ones
+    if(prefetch_enabled && renderer.state == IDLE && !interacting) {
+        prefetch_update(&prefetcher);
+    }
+}
 
-            renderer.state = IDLE;
+// the render coordinator thread: owns the renderer from start up to shut down
+void* render_coordinator(void *arg) {
+    struct timespec poll = {0, COORDINATOR_POLL_NS};
+    bool running = true;
+    while(running) {
+        RenderCommand_t cmd;
+        while(running && spsc_pop(&render_commands, &cmd)) {
+            running = handle_render_command(&cmd, &render_screen_dims);
+        }
+        fractal_render_update(&render_screen_dims);
+        publish_render_events();
+        nanosleep(&poll, NULL);
+    }
+    prefetch_destroy(&prefetcher);
+    renderer_destroy(&renderer);
+    tile_cache_destroy(&tile_cache);
+    return NULL;
+}
+
+// UI thread -----------------------------------------------------------------------------
+
+FractalBuffer_t *ui_buf = NULL; // buffer of the last EV_BUFFER, the texture shows its image
+Texture2D fractal_tex;
+Color *dirty_pixels; // staging buffer for uploading rects narrower than the image
+size_t dirty_pixels_cap;
+
+void send_render_command(RenderCommand_t cmd) {
+    if(!spsc_push(&render_commands, &cmd)) {
+        printf("render command queue full, dropping command %i\n", cmd.type);
+    }
+}
+
+void upload_rect(PixelRect_t d) {
+    Image *image = ui_buf->image;
+    Color *pixels = (Color*)image->data;
+    uint32_t w = d.x1 - d.x0;
+    uint32_t h = d.y1 - d.y0;
+    Rectangle rec = {d.x0, d.y0, w, h};
+    if(w == image->width) {
+        // full rows are contiguous in the image already
+        UpdateTextureRec(fractal_tex, rec, &pixels[(size_t)d.y0 * image->width]);
+        return;
+    }
+    if((size_t)w * h > dirty_pixels_cap) {
+        dirty_pixels_cap = (size_t)w * h;
+        dirty_pixels = realloc(dirty_pixels, dirty_pixels_cap * sizeof(Color));
+    }
+    for(uint32_t y = 0; y < h; ++y) {
+        memcpy(&dirty_pixels[(size_t)y * w], &pixels[(size_t)(d.y0 + y) * image->width + d.x0], w * sizeof(Color));
+    }
+    UpdateTextureRec(fractal_tex, rec, dirty_pixels);
+}
 
-            // check if we still have to do the next decimation level
-            if(decimation_level > 0) {
-                decimation_level--;
-                redraw_fractal_dec(screen_dims->width, screen_dims->height);
+// upload what the coordinator published since the last frame, the texture is only recreated when the image size changes
+void update_texture_from_events(void) {
+    RenderEvent_t ev;
+    while(spsc_pop(&render_events, &ev)) {
+        if(ev.type == EV_BUFFER) {
+            if(ui_buf != NULL) { fractal_buffer_release(ui_buf); }
+            ui_buf = ev.buf;
+            Image *image = ui_buf->image;
+            if(!IsTextureValid(fractal_tex) || fractal_tex.width != image->width || fractal_tex.height != image->height) {
+                if(IsTextureValid(fractal_tex)) { UnloadTexture(fractal_tex); }
+                fractal_tex = LoadTextureFromImage(*image);
+            } else {
+                UpdateTexture(fractal_tex, image->data);
             }
+        } else if(ui_buf != NULL) {
+            upload_rect(ev.rect);
         }
     }
 }
 
 void drawFractalTex(Clay_Dimensions *screen_dims) {
-    // draw images
-    for(int32_t dec = N_DECIMATIONS - 1; dec >= 0; dec--) {
-        if(IsTextureValid(fractal_tex[dec])) {
-            DrawTexturePro(fractal_tex[dec], (Rectangle) { 0.0, 0.0, fractal_tex[dec].width, fractal_tex[dec].height}, (Rectangle) { 0.0, 0.0, screen_dims->width, screen_dims->height}, (Vector2) { 0.0, 0.0 }, 0.0, WHITE);
-        }
+    // draw image
+    if(IsTextureValid(fractal_tex)) {
+        DrawTexturePro(fractal_tex, (Rectangle) { 0.0, 0.0, fractal_tex.width, fractal_tex.height}, (Rectangle) { 0.0, 0.0, screen_dims->width, screen_dims->height}, (Vector2) { 0.0, 0.0 }, 0.0, WHITE);
     }
 }
 
@@ -179,17 +543,77 @@ void UpdateDrawFrame(void)
     Clay_Dimensions screen_dims = (Clay_Dimensions) { (float)GetScreenWidth(), (float)GetScreenHeight() };
     Clay_SetLayoutDimensions(screen_dims);
 
-    // update fractal rendering (render next thing, update current texture, etc)
-    fractal_render_update(&screen_dims);
+    // the renderer runs on the coordinator thread, only tell it about new screen sizes and upload its results
+    if(memcmp(&screen_dims, &prev_screen_dims, sizeof(screen_dims))) {
+        prev_screen_dims = screen_dims;
+        send_render_command((RenderCommand_t) {.type = CMD_RESIZE, .x = screen_dims.width, .y = screen_dims.height});
+    }
+    Vector2 mouse = GetMousePosition();
+    Vector2 mouse_delta = GetMouseDelta();
+    if(mouse_delta.x != 0.0 || mouse_delta.y != 0.0) {
+        send_render_command((RenderCommand_t) {.type = CMD_CURSOR, .x = mouse.x, .y = mouse.y});
+    }
+    update_texture_from_events();
 
     if (!IsMouseButtonDown(0)) {
         scrollbarData.mouseDown = false;
     }
 
     if (IsKeyPressed(KEY_R)) {
-        renderer_cancel(&renderer);
-        reset_decimation_level();
-        redraw_fractal_dec(screen_dims.width, screen_dims.height);
+        send_render_command((RenderCommand_t) {.type = CMD_RERENDER});
+    }
+
+    // toggle adaptive (Mariani-Silver) rendering
+    if (IsKeyPressed(KEY_A)) {
+        send_render_command((RenderCommand_t) {.type = CMD_TOGGLE_ADAPTIVE});
+    }
+
+    // toggle guessing samples from the coarser decimation level
+    if (IsKeyPressed(KEY_G)) {
+        send_render_command((RenderCommand_t) {.type = CMD_TOGGLE_GUESS});
+    }
+
+    // toggle supersampling the edges between iteration counts once the full resolution render is done
+    if (IsKeyPressed(KEY_M)) {
+        send_render_command((RenderCommand_t) {.type = CMD_TOGGLE_ANTIALIAS});
+    }
+
+    // render the likely next views ahead while idle
+    if (IsKeyPressed(KEY_P)) {
+        send_render_command((RenderCommand_t) {.type = CMD_TOGGLE_PREFETCH});
+    }
+
+    // cycle the order tiles are rendered in
+    if (IsKeyPressed(KEY_T)) {
+        send_render_command((RenderCommand_t) {.type = CMD_CYCLE_ORDER});
+    }
+
+    // save the current location
+    if (IsKeyPressed(KEY_S)) {
+        send_render_command((RenderCommand_t) {.type = CMD_SAVE});
+    }
+
+    // double the iteration cap, only samples that didn't escape are rendered again
+    if (IsKeyPressed(KEY_I)) {
+        send_render_command((RenderCommand_t) {.type = CMD_MORE_ITERATIONS});
+    }
+
+    // pan with the arrow keys or by dragging, samples still on screen are kept
+    int32_t pan_x = (IsKeyPressed(KEY_RIGHT) - IsKeyPressed(KEY_LEFT)) * (int32_t)(screen_dims.width * final_pixel_scale / 10);
+    int32_t pan_y = (IsKeyPressed(KEY_DOWN) - IsKeyPressed(KEY_UP)) * (int32_t)(screen_dims.height * final_pixel_scale / 10);
+    if (IsMouseButtonDown(0) && !scrollbarData.mouseDown) {
+        pan_x -= (int32_t)roundf(mouse_delta.x * final_pixel_scale);
+        pan_y -= (int32_t)roundf(mouse_delta.y * final_pixel_scale);
+    }
+    if (pan_x != 0 || pan_y != 0) {
+        send_render_command((RenderCommand_t) {.type = CMD_PAN, .dx = pan_x, .dy = pan_y});
+    }
+
+    // zoom in/out by 2 around the cursor with the mouse wheel or Z/X
+    if (mouseWheelY > 0 || IsKeyPressed(KEY_Z)) {
+        send_render_command((RenderCommand_t) {.type = CMD_ZOOM, .out = false, .x = mouse.x, .y = mouse.y});
+    } else if (mouseWheelY < 0 || IsKeyPressed(KEY_X)) {
+        send_render_command((RenderCommand_t) {.type = CMD_ZOOM, .out = true, .x = mouse.x, .y = mouse.y});
     }
 
     if (IsMouseButtonDown(0) && !scrollbarData.mouseDown && Clay_PointerOver(Clay__HashString(CLAY_STRING("ScrollBar"), 0, 0))) {
@@ -240,16 +664,31 @@ void HandleClayErrors(Clay_ErrorData errorData) {
 
 
 
-int main(void) {
+// gmpfract [location.params]
+int main(int argc, char **argv) {
+    params_default(&fractal_params);
+    if(argc > 1 && !params_load(&fractal_params, argv[1])) { return 1; }
+
     uint64_t totalMemorySize = Clay_MinMemorySize();
     Clay_Arena clayMemory = Clay_CreateArenaWithCapacityAndMemory(totalMemorySize, malloc(totalMemorySize));
     Clay_Initialize(clayMemory, (Clay_Dimensions) { (float)GetScreenWidth(), (float)GetScreenHeight() }, (Clay_ErrorHandler) { HandleClayErrors });
     Clay_SetMeasureTextFunction(Raylib_MeasureText, 0);
     Clay_Raylib_Initialize(1024, 768, "Clay - Raylib Renderer Example", FLAG_VSYNC_HINT | FLAG_WINDOW_RESIZABLE | FLAG_WINDOW_HIGHDPI | FLAG_MSAA_4X_HINT);
     
-    configure_renderer();
-    renderer_init(&renderer, (Fractal) &perturb_mandelbrot, (void*)&fractal_config, N_THREADS);
+    if(!configure_renderer()) { return 1; }
+    renderer_init(&renderer, fractal_setup_fn(&fractal_setup), fractal_setup_cfg(&fractal_setup), RENDER_PLACEMENT);
+    renderer.opts.palette = fractal_params.palette;
+    renderer.opts.keep_orbits = true;
+    renderer.opts.antialias = ANTIALIAS_SAMPLES;
+    tile_cache_init(&tile_cache, (size_t)TILE_CACHE_MIB << 20);
+    renderer.prefill = &prefill_from_cache;
+    prefetch_init(&prefetcher, &renderer.pool, &tile_cache, &fractal_setup);
     reset_decimation_level();
+    // the coordinator inherits the reserved CPUs
+    render_pool_pin_reserved(&renderer.pool);
+    spsc_init(&render_commands, sizeof(RenderCommand_t), RENDER_QUEUE_SIZE);
+    spsc_init(&render_events, sizeof(RenderEvent_t), RENDER_QUEUE_SIZE);
+    pthread_create(&coordinator_tid, NULL, (void *(*)(void *)) render_coordinator, NULL);
 
     Raylib_fonts[FONT_ID_BODY_24] = (Raylib_Font) {
         .font = LoadFontEx("resources/Roboto-Regular.ttf", 48, 0, 400),
@@ -270,5 +709,19 @@ int main(void) {
     {
         UpdateDrawFrame();
     }
+
+    // the coordinator shuts the renderer down, then drop the buffers still queued for the UI
+    RenderCommand_t quit = {.type = CMD_QUIT};
+    while(!spsc_push(&render_commands, &quit)) { sched_yield(); }
+    pthread_join(coordinator_tid, NULL);
+    RenderEvent_t ev;
+    while(spsc_pop(&render_events, &ev)) {
+        if(ev.type == EV_BUFFER) { fractal_buffer_release(ev.buf); }
+    }
+    if(ui_buf != NULL) { fractal_buffer_release(ui_buf); }
+    spsc_destroy(&render_commands);
+    spsc_destroy(&render_events);
+    fractal_setup_free(&fractal_setup);
+    params_free(&fractal_params);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,623 @@
+// Command line renderer: renders one frame (or a zoom sequence) with the threaded perturbation renderer and writes it to files.
+// Frames too big for memory are rendered in bands and streamed to a PPM file or a DZI tile pyramid.
+// No window or GL context is created, but it still links raylib for its CPU side image functions (Image, ExportImage).
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+#include "draw_fractal.h"
+#include "mandelbrot.h"
+#include "fractal_params.h"
+#include "zoom_sequence.h"
+#include "exp_map.h"
+#include "band_render.h"
+#include "dzi_pyramid.h"
+#include "image_io.h"
+#include "raw_format.h"
+#include "checkpoint.h"
+#include "gmp.h"
+
+#define RENDER_POLL_NS 1000000 // 1 ms
+#define DZI_DEFAULT_MEMORY (256ull << 20) // band memory of pyramid renders without --memory
+#define EXP_MAP_DEFAULT_MEMORY (4096ull << 20) // exponential map memory of sequences without --memory
+#define CHECKPOINT_DEFAULT_INTERVAL 300 // seconds
+
+typedef struct CliOptions_t {
+    FractalParams_t params;
+    const char *save_params;
+    uint32_t width, height;
+    const char *out;
+    RenderPlacement_t placement;
+    RenderOptions_t opts;
+    uint32_t frames; // zoom sequence instead of a single frame if > 0
+    double zoom_start;
+    bool exp_map; // resample the sequence from an exponential map instead of rendering every frame
+    uint64_t memory; // bytes of pixel buffers for a banded render, 0 renders the whole frame at once
+    bool resume; // continue an interrupted banded render, or a single frame from its checkpoint
+    uint32_t tile_size; // of DZI output
+    const char *tile_format;
+    bool compress; // DEFLATE the tiles of .gfr output
+    const char *checkpoint; // checkpoint file of a single frame render, NULL for none
+    uint32_t checkpoint_interval; // seconds between checkpoints
+} CliOptions_t;
+
+void print_usage(const char *name) {
+    printf("Usage: %s [options]\n"
+           "Options are applied in order, later ones override earlier ones.\n"
+           "  -l, --params <file>      load a location parameter file\n"
+           "  -s, --save-params <file> save the location parameters used\n"
+           "  -r, --re <real>          center, real part (decimal string, any precision)\n"
+           "  -i, --im <imag>          center, imaginary part\n"
+           "  -z, --zoom <zoom>        zoom, 1 shows -2..2 across the width\n"
+           "  -n, --iterations <n>     iteration cap\n"
+           "  -p, --precision <bits>   GMP precision of the center and reference orbit\n"
+           "  -b, --bailout <radius>   escape radius\n"
+           "  -k, --kernel <name>      perturb or double\n"
+           "  -c, --palette <name>     hsv, gray or fire\n"
+           "  -w, --width <pixels>\n"
+           "  -h, --height <pixels>\n"
+           "  -o, --out <file>         output image, .ppm or .png, .dzi for a Deep Zoom tile pyramid\n"
+           "                           or .gfr for raw iteration data to recolour with gmpfract_recolor\n"
+           "  -t, --threads <n>        render threads, 0 for one per core\n"
+           "  -a, --adaptive           Mariani-Silver adaptive rendering\n"
+           "  -g, --guess              render progressively and guess samples from the coarser level,\n"
+           "                           needs the whole frame so it's ignored with --memory and .dzi output\n"
+           "  -A, --antialias <n>      supersample pixels along edges between iteration counts with up to n\n"
+           "                           sub-samples each, 4 to %d, 0 for none\n"
+           "      --aa-threshold <n>   iteration counts further apart than this count as an edge, default 0\n"
+           "  -f, --frames <n>         render a zoom sequence of n frames ending at the location\n"
+           "      --zoom-start <zoom>  zoom of the first frame of a sequence, default 1\n"
+           "  -e, --exp-map            render the sequence as one exponential map and resample the frames from it\n"
+           "  -m, --memory <MiB>       render in bands within this much buffer memory and stream them to a .ppm --out,\n"
+           "                           for --exp-map the most the map may take, default %d\n"
+           "      --resume             continue an interrupted banded render of the same location and size,\n"
+           "                           or a single frame from its --checkpoint\n"
+           "      --tile-size <pixels> tile size of .dzi output, a power of 2, default 256\n"
+           "      --tile-format <ext>  png or ppm tiles for .dzi output, default png\n"
+           "      --compress           compress .gfr output\n"
+           "      --checkpoint <file>  save the progress of a single frame render to file every so often and on\n"
+           "                           SIGINT/SIGTERM, --resume continues from it\n"
+           "      --checkpoint-interval <seconds>  default 300\n"
+           "      --help\n"
+           "For a sequence --out is either a file name pattern with one %%d for the frame number (e.g. frame%%05d.ppm,\n"
+           "only a 0 flag and a width are allowed) or a .rgb/.raw file to write raw rgb24 video to, - for stdout:\n"
+           "  %s -f 600 -w 1280 -h 720 -o - | ffmpeg -f rawvideo -pix_fmt rgb24 -s 1280x720 -r 30 -i - zoom.mp4\n", name, AA_MAX_SAMPLES, (int)(EXP_MAP_DEFAULT_MEMORY >> 20), name);
+}
+
+// parse the command line, returns false if the render shouldn't go ahead
+bool parse_options(int argc, char **argv, CliOptions_t *o) {
+    static const struct option long_options[] = {
+        {"params", required_argument, NULL, 'l'},
+        {"save-params", required_argument, NULL, 's'},
+        {"re", required_argument, NULL, 'r'},
+        {"im", required_argument, NULL, 'i'},
+        {"zoom", required_argument, NULL, 'z'},
+        {"iterations", required_argument, NULL, 'n'},
+        {"precision", required_argument, NULL, 'p'},
+        {"bailout", required_argument, NULL, 'b'},
+        {"kernel", required_argument, NULL, 'k'},
+        {"palette", required_argument, NULL, 'c'},
+        {"width", required_argument, NULL, 'w'},
+        {"height", required_argument, NULL, 'h'},
+        {"out", required_argument, NULL, 'o'},
+        {"threads", required_argument, NULL, 't'},
+        {"adaptive", no_argument, NULL, 'a'},
+        {"guess", no_argument, NULL, 'g'},
+        {"antialias", required_argument, NULL, 'A'},
+        {"aa-threshold", required_argument, NULL, 'X'},
+        {"frames", required_argument, NULL, 'f'},
+        {"zoom-start", required_argument, NULL, 'Z'},
+        {"exp-map", no_argument, NULL, 'e'},
+        {"memory", required_argument, NULL, 'm'},
+        {"resume", no_argument, NULL, 'R'},
+        {"tile-size", required_argument, NULL, 'T'},
+        {"tile-format", required_argument, NULL, 'F'},
+        {"compress", no_argument, NULL, 'C'},
+        {"checkpoint", required_argument, NULL, 'K'},
+        {"checkpoint-interval", required_argument, NULL, 'I'},
+        {"help", no_argument, NULL, 'H'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+    bool ok = true;
+    while(ok && (c = getopt_long(argc, argv, "l:s:r:i:z:n:p:b:k:c:w:h:o:t:agA:f:em:", long_options, NULL)) != -1) {
+        switch(c) {
+        case 'l': ok = params_load(&o->params, optarg); break;
+        case 's': o->save_params = optarg; break;
+        case 'r': ok = params_set(&o->params, "re", optarg); break;
+        case 'i': ok = params_set(&o->params, "im", optarg); break;
+        case 'z': ok = params_set(&o->params, "zoom", optarg); break;
+        case 'n': ok = params_set(&o->params, "iterations", optarg); break;
+        case 'p': ok = params_set(&o->params, "precision", optarg); break;
+        case 'b': ok = params_set(&o->params, "bailout", optarg); break;
+        case 'k': ok = params_set(&o->params, "kernel", optarg); break;
+        case 'c': ok = params_set(&o->params, "palette", optarg); break;
+        case 'w': o->width = strtoul(optarg, NULL, 10); break;
+        case 'h': o->height = strtoul(optarg, NULL, 10); break;
+        case 'o': o->out = optarg; break;
+        case 't': o->placement.n_threads = strtoul(optarg, NULL, 10); break;
+        case 'a': o->opts.adaptive = true; break;
+        case 'g': o->opts.guess = true; break;
+        case 'A': o->opts.antialias = strtoul(optarg, NULL, 10); break;
+        case 'X': o->opts.aa_threshold = strtoul(optarg, NULL, 10); break;
+        case 'f': o->frames = strtoul(optarg, NULL, 10); break;
+        case 'Z': o->zoom_start = strtod(optarg, NULL); break;
+        case 'e': o->exp_map = true; break;
+        case 'm': o->memory = strtoull(optarg, NULL, 10) << 20; break;
+        case 'R': o->resume = true; break;
+        case 'T': o->tile_size = strtoul(optarg, NULL, 10); break;
+        case 'F': o->tile_format = optarg; break;
+        case 'C': o->compress = true; break;
+        case 'K': o->checkpoint = optarg; break;
+        case 'I': o->checkpoint_interval = strtoul(optarg, NULL, 10); break;
+        case 'H':
+            print_usage(argv[0]);
+            exit(0);
+        default:
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    if(!ok) { return false; }
+    if(o->width == 0 || o->height == 0) {
+        printf("width and height have to be positive\n");
+        return false;
+    }
+    if(o->tile_size == 0 || (o->tile_size & (o->tile_size - 1)) != 0) {
+        printf("the tile size has to be a power of 2\n");
+        return false;
+    }
+    if(o->opts.antialias != 0 && (o->opts.antialias < 4 || o->opts.antialias > AA_MAX_SAMPLES)) {
+        printf("--antialias takes 4 to %d sub-samples\n", AA_MAX_SAMPLES);
+        return false;
+    }
+    if(!(o->zoom_start > 0.0)) {
+        printf("the start zoom has to be positive\n");
+        return false;
+    }
+    return true;
+}
+
+// file name pattern of the frames of a sequence, split around its frame number
+typedef struct FramePattern_t {
+    const char *prefix;
+    int prefix_len;
+    bool zero_pad;
+    int width;
+    const char *suffix;
+} FramePattern_t;
+
+// Split pattern around its one %d (or %05d, %5d, %u ...). Any other % is refused, the pattern never goes to printf.
+bool parse_frame_pattern(const char *pattern, FramePattern_t *p) {
+    const char *conv = strchr(pattern, '%');
+    if(conv == NULL) { return false; }
+    const char *s = conv + 1;
+    p->zero_pad = *s == '0';
+    while(*s == '0') { ++s; }
+    p->width = 0;
+    while(*s >= '0' && *s <= '9' && p->width < 100) {
+        p->width = p->width * 10 + (*s++ - '0');
+    }
+    if(*s != 'd' && *s != 'u' && *s != 'i') { return false; }
+    if(strchr(s + 1, '%') != NULL) { return false; }
+    p->prefix = pattern;
+    p->prefix_len = (int)(conv - pattern);
+    p->suffix = s + 1;
+    return true;
+}
+
+// whether out names a raw rgb24 video file rather than a frame pattern
+bool is_video_file(const char *out) {
+    const char *ext = strrchr(out, '.');
+    return ext != NULL && (strcmp(ext, ".rgb") == 0 || strcmp(ext, ".raw") == 0) && strchr(out, '%') == NULL;
+}
+
+// where the frames of a zoom sequence go: numbered image files or one raw video stream
+typedef struct SequenceOutput_t {
+    FramePattern_t pattern; // of the frame files if video is NULL
+    FILE *video;
+    uint32_t frames;
+} SequenceOutput_t;
+
+bool write_sequence_frame(Image *image, uint32_t index, SequenceOutput_t *out) {
+    bool ok;
+    if(out->video == NULL) {
+        FramePattern_t *p = &out->pattern;
+        char path[4096];
+        int len = snprintf(path, sizeof(path), p->zero_pad ? "%.*s%0*u%s" : "%.*s%*u%s", p->prefix_len, p->prefix, p->width,
+                           index, p->suffix);
+        ok = len > 0 && (size_t)len < sizeof(path) && write_image(image, path);
+    } else {
+        ok = write_rgb(image, out->video) && fflush(out->video) == 0;
+    }
+    if(!ok) {
+        printf("writing frame %u failed\n", index);
+    } else {
+        printf("frame %u of %u written\n", index + 1, out->frames);
+    }
+    return ok;
+}
+
+// Render the zoom sequence and write its frames. Raw video for stdout goes to the original stdout,
+// everything printed goes to stderr meanwhile so it doesn't end up in the video.
+int render_sequence(CliOptions_t *o) {
+    SequenceOutput_t out = {.video = NULL, .frames = o->frames};
+    bool video = strcmp(o->out, "-") == 0 || is_video_file(o->out);
+    if(!video && !parse_frame_pattern(o->out, &out.pattern)) {
+        printf("for a sequence --out needs one %%d for the frame number (e.g. frame%%05d.png), a .rgb/.raw video file or -\n");
+        return 1;
+    }
+    if(strcmp(o->out, "-") == 0) {
+        fflush(stdout);
+        int video_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        out.video = fdopen(video_fd, "wb");
+    } else if(video) {
+        out.video = fopen(o->out, "wb");
+    }
+    if(video && out.video == NULL) {
+        printf("can't open %s\n", o->out);
+        return 1;
+    }
+    printf("location %016" PRIx64 "\n", params_hash(&o->params));
+
+    double start_ms = render_time_ms();
+    FractalSetup_t setup;
+    if(!fractal_setup_init(&setup, &o->params)) {
+        if(out.video != NULL) { fclose(out.video); }
+        return 1;
+    }
+    printf("reference orbit: %.2f ms\n", render_time_ms() - start_ms);
+
+    RenderPool_t pool;
+    render_pool_init(&pool, o->placement);
+    ZoomSequence_t seq = {
+        .frames = o->frames,
+        .zoom_start = o->zoom_start,
+        .width = o->width,
+        .height = o->height,
+        .in_flight = 0,
+        .opts = o->opts
+    };
+    seq.opts.palette = o->params.palette;
+    uint64_t exp_map_memory = o->memory > 0 ? o->memory : EXP_MAP_DEFAULT_MEMORY;
+    bool ok = o->exp_map ? exp_map_sequence_render(&seq, &pool, &setup, exp_map_memory, (ZoomFrameSink) &write_sequence_frame, &out)
+                         : zoom_sequence_render(&seq, &pool, &setup, (ZoomFrameSink) &write_sequence_frame, &out);
+    printf("total: %.2f ms\n", render_time_ms() - start_ms);
+
+    render_pool_destroy(&pool);
+    fractal_setup_free(&setup);
+    if(out.video != NULL && fclose(out.video) != 0) { ok = false; }
+    return ok ? 0 : 1;
+}
+
+// A banded render streams rows into the PPM as they're done. The sidecar file next to it records how many rows are
+// on disk for which location and size, so an interrupted render can pick up where it stopped.
+typedef struct BandOutput_t {
+    FILE *f;
+    char *sidecar; // <out>.resume
+    uint64_t hash; // params_hash of the location
+    uint32_t width, height;
+} BandOutput_t;
+
+bool write_band_sidecar(BandOutput_t *out, uint32_t rows) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", out->sidecar);
+    FILE *f = fopen(tmp, "w");
+    if(f == NULL) { return false; }
+    fprintf(f, "%016" PRIx64 " %u %u %u\n", out->hash, out->width, out->height, rows);
+    // replaced in one go, a crash leaves either the old or the new count
+    return fclose(f) == 0 && rename(tmp, out->sidecar) == 0;
+}
+
+// rows of the output that were written for this location and size, 0 if there's nothing to resume
+uint32_t read_band_sidecar(BandOutput_t *out) {
+    FILE *f = fopen(out->sidecar, "r");
+    if(f == NULL) { return 0; }
+    uint64_t hash;
+    uint32_t width, height, rows;
+    bool match = fscanf(f, "%" SCNx64 " %u %u %u", &hash, &width, &height, &rows) == 4
+        && hash == out->hash && width == out->width && height == out->height && rows <= height;
+    fclose(f);
+    return match ? rows : 0;
+}
+
+bool write_band(Image *band, uint32_t y0, BandOutput_t *out) {
+    // the rows have to be on disk before the sidecar says so
+    bool ok = write_rgb(band, out->f) && fflush(out->f) == 0 && fdatasync(fileno(out->f)) == 0
+        && write_band_sidecar(out, y0 + band->height);
+    if(!ok) {
+        printf("writing rows %u to %u failed\n", y0, y0 + band->height);
+    } else {
+        printf("rows %u of %u written\n", y0 + band->height, out->height);
+    }
+    return ok;
+}
+
+// Render the frame in bands that fit the memory budget, streaming them to a PPM file
+int render_banded(CliOptions_t *o) {
+    const char *ext = strrchr(o->out, '.');
+    if(ext == NULL || strcmp(ext, ".ppm") != 0) {
+        printf("banded renders are streamed to a .ppm file (or a .dzi pyramid), not %s\n", o->out);
+        return 1;
+    }
+    if(o->opts.guess) {
+        printf("--guess needs the whole frame, ignored for banded renders\n");
+        o->opts.guess = false;
+    }
+    BandOutput_t out = {.hash = params_hash(&o->params), .width = o->width, .height = o->height};
+    printf("location %016" PRIx64 "\n", out.hash);
+    size_t sidecar_len = strlen(o->out) + sizeof(".resume");
+    out.sidecar = malloc(sidecar_len);
+    snprintf(out.sidecar, sidecar_len, "%s.resume", o->out);
+
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "P6\n%u %u\n255\n", o->width, o->height);
+    uint32_t first_row = o->resume ? read_band_sidecar(&out) : 0;
+    if(first_row > 0) {
+        out.f = fopen(o->out, "r+b");
+        off_t rows_end = header_len + (off_t)first_row * o->width * 3;
+        // drop anything after the last complete band
+        if(out.f == NULL || ftruncate(fileno(out.f), rows_end) != 0 || fseeko(out.f, rows_end, SEEK_SET) != 0) {
+            printf("can't resume %s, starting over\n", o->out);
+            if(out.f != NULL) { fclose(out.f); }
+            first_row = 0;
+        } else {
+            printf("resuming at row %u of %u\n", first_row, o->height);
+        }
+    }
+    if(first_row == 0) {
+        out.f = fopen(o->out, "wb");
+        if(out.f == NULL || fputs(header, out.f) == EOF) {
+            printf("can't write %s\n", o->out);
+            if(out.f != NULL) { fclose(out.f); }
+            free(out.sidecar);
+            return 1;
+        }
+    }
+
+    double start_ms = render_time_ms();
+    FractalSetup_t setup;
+    if(!fractal_setup_init(&setup, &o->params)) {
+        fclose(out.f);
+        free(out.sidecar);
+        return 1;
+    }
+    printf("reference orbit: %.2f ms\n", render_time_ms() - start_ms);
+
+    RenderPool_t pool;
+    render_pool_init(&pool, o->placement);
+    uint32_t band_rows = band_rows_for_budget(o->width, o->memory);
+    printf("%u rows per band\n", band_rows);
+    RenderOptions_t opts = o->opts;
+    opts.palette = o->params.palette;
+    bool ok = band_render(&pool, &setup, opts, o->width, o->height, first_row, band_rows, (BandSink) &write_band, &out);
+    printf("total: %.2f ms\n", render_time_ms() - start_ms);
+
+    render_pool_destroy(&pool);
+    fractal_setup_free(&setup);
+    if(fclose(out.f) != 0) { ok = false; }
+    if(ok) { remove(out.sidecar); }
+    free(out.sidecar);
+    return ok ? 0 : 1;
+}
+
+bool write_pyramid_band(Image *band, uint32_t y0, DziPyramid_t *pyramid) {
+    bool ok = dzi_add_image(pyramid, band);
+    printf("rows %u to %u added, %" PRIu64 " tiles written\n", y0, y0 + band->height, pyramid->tiles_written);
+    return ok;
+}
+
+// Render the frame in bands of whole tile rows into a DZI pyramid, the tiles of all levels are written as the bands finish
+int render_pyramid(CliOptions_t *o) {
+    if(o->opts.guess) {
+        printf("--guess needs the whole frame, ignored for pyramid renders\n");
+        o->opts.guess = false;
+    }
+    printf("location %016" PRIx64 "\n", params_hash(&o->params));
+    DziPyramid_t pyramid;
+    if(!dzi_init(&pyramid, o->out, o->width, o->height, o->tile_size, o->tile_format, &write_image)) {
+        return 1;
+    }
+    printf("%u levels of %u pixel tiles in %s\n", pyramid.max_level + 1, o->tile_size, pyramid.dir);
+
+    double start_ms = render_time_ms();
+    FractalSetup_t setup;
+    if(!fractal_setup_init(&setup, &o->params)) {
+        dzi_free(&pyramid);
+        return 1;
+    }
+    printf("reference orbit: %.2f ms\n", render_time_ms() - start_ms);
+
+    RenderPool_t pool;
+    render_pool_init(&pool, o->placement);
+    uint32_t band_rows = band_rows_for_budget(o->width, o->memory > 0 ? o->memory : DZI_DEFAULT_MEMORY);
+    // bands end on tile rows, so every band completes whole tiles
+    band_rows = band_rows < o->tile_size ? o->tile_size : band_rows - band_rows % o->tile_size;
+    printf("%u rows per band\n", band_rows);
+    RenderOptions_t opts = o->opts;
+    opts.palette = o->params.palette;
+    bool ok = band_render(&pool, &setup, opts, o->width, o->height, 0, band_rows, (BandSink) &write_pyramid_band, &pyramid);
+    printf("%" PRIu64 " tiles, total: %.2f ms\n", pyramid.tiles_written, render_time_ms() - start_ms);
+
+    render_pool_destroy(&pool);
+    fractal_setup_free(&setup);
+    dzi_free(&pyramid);
+    return ok ? 0 : 1;
+}
+
+// where and how often a single frame render is checkpointed
+typedef struct CheckpointOutput_t {
+    const char *path; // NULL for no checkpoints
+    uint64_t hash;
+    const RefIter *ref; // NULL without a reference orbit
+    double interval_ms;
+    double last_ms; // render_time_ms() of the last checkpoint
+} CheckpointOutput_t;
+
+volatile sig_atomic_t interrupted = 0;
+
+void on_interrupt(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+// Run one render job to the end, checkpointing on the way.
+// Returns false if the render got interrupted, after writing a last checkpoint.
+bool render_wait(FractalRenderer_t *r, CheckpointOutput_t *ckpt) {
+    struct timespec poll = {0, RENDER_POLL_NS};
+    while(renderer_update(r) != FINISHED) {
+        if(interrupted) {
+            // cancelled kernels stop within CANCEL_CHECK_INTERVAL iterations instead of finishing their tiles
+            renderer_cancel(r);
+            renderer_wait(r);
+            if(ckpt->path != NULL) { checkpoint_write(ckpt->path, ckpt->hash, r->buf, ckpt->ref); }
+            return false;
+        }
+        if(ckpt->path != NULL && render_time_ms() - ckpt->last_ms >= ckpt->interval_ms) {
+            checkpoint_write(ckpt->path, ckpt->hash, r->buf, ckpt->ref);
+            ckpt->last_ms = render_time_ms();
+        }
+        nanosleep(&poll, NULL);
+    }
+    r->state = IDLE;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    CliOptions_t o = {
+        .save_params = NULL,
+        .width = 1920,
+        .height = 1080,
+        .out = "fractal.png",
+        .placement = {.n_threads = 0, .pin = true, .skip_smt = true, .reserved_cpus = 0},
+        .opts = {.adaptive = false, .guess = false, .order = TILE_ORDER_ROWS},
+        .frames = 0,
+        .zoom_start = 1.0,
+        .exp_map = false,
+        .memory = 0,
+        .resume = false,
+        .tile_size = 256,
+        .tile_format = "png",
+        .compress = false,
+        .checkpoint = NULL,
+        .checkpoint_interval = CHECKPOINT_DEFAULT_INTERVAL,
+    };
+    params_default(&o.params);
+    if(!parse_options(argc, argv, &o) || (o.save_params != NULL && !params_save(&o.params, o.save_params))) {
+        params_free(&o.params);
+        return 1;
+    }
+    const char *ext = strrchr(o.out, '.');
+    bool dzi = ext != NULL && strcmp(ext, ".dzi") == 0;
+    bool raw = ext != NULL && strcmp(ext, ".gfr") == 0;
+    if(raw && (o.frames > 0 || o.memory > 0)) {
+        printf(".gfr output is only written for single frames rendered at once\n");
+        params_free(&o.params);
+        return 1;
+    }
+    if(o.opts.antialias > 0 && (o.frames > 0 || o.memory > 0 || dzi || raw)) {
+        printf("--antialias only applies to the colours of single frames rendered at once, ignored\n");
+        o.opts.antialias = 0;
+    }
+    if(o.frames > 0 || o.memory > 0 || dzi) {
+        int status = o.frames > 0 ? render_sequence(&o) : dzi ? render_pyramid(&o) : render_banded(&o);
+        params_free(&o.params);
+        return status;
+    }
+    uint64_t hash = params_hash(&o.params);
+    printf("location %016" PRIx64 "\n", hash);
+
+    double start_ms = render_time_ms();
+    Checkpoint_t resumed = {NULL, NULL, NULL};
+    if(o.checkpoint != NULL && o.resume && checkpoint_read(o.checkpoint, hash, o.width, o.height, &resumed)) {
+        printf("resuming from checkpoint %s\n", o.checkpoint);
+    }
+    FractalSetup_t setup;
+    if(!fractal_setup_init_with_ref(&setup, &o.params, resumed.ref_re, resumed.ref_im)) {
+        if(resumed.buf != NULL) { fractal_buffer_release(resumed.buf); }
+        params_free(&o.params);
+        return 1;
+    }
+    double ref_ms = render_time_ms();
+
+    FractalRenderer_t renderer;
+    renderer_init(&renderer, fractal_setup_fn(&setup), fractal_setup_cfg(&setup), o.placement);
+    renderer.opts = o.opts;
+    renderer.opts.palette = o.params.palette;
+    renderer.opts.sample_info = raw;
+    // samples known from the checkpoint aren't computed again
+    renderer.buf = resumed.buf != NULL ? resumed.buf : fractal_buffer_create(o.width, o.height);
+    fractal_buffer_redraw(renderer.buf, o.params.palette);
+
+    CheckpointOutput_t ckpt = {
+        .path = o.checkpoint,
+        .hash = hash,
+        .ref = setup.kernel == KERNEL_PERTURB ? &setup.ref : NULL,
+        .interval_ms = o.checkpoint_interval * 1000.0,
+        .last_ms = render_time_ms()
+    };
+    if(ckpt.path != NULL) {
+        signal(SIGINT, &on_interrupt);
+        signal(SIGTERM, &on_interrupt);
+        // the reference orbit is kept from the start
+        if(resumed.buf == NULL) { checkpoint_write(ckpt.path, hash, renderer.buf, ckpt.ref); }
+    }
+
+    uint64_t kernel_calls = 0;
+    bool done = true;
+    if(o.opts.guess) {
+        // guesses need the coarser lattice, start at step 4
+        for(uint32_t step = 4; step >= 1 && done; step /= 2) {
+            renderer_startRender(&renderer, o.width, o.height, step);
+            done = render_wait(&renderer, &ckpt);
+            kernel_calls += renderer.last_kernel_calls;
+        }
+        while(done) {
+            renderer_startVerify(&renderer);
+            done = render_wait(&renderer, &ckpt);
+            kernel_calls += renderer.last_kernel_calls;
+            if(renderer.last_corrected == 0) { break; }
+        }
+    } else {
+        renderer_startRender(&renderer, o.width, o.height, 1);
+        done = render_wait(&renderer, &ckpt);
+        kernel_calls += renderer.last_kernel_calls;
+    }
+    if(done && o.opts.antialias > 0) {
+        // only the edges get sub-samples, flat regions cost nothing more
+        renderer_startAntialias(&renderer);
+        done = render_wait(&renderer, &ckpt);
+        kernel_calls += renderer.last_kernel_calls;
+    }
+    if(!done) {
+        // only possible with a checkpoint, the signals aren't caught otherwise
+        printf("interrupted, run again with --resume to continue from %s\n", ckpt.path);
+        renderer_destroy(&renderer);
+        fractal_setup_free(&setup);
+        params_free(&o.params);
+        return 1;
+    }
+    double render_ms = render_time_ms();
+
+    bool ok;
+    if(raw) {
+        char *params_text = params_to_str(&o.params);
+        ok = raw_write(o.out, renderer.buf, params_text, o.compress, renderer.n_threads);
+        free(params_text);
+    } else {
+        ok = write_image(renderer.buf->image, o.out);
+    }
+    if(ok && o.checkpoint != NULL) { remove(o.checkpoint); }
+    double write_ms = render_time_ms();
+
+    printf("reference orbit: %.2f ms\n", ref_ms - start_ms);
+    printf("render: %.2f ms, %" PRIu64 " of %" PRIu64 " samples computed on %u threads\n",
+           render_ms - ref_ms, kernel_calls, (uint64_t)o.width * o.height, renderer.n_threads);
+    printf("write %s: %.2f ms%s\n", o.out, write_ms - render_ms, ok ? "" : " FAILED");
+    printf("total: %.2f ms\n", write_ms - start_ms);
+
+    renderer_destroy(&renderer);
+    fractal_setup_free(&setup);
+    params_free(&o.params);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+// Recolouring tool: colours the raw render data (.gfr) the command line renderer writes with -o x.gfr into an image,
+// so palettes can be tried out without rendering again.
+// Only raylib's CPU side image functions are used, no window or GL context is created.
+#include <getopt.h>
+#include "draw_fractal.h"
+#include "fractal_params.h"
+#include "raw_format.h"
+#include "image_io.h"
+
+typedef struct RecolorOptions_t {
+    const char *in;
+    const char *out;
+    int palette; // -1: the palette of the render
+    bool smooth; // blend between iterations using the smooth iteration counts
+    bool glitches; // paint samples the kernel flagged as glitched magenta
+    bool distance; // darken samples closer to the set than DISTANCE_SHADE_PIXELS
+} RecolorOptions_t;
+
+#define DISTANCE_SHADE_PIXELS 2.0f // distance estimates overshoot by up to 4x, so the boundary fades in over a few pixels
+
+void print_usage(const char *name) {
+    printf("Usage: %s [options] <file.gfr>\n"
+           "  -c, --palette <name>     hsv, gray or fire, default the palette of the render\n"
+           "  -s, --smooth             smooth colouring from the fractional iteration counts\n"
+           "  -G, --glitches           paint glitched samples magenta\n"
+           "  -d, --distance           darken the boundary of the set using the distance estimates\n"
+           "  -o, --out <file>         output image, .ppm or .png, default recolor.png\n"
+           "      --help\n", name);
+}
+
+bool parse_options(int argc, char **argv, RecolorOptions_t *o) {
+    static const struct option long_options[] = {
+        {"palette", required_argument, NULL, 'c'},
+        {"smooth", no_argument, NULL, 's'},
+        {"glitches", no_argument, NULL, 'G'},
+        {"distance", no_argument, NULL, 'd'},
+        {"out", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'H'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+    while((c = getopt_long(argc, argv, "c:sGdo:", long_options, NULL)) != -1) {
+        switch(c) {
+        case 'c':
+            o->palette = -1;
+            for(int i = 0; i < N_PALETTES; ++i) {
+                if(strcmp(optarg, PALETTE_NAMES[i]) == 0) { o->palette = i; }
+            }
+            if(o->palette < 0) {
+                printf("unknown palette %s\n", optarg);
+                return false;
+            }
+            break;
+        case 's': o->smooth = true; break;
+        case 'G': o->glitches = true; break;
+        case 'd': o->distance = true; break;
+        case 'o': o->out = optarg; break;
+        case 'H':
+            print_usage(argv[0]);
+            exit(0);
+        default:
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    if(optind != argc - 1) {
+        print_usage(argv[0]);
+        return false;
+    }
+    o->in = argv[optind];
+    return true;
+}
+
+// colour the tiles of the file into image, returns false if a tile is damaged
+bool recolor(RawFile_t *raw, const RecolorOptions_t *o, Palette_t palette, Image *image) {
+    const RawHeader_t *h = raw->header;
+    Color *pixels = (Color*)image->data;
+    bool smooth = o->smooth && (h->channels & RAW_CH_SMOOTH);
+    bool glitches = o->glitches && (h->channels & RAW_CH_FLAGS);
+    bool distance = o->distance && (h->channels & RAW_CH_DISTANCE);
+    if(o->distance && !distance) {
+        printf("%s has no distance estimates, not shading\n", o->in);
+    }
+    for(uint32_t i = 0; i < h->n_tiles; ++i) {
+        PixelRect_t r = raw_tile_rect(h, i);
+        uint32_t tw = r.x1 - r.x0;
+        uint8_t *scratch = NULL;
+        uint8_t *data = raw_tile(raw, i, &scratch);
+        if(data == NULL) {
+            printf("tile %u is damaged\n", i);
+            return false;
+        }
+        RawTileData_t t = raw_tile_arrays(h->channels, data, tw * (r.y1 - r.y0));
+        for(uint32_t y = r.y0; y < r.y1; ++y) {
+            for(uint32_t x = r.x0; x < r.x1; ++x) {
+                size_t ti = (size_t)(y - r.y0) * tw + (x - r.x0);
+                Color c;
+                if(glitches && (t.flags[ti] & SAMPLE_GLITCH)) {
+                    c = MAGENTA;
+                } else if(smooth) {
+                    c = paletteColorSmooth(palette, t.iters[ti], t.smooth[ti]);
+                } else {
+                    c = paletteColor(palette, t.iters[ti]);
+                }
+                // guessed and filled samples have no estimate of their own (distance 0), they keep the plain colour
+                // rather than being shaded black. Without the channel distance is off and t.distance NULL.
+                bool estimated = distance && t.iters[ti] != UINT32_MAX && t.distance[ti] > 0.0f
+                    && !(t.flags != NULL && (t.flags[ti] & SAMPLE_ESTIMATED));
+                if(estimated && t.distance[ti] < DISTANCE_SHADE_PIXELS) {
+                    float f = t.distance[ti] / DISTANCE_SHADE_PIXELS;
+                    c = (Color) {(unsigned char)(c.r * f), (unsigned char)(c.g * f), (unsigned char)(c.b * f), 255};
+                }
+                pixels[(size_t)y * h->width + x] = c;
+            }
+        }
+        if(scratch != NULL) { MemFree(scratch); }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    RecolorOptions_t o = {
+        .in = NULL,
+        .out = "recolor.png",
+        .palette = -1,
+        .smooth = false,
+        .glitches = false,
+        .distance = false,
+    };
+    if(!parse_options(argc, argv, &o)) { return 1; }
+
+    double start_ms = render_time_ms();
+    RawFile_t raw;
+    if(!raw_open(&raw, o.in)) { return 1; }
+    const RawHeader_t *h = raw.header;
+    if(!(h->channels & RAW_CH_ITERS)) {
+        printf("%s has no iteration counts\n", o.in);
+        raw_close(&raw);
+        return 1;
+    }
+
+    // the location the data was rendered at, for its palette
+    FractalParams_t params;
+    params_default(&params);
+    FILE *f = fmemopen((void*)raw.params, h->params_len, "r");
+    bool ok = f != NULL && params_read(&params, f, o.in);
+    if(f != NULL) { fclose(f); }
+    if(ok) {
+        printf("%u x %u render of location %016" PRIx64 "\n", h->width, h->height, params_hash(&params));
+        Image image = GenImageColor(h->width, h->height, BLACK);
+        Palette_t palette = o.palette >= 0 ? (Palette_t)o.palette : params.palette;
+        ok = recolor(&raw, &o, palette, &image);
+        double color_ms = render_time_ms();
+        ok = ok && write_image(&image, o.out);
+        printf("recolor: %.2f ms, write %s: %.2f ms%s\n", color_ms - start_ms, o.out, render_time_ms() - color_ms, ok ? "" : " FAILED");
+        UnloadImage(image);
+    }
+    params_free(&params);
+    raw_close(&raw);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,298 @@
+// Render server: keeps one pool of render threads, the reference orbits of recent locations and a tile cache warm
+// for several local clients at once (viewers, batch tools), instead of each of them starting its own renderer.
+// Clients connect to a Unix domain socket (or localhost TCP) and talk the protocol in server_protocol.h.
+// Only raylib's CPU side image functions are used, no window or GL context is created.
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "draw_fractal.h"
+#include "fractal_params.h"
+#include "render_server.h"
+#include "server_protocol.h"
+
+#define SERVER_MAX_CLIENTS 64
+#define SERVER_POLL_MS 5 // while requests are rendering, otherwise poll waits for the sockets
+#define SERVER_READ_CHUNK 65536
+#define SERVER_MAX_PARAMS_LEN 65536 // longest location parameters a request may have
+#define SERVER_MAX_THREADS 4096 // most render threads --threads asks for
+
+typedef struct ServerOptions_t {
+    const char *socket_path;
+    uint16_t port; // localhost TCP instead of the Unix socket if > 0
+    RenderPlacement_t placement;
+    RenderOptions_t opts;
+    uint64_t cache_mib;
+    uint32_t in_flight;
+} ServerOptions_t;
+
+void print_usage(const char *name) {
+    printf("Usage: %s [options]\n"
+           "  -S, --socket <path>      Unix domain socket to listen on, default gmpfract.sock\n"
+           "  -P, --port <port>        listen on localhost TCP instead\n"
+           "  -t, --threads <n>        render threads, 0 for one per core\n"
+           "  -a, --adaptive           Mariani-Silver adaptive rendering\n"
+           "  -C, --cache <MiB>        tile cache budget, default 1024\n"
+           "  -j, --in-flight <n>      requests rendering at once, default 2\n"
+           "      --help\n", name);
+}
+
+// Parse optarg of option name as a decimal number in min..max. Prints why and returns false if it isn't one.
+bool parse_number(const char *name, const char *arg, uint64_t min, uint64_t max, uint64_t *value) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if(arg[0] < '0' || arg[0] > '9' || *end != '\0' || errno == ERANGE || n < min || n > max) {
+        printf("invalid %s %s, %" PRIu64 " to %" PRIu64 "\n", name, arg, min, max);
+        return false;
+    }
+    *value = n;
+    return true;
+}
+
+bool parse_options(int argc, char **argv, ServerOptions_t *o) {
+    static const struct option long_options[] = {
+        {"socket", required_argument, NULL, 'S'},
+        {"port", required_argument, NULL, 'P'},
+        {"threads", required_argument, NULL, 't'},
+        {"adaptive", no_argument, NULL, 'a'},
+        {"cache", required_argument, NULL, 'C'},
+        {"in-flight", required_argument, NULL, 'j'},
+        {"help", no_argument, NULL, 'H'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+    uint64_t n;
+    while((c = getopt_long(argc, argv, "S:P:t:aC:j:", long_options, NULL)) != -1) {
+        switch(c) {
+        case 'S': o->socket_path = optarg; break;
+        case 'P':
+            if(!parse_number("port", optarg, 1, UINT16_MAX, &n)) { return false; }
+            o->port = n;
+            break;
+        case 't':
+            if(!parse_number("thread count", optarg, 0, SERVER_MAX_THREADS, &n)) { return false; }
+            o->placement.n_threads = n;
+            break;
+        case 'a': o->opts.adaptive = true; break;
+        case 'C':
+            // in bytes it has to fit as well
+            if(!parse_number("cache size", optarg, 0, UINT64_MAX >> 20, &n)) { return false; }
+            o->cache_mib = n;
+            break;
+        case 'j':
+            if(!parse_number("request count", optarg, 1, UINT32_MAX, &n)) { return false; }
+            o->in_flight = n;
+            break;
+        case 'H':
+            print_usage(argv[0]);
+            exit(0);
+        default:
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    if(optind != argc) {
+        print_usage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+volatile sig_atomic_t interrupted = 0;
+
+void on_interrupt(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+// listening socket, -1 on failure
+int server_listen(const ServerOptions_t *o) {
+    int fd;
+    if(o->port > 0) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(o->port)};
+        // local clients only
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if(fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+            printf("can't listen on localhost:%u: %s\n", o->port, strerror(errno));
+            if(fd >= 0) { close(fd); }
+            return -1;
+        }
+        printf("listening on localhost:%u\n", o->port);
+    } else {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if(strlen(o->socket_path) >= sizeof(addr.sun_path)) {
+            printf("socket path %s is too long\n", o->socket_path);
+            return -1;
+        }
+        strcpy(addr.sun_path, o->socket_path);
+        // a socket left behind by a server that didn't shut down
+        unlink(o->socket_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+            printf("can't listen on %s: %s\n", o->socket_path, strerror(errno));
+            if(fd >= 0) { close(fd); }
+            return -1;
+        }
+        printf("listening on %s\n", o->socket_path);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Hand the complete messages in the client's input to the server. Returns false if the client sent garbage.
+bool server_handle_input(RenderServer_t *s, ServerClient_t *c) {
+    size_t pos = 0;
+    bool ok = true;
+    while(ok && c->in_len - pos >= sizeof(RequestHeader_t)) {
+        RequestHeader_t h;
+        memcpy(&h, c->in + pos, sizeof(h));
+        if(h.magic != REQUEST_MAGIC || h.params_len > SERVER_MAX_PARAMS_LEN) {
+            ok = false;
+            break;
+        }
+        if(c->in_len - pos < sizeof(h) + h.params_len) { break; }
+        const char *params = (const char*)c->in + pos + sizeof(h);
+        if(h.type == REQ_RENDER) {
+            server_submit(s, c, &h, params);
+        } else if(h.type == REQ_CANCEL) {
+            server_cancel(s, c, h.id);
+        } else {
+            server_reply_error(c, h.id, "unknown request type");
+        }
+        pos += sizeof(h) + h.params_len;
+    }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    return ok;
+}
+
+// read what the client sent, returns false once it's gone
+bool server_read(RenderServer_t *s, ServerClient_t *c) {
+    while(1) {
+        if(c->in_cap - c->in_len < SERVER_READ_CHUNK) {
+            uint8_t *in = realloc(c->in, c->in_len + SERVER_READ_CHUNK);
+            if(in == NULL) { return false; }
+            c->in = in;
+            c->in_cap = c->in_len + SERVER_READ_CHUNK;
+        }
+        ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+        if(n == 0) { return false; }
+        if(n < 0) { return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR; }
+        c->in_len += n;
+        if(!server_handle_input(s, c)) {
+            printf("client %i sent an invalid message, disconnecting\n", c->fd);
+            return false;
+        }
+    }
+}
+
+// send as much of the client's output as the socket takes, returns false once it's gone
+bool server_write(ServerClient_t *c) {
+    while(c->out.sent < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->out.sent, c->out.len - c->out.sent, MSG_NOSIGNAL);
+        if(n < 0) { return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR; }
+        server_output_consumed(&c->out, n);
+    }
+    return true;
+}
+
+void server_client_free(RenderServer_t *s, ServerClient_t *c) {
+    printf("client %i disconnected\n", c->fd);
+    server_client_gone(s, c);
+    close(c->fd);
+    free(c->in);
+    free(c->out.data);
+    free(c);
+}
+
+int main(int argc, char **argv) {
+    ServerOptions_t o = {
+        .socket_path = "gmpfract.sock",
+        .port = 0,
+        .placement = {.n_threads = 0, .pin = true, .skip_smt = true, .reserved_cpus = 0},
+        .opts = {.adaptive = false, .guess = false, .order = TILE_ORDER_SPIRAL},
+        .cache_mib = 1024,
+        .in_flight = 2,
+    };
+    if(!parse_options(argc, argv, &o)) { return 1; }
+    int listen_fd = server_listen(&o);
+    if(listen_fd < 0) { return 1; }
+    signal(SIGINT, &on_interrupt);
+    signal(SIGTERM, &on_interrupt);
+
+    RenderServer_t server;
+    server_init(&server, o.placement, o.opts, o.cache_mib << 20, o.in_flight);
+    ServerClient_t *clients[SERVER_MAX_CLIENTS];
+    uint32_t n_clients = 0;
+    struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+    bool busy = false;
+    while(!interrupted) {
+        fds[0] = (struct pollfd) {.fd = listen_fd, .events = n_clients < SERVER_MAX_CLIENTS ? POLLIN : 0};
+        for(uint32_t i = 0; i < n_clients; ++i) {
+            // a client that doesn't read its replies isn't read from either, so its output stays near the cap
+            size_t queued = server_output_queued(&clients[i]->out);
+            short events = (queued < SERVER_MAX_OUTPUT ? POLLIN : 0) | (queued > 0 ? POLLOUT : 0);
+            fds[i + 1] = (struct pollfd) {.fd = clients[i]->fd, .events = events};
+        }
+        if(poll(fds, n_clients + 1, busy ? SERVER_POLL_MS : -1) < 0 && errno != EINTR) {
+            printf("poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        uint32_t kept = 0;
+        for(uint32_t i = 0; i < n_clients; ++i) {
+            ServerClient_t *c = clients[i];
+            bool alive = !(fds[i + 1].revents & (POLLERR | POLLNVAL));
+            if(alive && (fds[i + 1].revents & (POLLIN | POLLHUP))) {
+                alive = server_read(&server, c);
+            }
+            if(alive) {
+                clients[kept++] = c;
+            } else {
+                server_client_free(&server, c);
+            }
+        }
+        n_clients = kept;
+        if(fds[0].revents & POLLIN) {
+            int fd;
+            while(n_clients < SERVER_MAX_CLIENTS && (fd = accept(listen_fd, NULL, NULL)) >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                ServerClient_t *c = calloc(1, sizeof(ServerClient_t));
+                c->fd = fd;
+                clients[n_clients++] = c;
+                printf("client %i connected\n", fd);
+            }
+        }
+
+        busy = server_update(&server);
+        // replies queued by this round go out right away, whatever doesn't fit waits for POLLOUT
+        kept = 0;
+        for(uint32_t i = 0; i < n_clients; ++i) {
+            if(!clients[i]->failed && server_write(clients[i])) {
+                clients[kept++] = clients[i];
+            } else {
+                server_client_free(&server, clients[i]);
+            }
+        }
+        n_clients = kept;
+    }
+
+    printf("shutting down\n");
+    for(uint32_t i = 0; i < n_clients; ++i) {
+        server_client_free(&server, clients[i]);
+    }
+    server_destroy(&server);
+    close(listen_fd);
+    if(o.port == 0) { unlink(o.socket_path); }
+    return 0;
+}